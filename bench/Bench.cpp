@@ -0,0 +1,139 @@
+#include "Bench.h"
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const int MAX_BENCHMARKS = 64;
+static const int REPETITIONS = 5;
+static const int64_t MIN_RUN_NS = 20000000LL;
+static const size_t MAX_ITERATIONS = 1 << 24;
+
+static uint64_t gAllocations = 0;
+
+static struct {
+    const char* name;
+    BenchFunction fn;
+} gBenchmarks[MAX_BENCHMARKS];
+static int gBenchmarkCount = 0;
+
+// --- Allocation counting ---
+
+void* operator new(size_t size) throw(std::bad_alloc) {
+    gAllocations++;
+    void* p = malloc(size ? size : 1);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size) throw(std::bad_alloc) {
+    gAllocations++;
+    void* p = malloc(size ? size : 1);
+    if(!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw() {
+    free(p);
+}
+
+void operator delete[](void* p) throw() {
+    free(p);
+}
+
+uint64_t bench_allocations() {
+    return gAllocations;
+}
+
+void bench_use(const void* p) {
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+static int64_t now_ns() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// --- BenchState ---
+
+void BenchState::pause() {
+    if(mRunning) {
+        mElapsed += now_ns() - mStart;
+        mAllocs += gAllocations - mAllocStart;
+        mRunning = false;
+    }
+}
+
+void BenchState::resume() {
+    if(!mRunning) {
+        mAllocStart = gAllocations;
+        mStart = now_ns();
+        mRunning = true;
+    }
+}
+
+BenchRegistrar::BenchRegistrar(const char* name, BenchFunction fn) {
+    if(gBenchmarkCount < MAX_BENCHMARKS) {
+        gBenchmarks[gBenchmarkCount].name = name;
+        gBenchmarks[gBenchmarkCount].fn = fn;
+        gBenchmarkCount++;
+    }
+}
+
+class BenchRunner {
+public:
+    static void run(BenchFunction fn, size_t iterations, int64_t* elapsed, uint64_t* allocs) {
+        BenchState state;
+        state.iterations = iterations;
+        state.mElapsed = 0;
+        state.mAllocs = 0;
+        state.mRunning = false;
+        state.resume();
+        fn(state);
+        state.pause();
+        *elapsed = state.mElapsed;
+        *allocs = state.mAllocs;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    const char* filter = argc > 1 ? argv[1] : NULL;
+
+    printf("%-32s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+    for(int b = 0; b < gBenchmarkCount; b++) {
+        if(filter && !strstr(gBenchmarks[b].name, filter)) {
+            continue;
+        }
+
+        int64_t elapsed;
+        uint64_t allocs;
+
+        // Grow the iteration count until a run is long enough to time reliably
+        size_t iterations = 1;
+        while(1) {
+            BenchRunner::run(gBenchmarks[b].fn, iterations, &elapsed, &allocs);
+            if(elapsed >= MIN_RUN_NS || iterations >= MAX_ITERATIONS) {
+                break;
+            }
+            iterations *= 2;
+        }
+
+        // Keep the fastest repetition
+        int64_t best = elapsed;
+        uint64_t bestAllocs = allocs;
+        for(int r = 0; r < REPETITIONS; r++) {
+            BenchRunner::run(gBenchmarks[b].fn, iterations, &elapsed, &allocs);
+            if(elapsed < best) {
+                best = elapsed;
+                bestAllocs = allocs;
+            }
+        }
+
+        printf("%-32s %12lu %12.1f %12.2f\n", gBenchmarks[b].name, (unsigned long)iterations,
+                double(best) / iterations, double(bestAllocs) / iterations);
+        fflush(stdout);
+    }
+    return 0;
+}
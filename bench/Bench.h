@@ -0,0 +1,43 @@
+#ifndef BENCH
+#define BENCH
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Minimal microbenchmark harness.  A benchmark function is handed a BenchState
+ * and must perform state.iterations operations; setup that shouldn't be counted
+ * goes between pause() and resume().  The harness picks the iteration count,
+ * repeats the run and reports the fastest ns/op along with heap allocations per
+ * operation, so results are stable enough to track over time. */
+class BenchState {
+public:
+    size_t iterations;
+
+    void pause();
+    void resume();
+
+private:
+    friend class BenchRunner;
+    int64_t mStart;
+    int64_t mElapsed;
+    uint64_t mAllocStart;
+    uint64_t mAllocs;
+    bool mRunning;
+};
+
+typedef void (*BenchFunction)(BenchState &state);
+
+class BenchRegistrar {
+public:
+    BenchRegistrar(const char* name, BenchFunction fn);
+};
+
+#define BENCHMARK(fn) static BenchRegistrar registrar_##fn(#fn, fn)
+
+// Heap allocations made so far by this process
+uint64_t bench_allocations();
+
+// Keeps the compiler from discarding a computed value
+void bench_use(const void* p);
+
+#endif // BENCH
@@ -0,0 +1,295 @@
+#include "Bench.h"
+#include "Message.h"
+#include "InputMessenger.h"
+#include "TouchPanel.h"
+#include "TraceCodec.h"
+#include "MessageFormat.h"
+#include "ReplayCompiler.h"
+#include <algorithm>
+#include <math.h>
+
+// Benchmarks for the record and replay hot paths
+
+static const int TRACE_LENGTH = 512;
+static const int SCREEN_WIDTH = 360;
+static const int SCREEN_HEIGHT = 640;
+
+static int null_fd() {
+    static int fd = -1;
+    if(fd < 0) {
+        fd = open("/dev/null", O_RDWR);
+    }
+    return fd;
+}
+
+static void panel_axes(input_absinfo* xInfo, input_absinfo* yInfo) {
+    memset(xInfo, 0, sizeof(*xInfo));
+    memset(yInfo, 0, sizeof(*yInfo));
+    xInfo->maximum = 1079;
+    yInfo->maximum = 1919;
+}
+
+// Two fingers moving in parallel, one frame per timestamp
+static Message trace_message(int i) {
+    int frame = i / 2;
+    int finger = i % 2;
+    return Message::Sync(1000 + frame * 8, 100 + finger, 50 + finger * 100 + frame % 200, 100 + frame % 400);
+}
+
+// Curved one finger strokes of 64 samples, each ending in a stop
+static Message stroke_message(int i) {
+    int stroke = i / 65;
+    int sample = i % 65;
+    int32_t timestamp = 1000 + stroke * 600 + sample * 8;
+    if(sample == 64) {
+        return Message::Stop(timestamp, stroke);
+    }
+    double u = sample / 64.0;
+    return Message::Sync(timestamp, stroke, 50 + (int)(200 * u + 40 * sin(3 * u)), 100 + (int)(400 * u * u));
+}
+
+static void message_fromString(BenchState &state) {
+    std::string line("sync 4118 85 215 399");
+    Message msg;
+    for(size_t i = 0; i < state.iterations; i++) {
+        Message::fromString(line, msg);
+        bench_use(&msg);
+    }
+}
+BENCHMARK(message_fromString);
+
+static void message_dump(BenchState &state) {
+    Message msg = Message::Sync(4118, 85, 215, 399);
+    int fd = null_fd();
+    for(size_t i = 0; i < state.iterations; i++) {
+        msg.dump(fd);
+    }
+}
+BENCHMARK(message_dump);
+
+// The serializers against the old stdio path.  One operation is one message
+// written out; the serializers write to a buffer, so they skip the syscall too.
+static void serialize_fprintf(BenchState &state) {
+    state.pause();
+    FILE* out = fopen("/dev/null", "w");
+    state.resume();
+    for(size_t i = 0; i < state.iterations; i++) {
+        Message msg = trace_message(i % TRACE_LENGTH);
+        fprintf(out, "sync %d %d %d %d\n", msg.getTimestamp(), msg.getTrackingID(), msg.getX(), msg.getY());
+    }
+    state.pause();
+    fclose(out);
+    state.resume();
+}
+BENCHMARK(serialize_fprintf);
+
+static void serialize_snprintf(BenchState &state) {
+    char buf[MAX_SERIALIZED_LENGTH];
+    for(size_t i = 0; i < state.iterations; i++) {
+        Message msg = trace_message(i % TRACE_LENGTH);
+        int len = snprintf(buf, sizeof(buf), "sync %d %d %d %d\n",
+                msg.getTimestamp(), msg.getTrackingID(), msg.getX(), msg.getY());
+        bench_use(buf + len);
+    }
+}
+BENCHMARK(serialize_snprintf);
+
+template<class Format>
+static void serialize_format(BenchState &state) {
+    char buf[MAX_SERIALIZED_LENGTH];
+    for(size_t i = 0; i < state.iterations; i++) {
+        Message msg = trace_message(i % TRACE_LENGTH);
+        int len = serializeMessage<Format>(msg, buf, sizeof(buf));
+        bench_use(buf + len);
+    }
+}
+
+static void serialize_text(BenchState &state) { serialize_format<TextFormat>(state); }
+static void serialize_csv(BenchState &state) { serialize_format<CsvFormat>(state); }
+static void serialize_jsonl(BenchState &state) { serialize_format<JsonFormat>(state); }
+static void serialize_fixed(BenchState &state) { serialize_format<FixedFormat>(state); }
+BENCHMARK(serialize_text);
+BENCHMARK(serialize_csv);
+BENCHMARK(serialize_jsonl);
+BENCHMARK(serialize_fixed);
+
+// One operation is one line read and parsed from a file
+static void messenger_fill_queue(BenchState &state) {
+    state.pause();
+    FILE* trace = tmpfile();
+    for(size_t i = 0; i < state.iterations; i++) {
+        char line[Message::MAX_TEXT_LENGTH];
+        int len = trace_message(i).format(line, sizeof(line));
+        fwrite(line, 1, len, trace);
+    }
+    fflush(trace);
+    lseek(fileno(trace), 0, SEEK_SET);
+    InputMessenger* messenger = new InputMessenger();
+    messenger->setInFD(fileno(trace));
+    state.resume();
+
+    messenger->fill_queue();
+
+    state.pause();
+    delete messenger;
+    fclose(trace);
+    state.resume();
+}
+BENCHMARK(messenger_fill_queue);
+
+static void messenger_dequeue(BenchState &state) {
+    state.pause();
+    InputMessenger* messenger = new InputMessenger();
+    for(size_t i = 0; i < state.iterations; i++) {
+        messenger->add_msg(Message::Sync(1000, 85, i, i));
+    }
+    state.resume();
+
+    Message msg;
+    while(messenger->dequeue(1, msg)) {
+        bench_use(&msg);
+    }
+
+    state.pause();
+    delete messenger;
+    state.resume();
+}
+BENCHMARK(messenger_dequeue);
+
+// One operation is one input_event
+static void touchpanel_process(BenchState &state) {
+    state.pause();
+    input_event events[TRACE_LENGTH * 7];
+    int count = 0;
+    for(int frame = 0; frame < TRACE_LENGTH; frame++) {
+        for(int finger = 0; finger < 2; finger++) {
+            input_event* ev = &events[count];
+            memset(ev, 0, 3 * sizeof(*ev));
+            ev[0].type = EV_ABS; ev[0].code = ABS_MT_SLOT; ev[0].value = finger;
+            ev[1].type = EV_ABS; ev[1].code = ABS_MT_POSITION_X; ev[1].value = 100 + finger * 300 + frame;
+            ev[2].type = EV_ABS; ev[2].code = ABS_MT_POSITION_Y; ev[2].value = 200 + frame;
+            count += 3;
+        }
+        memset(&events[count], 0, sizeof(events[count]));
+        events[count].type = EV_SYN;
+        events[count].code = SYN_REPORT;
+        events[count].time.tv_usec = frame * 8000;
+        count++;
+    }
+
+    InputMessenger messenger;
+    messenger.setOutFD(null_fd());
+    TouchPanel panel("null", 4, &messenger, SCREEN_WIDTH, SCREEN_HEIGHT);
+    input_absinfo xInfo, yInfo;
+    panel_axes(&xInfo, &yInfo);
+    panel.configureAxes(xInfo, yInfo);
+    state.resume();
+
+    for(size_t i = 0; i < state.iterations; i++) {
+        panel.process(&events[i % count]);
+    }
+}
+BENCHMARK(touchpanel_process);
+
+// One operation is one replayed message
+static void touchpanel_replay(BenchState &state) {
+    state.pause();
+    Message msgs[TRACE_LENGTH];
+    for(int i = 0; i < TRACE_LENGTH; i++) {
+        msgs[i] = trace_message(i);
+    }
+
+    TouchPanel panel("null", 4, NULL, SCREEN_WIDTH, SCREEN_HEIGHT);
+    panel.attachDevice(null_fd(), true);
+    input_absinfo xInfo, yInfo;
+    panel_axes(&xInfo, &yInfo);
+    panel.configureAxes(xInfo, yInfo);
+    state.resume();
+
+    for(size_t i = 0; i < state.iterations; i++) {
+        panel.replay(msgs[i % TRACE_LENGTH], 0);
+    }
+    panel.flushFrame();
+}
+BENCHMARK(touchpanel_replay);
+
+// One operation is one frame written from a compiled replay, compare with
+// touchpanel_replay at two messages per frame
+static void compiled_replay(BenchState &state) {
+    state.pause();
+    std::string text;
+    char line[64];
+    for(int i = 0; i < TRACE_LENGTH; i++) {
+        int len = trace_message(i).format(line, sizeof(line));
+        text.append(line, len);
+    }
+    Trace trace;
+    trace.parse(text.data(), text.size());
+
+    TouchPanel panel("null", 4, NULL, SCREEN_WIDTH, SCREEN_HEIGHT);
+    panel.attachDevice(null_fd(), true);
+    input_absinfo xInfo, yInfo;
+    panel_axes(&xInfo, &yInfo);
+    panel.configureAxes(xInfo, yInfo);
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/touch_vcr_bench_%d.tvcr", (int)getpid());
+    ReplayCompiler::compile(trace, &panel, path);
+    DeviceProfile profile;
+    panel.getProfile(&profile);
+    state.resume();
+
+    for(size_t done = 0; done < state.iterations; ) {
+        CompiledReplay replay;
+        if(!replay.open(path, profile)) {
+            break;
+        }
+        nsecs_t now = 0;
+        while(done < state.iterations && !replay.isDone()) {
+            now = replay.nextDeadline(now);
+            replay.emit(now, null_fd());
+            done++;
+        }
+    }
+    unlink(path);
+}
+BENCHMARK(compiled_replay);
+
+// One operation is one message fitted into a stroke
+static void stroke_encode(BenchState &state) {
+    state.pause();
+    std::vector<Message> msgs;
+    for(int i = 0; i < TRACE_LENGTH * 2; i++) {
+        msgs.push_back(stroke_message(i));
+    }
+    std::vector<char> out;
+    state.resume();
+
+    for(size_t done = 0; done < state.iterations; done += msgs.size()) {
+        out.clear();
+        size_t count = std::min(msgs.size(), state.iterations - done);
+        TraceCodec::encode(FORMAT_STROKE, &msgs[0], count, out);
+        bench_use(&out[0]);
+    }
+}
+BENCHMARK(stroke_encode);
+
+// One operation is one message regenerated from strokes
+static void stroke_decode(BenchState &state) {
+    state.pause();
+    std::vector<Message> msgs;
+    for(int i = 0; i < TRACE_LENGTH * 2; i++) {
+        msgs.push_back(stroke_message(i));
+    }
+    std::vector<char> encoded;
+    TraceCodec::encode(FORMAT_STROKE, &msgs[0], msgs.size(), encoded);
+    msgs.reserve(msgs.size() * 2);
+    state.resume();
+
+    for(size_t done = 0; done < state.iterations; ) {
+        msgs.clear();
+        TraceCodec::decode(FORMAT_STROKE, &encoded[0], encoded.size(), msgs);
+        done += msgs.size();
+        bench_use(&msgs[0]);
+    }
+}
+BENCHMARK(stroke_decode);
@@ -0,0 +1,355 @@
+#include "Message.h"
+#include "TraceCodec.h"
+#include "ReplayCompiler.h"
+#include "StrokeWriter.h"
+#include <algorithm>
+#include <map>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Round-trip checks for the lossy and lossless trace encodings, run by ctest.
+// Each check prints what went wrong and returns false on the first mismatch.
+
+static const int TRACE_LENGTH = 10000;
+static const int SCREEN_WIDTH = 360;
+static const int SCREEN_HEIGHT = 640;
+
+// Two fingers crossing the screen with lifts, resets and jumps in every field,
+// long enough to span several packed blocks
+static Message mixed_message(int i) {
+    int frame = i / 3;
+    int32_t timestamp = 1000 + frame * 7 + (i % 3);
+    switch(i % 97) {
+    case 0:
+        return Message::Reset(timestamp);
+    case 41:
+        return Message::Stop(timestamp, frame % 5);
+    }
+    int32_t id = (frame + i) % 5;
+    return Message::Sync(timestamp, id, (frame * 37 + id * 611) % 1080 - 20, (frame * 53) % 70000);
+}
+
+// Two fingers taking turns drawing curved strokes of 64 samples 8 ms apart, each
+// ending in a stop, so every stroke overlaps the other finger's.  A reset lands
+// part way into every third stroke, off the sample grid so no two messages tie.
+static bool earlier(const Message &a, const Message &b) {
+    return a.getTimestamp() < b.getTimestamp();
+}
+
+static void stroke_trace(std::vector<Message> &msgs) {
+    for(int stroke = 0; stroke < TRACE_LENGTH / 65; stroke++) {
+        int32_t id = stroke % 2;
+        int32_t start = 1000 + stroke * 300;
+        for(int sample = 0; sample < 64; sample++) {
+            double u = sample / 64.0;
+            msgs.push_back(Message::Sync(start + sample * 8, id,
+                    50 + id * 300 + (int)(200 * u + 40 * sin(3 * u + stroke)),
+                    100 + (int)(400 * u * u) + stroke % 7 * 30));
+        }
+        msgs.push_back(Message::Stop(start + 64 * 8, id));
+        if(stroke % 3 == 2) {
+            msgs.push_back(Message::Reset(start + 3));
+        }
+    }
+    std::stable_sort(msgs.begin(), msgs.end(), earlier);
+}
+
+// One finger held down for longer than StrokeWriter writes in one piece while
+// the other taps beside it, as in a pinch, with a reset part way through
+static void pinch_trace(std::vector<Message> &msgs) {
+    for(int sample = 0; sample < 1500; sample++) {
+        int32_t timestamp = 1000 + sample * 8;
+        msgs.push_back(Message::Sync(timestamp, 0, 300 + (int)(100 * sin(sample / 50.0)), 500 + sample / 10));
+        int tap = sample % 40;
+        if(tap < 12) {
+            msgs.push_back(Message::Sync(timestamp + 4, 1, 600 - tap * 5, 900 + tap * 3));
+        } else if(tap == 12) {
+            msgs.push_back(Message::Stop(timestamp + 4, 1));
+        }
+        if(sample == 700) {
+            msgs.push_back(Message::Reset(timestamp + 5));
+        }
+    }
+    msgs.push_back(Message::Stop(1000 + 1500 * 8, 0));
+}
+
+static bool same_message(const Message &a, const Message &b) {
+    MessageRecord ra, rb;
+    a.toRecord(&ra);
+    b.toRecord(&rb);
+    return memcmp(&ra, &rb, sizeof(ra)) == 0;
+}
+
+static void report(const char* check, size_t index, const Message &expected, const Message &actual) {
+    char want[Message::MAX_TEXT_LENGTH], got[Message::MAX_TEXT_LENGTH];
+    int wantLen = expected.format(want, sizeof(want));
+    int gotLen = actual.format(got, sizeof(got));
+    fprintf(stderr, "%s: message %lu differs\n  expected %.*s  got      %.*s", check, (unsigned long)index,
+            wantLen < 0 ? 8 : wantLen, wantLen < 0 ? "(unset)\n" : want,
+            gotLen < 0 ? 8 : gotLen, gotLen < 0 ? "(unset)\n" : got);
+}
+
+// Everything written to fd so far
+static bool read_back(int fd, std::vector<char> &out) {
+    off_t len = lseek(fd, 0, SEEK_END);
+    out.resize(len);
+    return len >= 0 && pread(fd, &out[0], len, 0) == len;
+}
+
+// Packed blocks must give back every message exactly, and encode to the same bytes again
+static bool check_packed() {
+    std::vector<Message> msgs;
+    for(int i = 0; i < TRACE_LENGTH; i++) {
+        msgs.push_back(mixed_message(i));
+    }
+
+    std::vector<char> encoded;
+    TraceCodec::encode(FORMAT_PACKED, &msgs[0], msgs.size(), encoded);
+    std::vector<Message> decoded;
+    if(!TraceCodec::decode(FORMAT_PACKED, &encoded[0], encoded.size(), decoded)) {
+        fprintf(stderr, "packed: decode failed\n");
+        return false;
+    }
+    if(decoded.size() != msgs.size()) {
+        fprintf(stderr, "packed: %lu messages in, %lu out\n", (unsigned long)msgs.size(),
+                (unsigned long)decoded.size());
+        return false;
+    }
+    for(size_t i = 0; i < msgs.size(); i++) {
+        if(!same_message(msgs[i], decoded[i])) {
+            report("packed", i, msgs[i], decoded[i]);
+            return false;
+        }
+    }
+
+    std::vector<char> again;
+    TraceCodec::encode(FORMAT_PACKED, &decoded[0], decoded.size(), again);
+    if(again != encoded) {
+        fprintf(stderr, "packed: re-encoding gave %lu bytes, not the same %lu\n", (unsigned long)again.size(),
+                (unsigned long)encoded.size());
+        return false;
+    }
+    return true;
+}
+
+// Strokes regenerated with their recorded sample count come back in time order,
+// land on the recorded times within maxError of every sample (plus rounding to
+// whole pixels), and keep every stop and reset exactly
+static bool compare_strokes(const std::vector<Message> &msgs, const std::vector<char> &encoded, double maxError) {
+    std::vector<Message> decoded;
+    if(!TraceCodec::decode(FORMAT_STROKE, &encoded[0], encoded.size(), decoded)) {
+        fprintf(stderr, "stroke: decode failed\n");
+        return false;
+    }
+    for(size_t i = 1; i < decoded.size(); i++) {
+        if(decoded[i].getTimestamp() < decoded[i - 1].getTimestamp()) {
+            fprintf(stderr, "stroke: time goes backwards at message %lu\n", (unsigned long)i);
+            report("stroke", i, decoded[i - 1], decoded[i]);
+            return false;
+        }
+    }
+
+    // Every sync by tracking id and time, and the stops and resets in order
+    std::map<int64_t, Message> syncs;
+    std::vector<Message> marks;
+    for(size_t i = 0; i < msgs.size(); i++) {
+        if(msgs[i].isSync()) {
+            syncs[(int64_t)msgs[i].getTrackingID() << 32 | (uint32_t)msgs[i].getTimestamp()] = msgs[i];
+        } else {
+            marks.push_back(msgs[i]);
+        }
+    }
+
+    double limit = maxError + sqrt(0.5);
+    size_t syncCount = 0;
+    size_t markCount = 0;
+    for(size_t i = 0; i < decoded.size(); i++) {
+        const Message &msg = decoded[i];
+        if(!msg.isSync()) {
+            if(markCount >= marks.size() || !same_message(marks[markCount], msg)) {
+                report("stroke", i, markCount < marks.size() ? marks[markCount] : Message(), msg);
+                return false;
+            }
+            markCount++;
+            continue;
+        }
+        std::map<int64_t, Message>::const_iterator it =
+                syncs.find((int64_t)msg.getTrackingID() << 32 | (uint32_t)msg.getTimestamp());
+        if(it == syncs.end()) {
+            report("stroke", i, Message(), msg);
+            return false;
+        }
+        double error = hypot(msg.getX() - it->second.getX(), msg.getY() - it->second.getY());
+        if(error > limit) {
+            fprintf(stderr, "stroke: message %lu is %.2f px off, more than %.2f\n", (unsigned long)i, error, limit);
+            report("stroke", i, it->second, msg);
+            return false;
+        }
+        syncCount++;
+    }
+    if(syncCount != syncs.size() || markCount != marks.size()) {
+        fprintf(stderr, "stroke: %lu syncs and %lu stops or resets in, %lu and %lu out\n",
+                (unsigned long)syncs.size(), (unsigned long)marks.size(), (unsigned long)syncCount,
+                (unsigned long)markCount);
+        return false;
+    }
+    return true;
+}
+
+static bool check_stroke_error(double maxError) {
+    std::vector<Message> msgs;
+    stroke_trace(msgs);
+    std::vector<char> encoded;
+    TraceCodec::encode(FORMAT_STROKE, &msgs[0], msgs.size(), encoded, maxError);
+    return compare_strokes(msgs, encoded, maxError);
+}
+
+// Recording through StrokeWriter writes a block per stroke as each one ends, so
+// decoding has to merge strokes across blocks
+static bool check_stroke_writer() {
+    std::vector<Message> msgs;
+    pinch_trace(msgs);
+    FILE* file = tmpfile();
+    if(!file) {
+        fprintf(stderr, "stroke_writer: no temporary file, %s\n", strerror(errno));
+        return false;
+    }
+    StrokeWriter writer(fileno(file), TraceCodec::DEFAULT_MAX_ERROR);
+    for(size_t i = 0; i < msgs.size(); i++) {
+        writer.add(msgs[i]);
+    }
+    writer.flush();
+
+    std::vector<char> encoded;
+    bool ok = read_back(fileno(file), encoded);
+    fclose(file);
+    if(!ok) {
+        fprintf(stderr, "stroke_writer: could not read the strokes back\n");
+        return false;
+    }
+    return compare_strokes(msgs, encoded, TraceCodec::DEFAULT_MAX_ERROR);
+}
+
+static bool check_stroke() {
+    return check_stroke_error(TraceCodec::DEFAULT_MAX_ERROR);
+}
+
+static bool check_stroke_coarse() {
+    return check_stroke_error(4.0);
+}
+
+// A panel writing to fd, as configured on every run
+static void setup_panel(TouchPanel* panel, int fd) {
+    panel->attachDevice(fd, true);
+    input_absinfo xInfo, yInfo;
+    memset(&xInfo, 0, sizeof(xInfo));
+    memset(&yInfo, 0, sizeof(yInfo));
+    xInfo.maximum = 1079;
+    yInfo.maximum = 1919;
+    panel->configureAxes(xInfo, yInfo);
+}
+
+// A compiled replay must write exactly the events TouchPanel::replay writes for
+// the same trace, one compiled frame per live frame
+static bool check_compiled() {
+    // The strokes, then the mixed trace squeezed onto the panel's four slots and
+    // moved to after them
+    std::vector<Message> msgs;
+    stroke_trace(msgs);
+    int32_t offset = msgs.back().getTimestamp();
+    for(int i = 0; i < TRACE_LENGTH / 4; i++) {
+        Message m = mixed_message(i);
+        int32_t timestamp = offset + m.getTimestamp();
+        msgs.push_back(m.isReset() ? Message::Reset(timestamp) :
+                m.isStop() ? Message::Stop(timestamp, m.getTrackingID() % 4) :
+                Message::Sync(timestamp, m.getTrackingID() % 4, m.getX(), m.getY()));
+    }
+    Trace trace;
+    trace.assign(&msgs[0], msgs.size());
+
+    FILE* liveFile = tmpfile();
+    FILE* compiledFile = tmpfile();
+    if(!liveFile || !compiledFile) {
+        fprintf(stderr, "compiled: no temporary files, %s\n", strerror(errno));
+        return false;
+    }
+    TouchPanel live("live", 4, NULL, SCREEN_WIDTH, SCREEN_HEIGHT);
+    setup_panel(&live, fileno(liveFile));
+    Message msg;
+    for(size_t i = 0; i < trace.size(); i++) {
+        if(trace.get(i, msg)) {
+            live.replay(msg, 0);
+        }
+    }
+    live.flushFrame();
+
+    TouchPanel panel("compiled", 4, NULL, SCREEN_WIDTH, SCREEN_HEIGHT);
+    setup_panel(&panel, fileno(compiledFile));
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/touch_vcr_roundtrip_%d.tvcr", (int)getpid());
+    CompiledReplayHeader header;
+    bool ok = ReplayCompiler::compile(trace, &panel, path, &header);
+    DeviceProfile profile;
+    panel.getProfile(&profile);
+    CompiledReplay replay;
+    ok = ok && replay.open(path, profile);
+    unlink(path);
+    if(!ok) {
+        fprintf(stderr, "compiled: could not compile and open %s\n", path);
+        return false;
+    }
+    nsecs_t now = 0;
+    while(!replay.isDone()) {
+        now = replay.nextDeadline(now);
+        replay.emit(now, fileno(compiledFile));
+    }
+
+    std::vector<char> expected, actual;
+    ok = read_back(fileno(liveFile), expected) && read_back(fileno(compiledFile), actual);
+    fclose(liveFile);
+    fclose(compiledFile);
+    if(!ok) {
+        fprintf(stderr, "compiled: could not read the written events back\n");
+        return false;
+    }
+    if(header.frameCount != live.getFramesWritten()) {
+        fprintf(stderr, "compiled: %u frames, live replay wrote %lu\n", header.frameCount,
+                (unsigned long)live.getFramesWritten());
+        return false;
+    }
+    if(expected.empty() || actual != expected) {
+        size_t i = 0;
+        while(i < expected.size() && i < actual.size() && actual[i] == expected[i]) {
+            i++;
+        }
+        fprintf(stderr, "compiled: %lu bytes written, live replay wrote %lu, first difference in event %lu\n",
+                (unsigned long)actual.size(), (unsigned long)expected.size(),
+                (unsigned long)(i / sizeof(input_event)));
+        return false;
+    }
+    return true;
+}
+
+static const struct {
+    const char* name;
+    bool (*fn)();
+} gChecks[] = {
+    { "packed", check_packed },
+    { "stroke", check_stroke },
+    { "stroke_coarse", check_stroke_coarse },
+    { "stroke_writer", check_stroke_writer },
+    { "compiled", check_compiled },
+};
+
+int main() {
+    int failed = 0;
+    for(size_t i = 0; i < sizeof(gChecks) / sizeof(gChecks[0]); i++) {
+        bool ok = gChecks[i].fn();
+        printf("%-32s %s\n", gChecks[i].name, ok ? "ok" : "FAILED");
+        if(!ok) {
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
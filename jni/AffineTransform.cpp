@@ -0,0 +1,202 @@
+#include "AffineTransform.h"
+#include "Message.h"
+#include <math.h>
+
+// Rounds a 16.16 fixed point value to the nearest integer
+static inline int32_t fixedToInt(int64_t value) {
+    return (int32_t)((value + (AffineTransform::FIXED_ONE >> 1)) >> AffineTransform::FIXED_SHIFT);
+}
+
+// Per-kind point mapping.  The general case does the full multiply; the
+// specializations skip the terms that are known to be zero.
+template<AffineTransform::Kind K>
+struct AffineKernel {
+    static inline void map(const int64_t* m, int32_t x, int32_t y, int32_t* outX, int32_t* outY) {
+        *outX = fixedToInt(m[0]*x + m[1]*y + m[2]);
+        *outY = fixedToInt(m[3]*x + m[4]*y + m[5]);
+    }
+};
+
+template<>
+struct AffineKernel<AffineTransform::IDENTITY> {
+    static inline void map(const int64_t*, int32_t x, int32_t y, int32_t* outX, int32_t* outY) {
+        *outX = x;
+        *outY = y;
+    }
+};
+
+template<>
+struct AffineKernel<AffineTransform::SCALE> {
+    static inline void map(const int64_t* m, int32_t x, int32_t y, int32_t* outX, int32_t* outY) {
+        *outX = fixedToInt(m[0]*x + m[2]);
+        *outY = fixedToInt(m[4]*y + m[5]);
+    }
+};
+
+template<>
+struct AffineKernel<AffineTransform::SWAP_AXES> {
+    static inline void map(const int64_t* m, int32_t x, int32_t y, int32_t* outX, int32_t* outY) {
+        *outX = fixedToInt(m[1]*y + m[2]);
+        *outY = fixedToInt(m[3]*x + m[5]);
+    }
+};
+
+// 3x3 affine product (bottom row implied), out = l * r
+static void multiply(const double* l, const double* r, double* out) {
+    double tmp[6];
+    tmp[0] = l[0]*r[0] + l[1]*r[3];
+    tmp[1] = l[0]*r[1] + l[1]*r[4];
+    tmp[2] = l[0]*r[2] + l[1]*r[5] + l[2];
+    tmp[3] = l[3]*r[0] + l[4]*r[3];
+    tmp[4] = l[3]*r[1] + l[4]*r[4];
+    tmp[5] = l[3]*r[2] + l[4]*r[5] + l[5];
+    for(int i = 0; i < 6; i++) {
+        out[i] = tmp[i];
+    }
+}
+
+AffineTransform::AffineTransform() {
+    mCoeffs[0] = 1; mCoeffs[1] = 0; mCoeffs[2] = 0;
+    mCoeffs[3] = 0; mCoeffs[4] = 1; mCoeffs[5] = 0;
+    classify();
+}
+
+AffineTransform::AffineTransform(double a, double b, double c, double d, double e, double f) {
+    mCoeffs[0] = a; mCoeffs[1] = b; mCoeffs[2] = c;
+    mCoeffs[3] = d; mCoeffs[4] = e; mCoeffs[5] = f;
+    classify();
+}
+
+AffineTransform AffineTransform::Identity() {
+    return AffineTransform();
+}
+
+AffineTransform AffineTransform::Calibration(const input_absinfo &xInfo, const input_absinfo &yInfo,
+        int screenWidth, int screenHeight, int rotation, bool flipX, bool flipY) {
+    // Normalize both panel axes to [0, 1)
+    double xRange = double(xInfo.maximum) - xInfo.minimum + 1;
+    double yRange = double(yInfo.maximum) - yInfo.minimum + 1;
+    double m[6] = { 1.0 / xRange, 0, -xInfo.minimum / xRange,
+                    0, 1.0 / yRange, -yInfo.minimum / yRange };
+
+    // Rotate within the unit square
+    double r[6];
+    switch(((rotation % 360) + 360) % 360) {
+    case 90: {
+        double rot[6] = { 0, -1, 1,   1, 0, 0 };
+        multiply(rot, m, r);
+        break;
+    }
+    case 180: {
+        double rot[6] = { -1, 0, 1,   0, -1, 1 };
+        multiply(rot, m, r);
+        break;
+    }
+    case 270: {
+        double rot[6] = { 0, 1, 0,   -1, 0, 1 };
+        multiply(rot, m, r);
+        break;
+    }
+    default:
+        if(rotation % 360 != 0) {
+            fprintf(stderr, "Unsupported rotation %d, ignoring\n", rotation);
+        }
+        for(int i = 0; i < 6; i++) {
+            r[i] = m[i];
+        }
+        break;
+    }
+
+    if(flipX || flipY) {
+        double flip[6] = { flipX ? -1.0 : 1.0, 0, flipX ? 1.0 : 0.0,
+                           0, flipY ? -1.0 : 1.0, flipY ? 1.0 : 0.0 };
+        multiply(flip, r, r);
+    }
+
+    // Stretch the unit square over the screen
+    double scale[6] = { double(screenWidth), 0, 0,   0, double(screenHeight), 0 };
+    multiply(scale, r, r);
+
+    return AffineTransform(r[0], r[1], r[2], r[3], r[4], r[5]);
+}
+
+AffineTransform AffineTransform::inverse() const {
+    const double* m = mCoeffs;
+    double det = m[0]*m[4] - m[1]*m[3];
+    if(det == 0) {
+        fprintf(stderr, "Transform is not invertible, using identity\n");
+        return Identity();
+    }
+    return AffineTransform( m[4]/det, -m[1]/det, (m[1]*m[5] - m[4]*m[2])/det,
+                           -m[3]/det,  m[0]/det, (m[3]*m[2] - m[0]*m[5])/det);
+}
+
+void AffineTransform::classify() {
+    for(int i = 0; i < 6; i++) {
+        mFixed[i] = (int64_t)floor(mCoeffs[i] * FIXED_ONE + 0.5);
+    }
+
+    const int64_t* m = mFixed;
+    if(m[0] == FIXED_ONE && m[1] == 0 && m[2] == 0 &&
+       m[3] == 0 && m[4] == FIXED_ONE && m[5] == 0) {
+        mKind = IDENTITY;
+    } else if(m[1] == 0 && m[3] == 0) {
+        mKind = SCALE;
+    } else if(m[0] == 0 && m[4] == 0) {
+        mKind = SWAP_AXES;
+    } else {
+        mKind = GENERAL;
+    }
+}
+
+void AffineTransform::apply(int32_t x, int32_t y, int32_t* outX, int32_t* outY) const {
+    switch(mKind) {
+    case IDENTITY:
+        AffineKernel<IDENTITY>::map(mFixed, x, y, outX, outY);
+        break;
+    case SCALE:
+        AffineKernel<SCALE>::map(mFixed, x, y, outX, outY);
+        break;
+    case SWAP_AXES:
+        AffineKernel<SWAP_AXES>::map(mFixed, x, y, outX, outY);
+        break;
+    default:
+        AffineKernel<GENERAL>::map(mFixed, x, y, outX, outY);
+        break;
+    }
+}
+
+template<AffineTransform::Kind K>
+void AffineTransform::applyTraceKernel(Message* msgs, size_t count) const {
+    int32_t x, y;
+    for(size_t i = 0; i < count; i++) {
+        Message &msg = msgs[i];
+        if(!msg.isSync()) {
+            continue;
+        }
+        AffineKernel<K>::map(mFixed, msg.getX(), msg.getY(), &x, &y);
+        msg = Message::Sync(msg.getTimestamp(), msg.getTrackingID(), x, y);
+    }
+}
+
+void AffineTransform::applyTrace(Message* msgs, size_t count) const {
+    switch(mKind) {
+    case IDENTITY:
+        break;
+    case SCALE:
+        applyTraceKernel<SCALE>(msgs, count);
+        break;
+    case SWAP_AXES:
+        applyTraceKernel<SWAP_AXES>(msgs, count);
+        break;
+    default:
+        applyTraceKernel<GENERAL>(msgs, count);
+        break;
+    }
+}
+
+void AffineTransform::dump(FILE* output) const {
+    static const char* kindNames[] = { "identity", "scale", "swap", "general" };
+    fprintf(output, "transform (%s): [%f %f %f] [%f %f %f]\n", kindNames[mKind],
+            mCoeffs[0], mCoeffs[1], mCoeffs[2], mCoeffs[3], mCoeffs[4], mCoeffs[5]);
+}
@@ -0,0 +1,68 @@
+#ifndef AFFINE_TRANSFORM
+#define AFFINE_TRANSFORM
+
+#include "touch_vcr.h"
+
+class Message;
+
+/* Maps touch coordinates between two spaces (typically raw panel units and the
+ * normalized screen space written to traces) with a 2x3 affine matrix:
+ *
+ *   x' = a*x + b*y + c
+ *   y' = d*x + e*y + f
+ *
+ * The matrix is built in floating point and then frozen into 16.16 fixed point,
+ * so applying it per event is integer-only.  The common shapes (identity, pure
+ * scale/offset, and quarter-turn rotations) get their own specialized kernels. */
+class AffineTransform {
+public:
+    enum Kind {
+        IDENTITY,
+        SCALE,      // b == d == 0
+        SWAP_AXES,  // a == e == 0, i.e. a 90 or 270 degree rotation
+        GENERAL
+    };
+
+    static const int FIXED_SHIFT = 16;
+    static const int64_t FIXED_ONE = 1LL << FIXED_SHIFT;
+
+    AffineTransform();
+
+    static AffineTransform Identity();
+
+    // Maps the raw axis ranges of a panel to a screenWidth x screenHeight space.
+    // rotation is the clockwise rotation of the screen relative to the panel in
+    // degrees (0, 90, 180 or 270); flips are applied after rotation.
+    static AffineTransform Calibration(const input_absinfo &xInfo, const input_absinfo &yInfo,
+            int screenWidth, int screenHeight, int rotation, bool flipX, bool flipY);
+
+    AffineTransform inverse() const;
+
+    inline Kind getKind() const { return mKind; }
+
+    // Maps a single point.  Dispatches on the kind of the matrix; prefer
+    // applyTrace() when transforming many points at once.
+    void apply(int32_t x, int32_t y, int32_t* outX, int32_t* outY) const;
+
+    // Transforms the position of every sync message in place.  The dispatch on the
+    // matrix kind happens once for the whole trace.
+    void applyTrace(Message* msgs, size_t count) const;
+
+    void dump(FILE* output) const;
+
+private:
+    AffineTransform(double a, double b, double c, double d, double e, double f);
+
+    void classify();
+
+    template<Kind K> void applyTraceKernel(Message* msgs, size_t count) const;
+
+    // Original coefficients, kept so the inverse doesn't compound rounding error
+    double mCoeffs[6];
+
+    // Fixed point coefficients, a b c d e f
+    int64_t mFixed[6];
+    Kind mKind;
+};
+
+#endif // AFFINE_TRANSFORM
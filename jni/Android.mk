@@ -16,12 +16,51 @@ LOCAL_PATH := $(call my-dir)
 
 include $(CLEAR_VARS)
 
-LOCAL_MODULE    := touch_vcr
-LOCAL_SRC_FILES := touch_vcr.cpp \
-				TouchPanel.cpp \
+LOCAL_MODULE    := touch_vcr_core
+LOCAL_SRC_FILES := TouchPanel.cpp \
 				InputMessenger.cpp \
 				Clock.cpp \
-				Message.cpp
+				Message.cpp \
+				AffineTransform.cpp \
+				StreamServer.cpp \
+				ShmRing.cpp \
+				CaptureFilter.cpp \
+				Trace.cpp \
+				TraceCache.cpp \
+				ReplayScheduler.cpp \
+				Histogram.cpp \
+				TouchProfiler.cpp \
+				LoopPlayer.cpp \
+				TraceCodec.cpp \
+				StrokeFitter.cpp \
+				StrokeWriter.cpp \
+				MessageFormat.cpp \
+				FlightRecorder.cpp \
+				ReplayCompiler.cpp \
+				UinputDevice.cpp \
+				FanoutPlayer.cpp \
+				TouchVcr.cpp \
+				TouchDaemon.cpp
+LOCAL_EXPORT_C_INCLUDES := $(LOCAL_PATH)
+
+include $(BUILD_STATIC_LIBRARY)
+
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    := touch_vcr
+LOCAL_SRC_FILES := touch_vcr.cpp
+LOCAL_STATIC_LIBRARIES := touch_vcr_core
 
 include $(BUILD_EXECUTABLE)
 
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE    := trace_convert
+LOCAL_SRC_FILES := trace_convert.cpp \
+				TraceCodec.cpp \
+				StrokeFitter.cpp \
+				Message.cpp
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,174 @@
+#include "CaptureFilter.h"
+
+CaptureFilter::CaptureFilter() :
+    mKernelMask(false), mMaskInstalled(false), mFD(-1), mHaveRegion(false),
+    mLeft(0), mTop(0), mRight(0), mBottom(0), mTrackingIdCount(0), mAccepted(0), mRejected(0) {
+    memset(&mCalibration, 0, sizeof(mCalibration));
+    memset(&mFiltered, 0, sizeof(mFiltered));
+}
+
+void CaptureFilter::setRegion(int32_t left, int32_t top, int32_t right, int32_t bottom) {
+    mHaveRegion = true;
+    mLeft = left;
+    mTop = top;
+    mRight = right;
+    mBottom = bottom;
+}
+
+bool CaptureFilter::addTrackingId(int32_t trackingId) {
+    if(mTrackingIdCount >= MAX_TRACKING_IDS) {
+        fprintf(stderr, "Too many tracking ids, ignoring %d\n", trackingId);
+        return false;
+    }
+    mTrackingIds[mTrackingIdCount++] = trackingId;
+    return true;
+}
+
+bool CaptureFilter::parseRegion(const char* spec) {
+    int left, top, right, bottom;
+    if(sscanf(spec, "%d,%d,%d,%d", &left, &top, &right, &bottom) != 4 || right < left || bottom < top) {
+        fprintf(stderr, "Bad region %s, expected left,top,right,bottom\n", spec);
+        return false;
+    }
+    setRegion(left, top, right, bottom);
+    return true;
+}
+
+bool CaptureFilter::parseTrackingIds(const char* spec) {
+    const char* p = spec;
+    while(*p) {
+        char* end;
+        long id = strtol(p, &end, 10);
+        if(end == p) {
+            fprintf(stderr, "Bad tracking id list %s\n", spec);
+            return false;
+        }
+        addTrackingId(id);
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return true;
+}
+
+void CaptureFilter::attach(int fd) {
+    mFD = fd;
+    mCalibration.startMs = nowMs();
+}
+
+int64_t CaptureFilter::nowMs() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000LL;
+}
+
+// Lets through only what TouchPanel::process records
+bool CaptureFilter::installMask() {
+    uint8_t absBits[(ABS_MAX + 8) / 8];
+    uint8_t keyBits[(KEY_MAX + 8) / 8];
+    uint8_t mscBits[(MSC_MAX + 8) / 8];
+    struct input_mask mask;
+
+    memset(absBits, 0, sizeof(absBits));
+    memset(keyBits, 0, sizeof(keyBits));
+    memset(mscBits, 0, sizeof(mscBits));
+
+    static const int keep[] = { ABS_MT_SLOT, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_TRACKING_ID };
+    for(size_t i = 0; i < sizeof(keep)/sizeof(keep[0]); i++) {
+        absBits[keep[i] / 8] |= 1 << (keep[i] % 8);
+    }
+
+    mask.type = EV_ABS;
+    mask.codes_size = sizeof(absBits);
+    mask.codes_ptr = (uintptr_t)absBits;
+    if(ioctl(mFD, EVIOCSMASK, &mask) < 0) {
+        fprintf(stderr, "Kernel event masks not supported, %s\n", strerror(errno));
+        return false;
+    }
+
+    mask.type = EV_KEY;
+    mask.codes_size = sizeof(keyBits);
+    mask.codes_ptr = (uintptr_t)keyBits;
+    ioctl(mFD, EVIOCSMASK, &mask);
+
+    mask.type = EV_MSC;
+    mask.codes_size = sizeof(mscBits);
+    mask.codes_ptr = (uintptr_t)mscBits;
+    ioctl(mFD, EVIOCSMASK, &mask);
+
+    fprintf(stderr, "Installed kernel event mask\n");
+    return true;
+}
+
+void CaptureFilter::noteEvents(const input_event* events, size_t count) {
+    Counters* counters = mMaskInstalled ? &mFiltered : &mCalibration;
+    counters->wakeups++;
+    counters->events += count;
+    for(size_t i = 0; i < count; i++) {
+        if(events[i].type == EV_SYN && events[i].code == SYN_REPORT) {
+            counters->frames++;
+        }
+    }
+
+    if(mKernelMask && !mMaskInstalled && mCalibration.frames >= CALIBRATION_FRAMES) {
+        // Only try once
+        mKernelMask = false;
+        if(installMask()) {
+            mMaskInstalled = true;
+            mFiltered.startMs = nowMs();
+        }
+    }
+}
+
+bool CaptureFilter::accept(int32_t trackingId, int32_t x, int32_t y) {
+    bool ok = true;
+    if(mHaveRegion && (x < mLeft || x > mRight || y < mTop || y > mBottom)) {
+        ok = false;
+    }
+    if(ok && mTrackingIdCount > 0) {
+        ok = false;
+        for(int i = 0; i < mTrackingIdCount; i++) {
+            if(mTrackingIds[i] == trackingId) {
+                ok = true;
+                break;
+            }
+        }
+    }
+
+    if(ok) {
+        mAccepted++;
+    } else {
+        mRejected++;
+    }
+    return ok;
+}
+
+void CaptureFilter::dumpRates(FILE* output, const char* label, const Counters &counters, int64_t endMs) {
+    double seconds = (endMs - counters.startMs) / 1000.0;
+    double frames = counters.frames ? counters.frames : 1;
+    if(seconds <= 0) {
+        seconds = 1;
+    }
+    fprintf(output, "  %s: %.1f wakeups/s %.0f bytes/s, per frame %.2f wakeups %.1f events %.0f bytes\n",
+            label, counters.wakeups / seconds, counters.events * sizeof(input_event) / seconds,
+            counters.wakeups / frames, counters.events / frames, counters.events * sizeof(input_event) / frames);
+}
+
+void CaptureFilter::dumpStats(FILE* output) const {
+    int64_t now = nowMs();
+    fprintf(output, "Capture filter\n");
+    if(mMaskInstalled) {
+        dumpRates(output, "unmasked", mCalibration, mFiltered.startMs);
+        dumpRates(output, "masked", mFiltered, now);
+        if(mCalibration.frames > 0 && mFiltered.frames > 0) {
+            double before = double(mCalibration.events) / mCalibration.frames;
+            double after = double(mFiltered.events) / mFiltered.frames;
+            double wakeBefore = double(mCalibration.wakeups) / mCalibration.frames;
+            double wakeAfter = double(mFiltered.wakeups) / mFiltered.frames;
+            fprintf(output, "  reduction per frame: %.0f%% events/bytes, %.0f%% wakeups\n",
+                    100.0 * (1.0 - after / before), 100.0 * (1.0 - wakeAfter / wakeBefore));
+        }
+    } else {
+        dumpRates(output, "all", mCalibration, now);
+    }
+    fprintf(output, "  samples accepted %llu rejected %llu\n",
+            (unsigned long long)mAccepted, (unsigned long long)mRejected);
+}
@@ -0,0 +1,69 @@
+#ifndef CAPTURE_FILTER
+#define CAPTURE_FILTER
+
+#include "touch_vcr.h"
+
+/* Decides which events are worth waking up for and which touches get recorded.
+ *
+ * The kernel side is an EVIOCSMASK event mask that only lets through the codes
+ * TouchPanel::process turns into messages (slot, position and tracking id, plus
+ * the sync reports), so the size, orientation, pressure, key and MSC_TIMESTAMP
+ * traffic never reaches the process.  The mask is installed after a short
+ * unmasked calibration window so the per-frame reduction can be reported.
+ *
+ * The user space side is a screen-space region of interest and an optional list
+ * of tracking ids, checked before a Message is created. */
+class CaptureFilter {
+public:
+    static const int MAX_TRACKING_IDS = 16;
+    static const int CALIBRATION_FRAMES = 200;
+
+    CaptureFilter();
+
+    void setKernelMask(bool enabled) { mKernelMask = enabled; }
+    void setRegion(int32_t left, int32_t top, int32_t right, int32_t bottom);
+    bool addTrackingId(int32_t trackingId);
+
+    // Parse "left,top,right,bottom" and "id,id,..." from the command line
+    bool parseRegion(const char* spec);
+    bool parseTrackingIds(const char* spec);
+
+    void attach(int fd);
+
+    // Called with every batch of events read from the device
+    void noteEvents(const input_event* events, size_t count);
+
+    // Screen-space position of a contact about to be recorded
+    bool accept(int32_t trackingId, int32_t x, int32_t y);
+
+    void dumpStats(FILE* output) const;
+
+private:
+    struct Counters {
+        uint64_t wakeups;
+        uint64_t events;
+        uint64_t frames;
+        int64_t startMs;
+    };
+
+    bool mKernelMask;
+    bool mMaskInstalled;
+    int mFD;
+
+    bool mHaveRegion;
+    int32_t mLeft, mTop, mRight, mBottom;
+
+    int32_t mTrackingIds[MAX_TRACKING_IDS];
+    int mTrackingIdCount;
+
+    Counters mCalibration;
+    Counters mFiltered;
+    uint64_t mAccepted;
+    uint64_t mRejected;
+
+    bool installMask();
+    static int64_t nowMs();
+    static void dumpRates(FILE* output, const char* label, const Counters &counters, int64_t endMs);
+};
+
+#endif // CAPTURE_FILTER
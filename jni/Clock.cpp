@@ -25,3 +25,10 @@ int32_t Clock::getTimestampNow() {
     clock_gettime(CLOCK_REALTIME, &t);
     return getTimestamp(t);
 }
+
+nsecs_t Clock::getMonotonicNs() {
+    struct timespec t;
+    t.tv_sec = t.tv_nsec = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
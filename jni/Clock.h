@@ -1,8 +1,7 @@
 #ifndef CLOCK
 #define CLOCK
 
-#include <linux/input.h>
-#include <time.h>
+#include "touch_vcr.h"
 
 class Clock {
  public: 
@@ -14,6 +13,9 @@ class Clock {
   int32_t getTimestampNow();
   int32_t getTimestampStart();
 
+  // CLOCK_MONOTONIC in ns, the timeline replay is scheduled on
+  static nsecs_t getMonotonicNs();
+
  private:
   int32_t mStartTimeSeconds;
 };
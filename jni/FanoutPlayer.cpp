@@ -0,0 +1,185 @@
+#include "FanoutPlayer.h"
+#include "Clock.h"
+#include <algorithm>
+
+FanoutPlayer::FanoutPlayer(const CompiledFrame* frames, const input_event* events, uint32_t frameCount) :
+    mFrames(frames), mEvents(events), mFrameCount(frameCount), mStart(-1), mStopping(false),
+    mDispatches(0), mSpans(0) {
+}
+
+FanoutPlayer::~FanoutPlayer() {
+    // Whatever is already queued still goes out
+    for(size_t i = 0; i < mWorkers.size(); i++) {
+        Worker* worker = mWorkers[i];
+        pthread_mutex_lock(&worker->lock);
+        mStopping = true;
+        pthread_cond_signal(&worker->ready);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    for(size_t i = 0; i < mWorkers.size(); i++) {
+        Worker* worker = mWorkers[i];
+        if(worker->started) {
+            pthread_join(worker->thread, NULL);
+        }
+        pthread_mutex_destroy(&worker->lock);
+        pthread_cond_destroy(&worker->ready);
+        delete worker;
+    }
+    for(size_t i = 0; i < mTargets.size(); i++) {
+        delete mTargets[i];
+    }
+}
+
+void FanoutPlayer::addTarget(int fd, const char* name, nsecs_t offset) {
+    Target* target = new Target();
+    target->fd = fd;
+    snprintf(target->name, sizeof(target->name), "%s", name);
+    target->offset = offset;
+    target->next = 0;
+    target->frames = 0;
+    target->writes = 0;
+    target->failed = 0;
+    mTargets.push_back(target);
+}
+
+bool FanoutPlayer::start(int threads) {
+    if(threads > (int)mTargets.size()) threads = mTargets.size();
+    if(threads < 1) threads = 1;
+
+    for(int i = 0; i < threads; i++) {
+        Worker* worker = new Worker();
+        worker->player = this;
+        worker->started = false;
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->ready, NULL);
+        mWorkers.push_back(worker);
+        if(pthread_create(&worker->thread, NULL, workerMain, worker) != 0) {
+            fprintf(stderr, "could not start fan-out worker, %s\n", strerror(errno));
+            return false;
+        }
+        worker->started = true;
+    }
+    fprintf(stderr, "Fanning out %u frames to %d devices on %d threads\n",
+            mFrameCount, (int)mTargets.size(), threads);
+    return true;
+}
+
+nsecs_t FanoutPlayer::deadlineOf(const Target* target, uint32_t frame) const {
+    return mStart + target->offset + mFrames[frame].deadline;
+}
+
+nsecs_t FanoutPlayer::nextDeadline(nsecs_t now) {
+    if(mStart < 0) {
+        mStart = now;
+        for(size_t i = 0; i < mTargets.size(); i++) {
+            if(mFrameCount > 0) {
+                Due due = { deadlineOf(mTargets[i], 0), (uint32_t)i };
+                mHeap.push_back(due);
+            }
+        }
+        std::make_heap(mHeap.begin(), mHeap.end());
+    }
+    return mHeap.empty() ? -1 : mHeap.front().deadline;
+}
+
+void FanoutPlayer::dispatch(nsecs_t now) {
+    if(mWorkers.empty()) {
+        return;
+    }
+    mDispatches++;
+    while(!mHeap.empty() && mHeap.front().deadline <= now) {
+        Due due = mHeap.front();
+        std::pop_heap(mHeap.begin(), mHeap.end());
+        mHeap.pop_back();
+
+        // Everything this target owes goes out together, even if we're late
+        Target* target = mTargets[due.target];
+        Span span;
+        span.target = due.target;
+        span.first = target->next;
+        span.deadline = due.deadline;
+        while(target->next < mFrameCount && deadlineOf(target, target->next) <= now) {
+            target->next++;
+        }
+        span.end = target->next;
+        if(target->next < mFrameCount) {
+            Due next = { deadlineOf(target, target->next), due.target };
+            mHeap.push_back(next);
+            std::push_heap(mHeap.begin(), mHeap.end());
+        }
+
+        Worker* worker = mWorkers[due.target % mWorkers.size()];
+        pthread_mutex_lock(&worker->lock);
+        worker->pending.push_back(span);
+        pthread_cond_signal(&worker->ready);
+        pthread_mutex_unlock(&worker->lock);
+        mSpans++;
+    }
+}
+
+void* FanoutPlayer::workerMain(void* arg) {
+    Worker* worker = (Worker*)arg;
+    worker->player->run(worker);
+    return NULL;
+}
+
+void FanoutPlayer::run(Worker* worker) {
+    std::vector<Span> spans;
+    pthread_mutex_lock(&worker->lock);
+    while(1) {
+        if(worker->pending.empty()) {
+            if(mStopping) break;
+            pthread_cond_wait(&worker->ready, &worker->lock);
+            continue;
+        }
+        spans.swap(worker->pending);
+        pthread_mutex_unlock(&worker->lock);
+
+        for(size_t i = 0; i < spans.size(); i++) {
+            write(spans[i]);
+        }
+        spans.clear();
+
+        pthread_mutex_lock(&worker->lock);
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+void FanoutPlayer::write(const Span &span) {
+    Target* target = mTargets[span.target];
+    const CompiledFrame &first = mFrames[span.first];
+    const CompiledFrame &last = mFrames[span.end - 1];
+    ssize_t len = (last.firstEvent + last.eventCount - first.firstEvent) * sizeof(input_event);
+    bool ok = ::write(target->fd, &mEvents[first.firstEvent], len) == len;
+    nsecs_t lag = Clock::getMonotonicNs() - span.deadline;
+
+    Worker* worker = mWorkers[span.target % mWorkers.size()];
+    pthread_mutex_lock(&worker->lock);
+    target->frames += span.end - span.first;
+    target->writes++;
+    if(!ok) {
+        target->failed++;
+    }
+    nsecs_t lagUs = lag / 1000;
+    target->lag.record(lagUs < 0 ? 0 : lagUs > 0xffffffffLL ? 0xffffffff : lagUs);
+    pthread_mutex_unlock(&worker->lock);
+}
+
+void FanoutPlayer::dumpStats(FILE* output) const {
+    Histogram all;
+    fprintf(output, "Fan-out replay: %llu dispatches, %llu spans\n",
+            (unsigned long long)mDispatches, (unsigned long long)mSpans);
+    for(size_t i = 0; i < mTargets.size(); i++) {
+        const Target* target = mTargets[i];
+        const Worker* worker = mWorkers.empty() ? NULL : mWorkers[i % mWorkers.size()];
+        if(worker) pthread_mutex_lock(&worker->lock);
+        fprintf(output, "  %s: %llu of %u frames, %llu writes, %llu failed, lag p50 %uus p99 %uus max %uus\n",
+                target->name, (unsigned long long)target->frames, mFrameCount, (unsigned long long)target->writes,
+                (unsigned long long)target->failed, target->lag.quantile(0.5), target->lag.quantile(0.99),
+                target->lag.max());
+        all.merge(target->lag);
+        if(worker) pthread_mutex_unlock(&worker->lock);
+    }
+    fprintf(output, "  all: lag p50 %uus p99 %uus max %uus\n",
+            all.quantile(0.5), all.quantile(0.99), all.max());
+}
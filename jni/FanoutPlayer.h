@@ -0,0 +1,102 @@
+#ifndef FANOUT_PLAYER
+#define FANOUT_PLAYER
+
+#include "touch_vcr.h"
+#include "ReplayCompiler.h"
+#include "Histogram.h"
+#include <pthread.h>
+#include <vector>
+
+/* Replays one set of compiled frames to many devices at once, each on the same
+ * timeline shifted by its own offset.
+ *
+ * The poll loop is the only scheduler: it keeps every target's next deadline in
+ * a heap, sleeps until the earliest one with the usual ReplayScheduler, and on
+ * waking hands each due target the span of frames it owes to a worker thread.
+ * A target always goes to the same worker, so its spans are written in order,
+ * and a worker writes each span with a single write().  Lag is measured from a
+ * span's first deadline to when its write returns. */
+class FanoutPlayer {
+public:
+    // frames and events must outlive the player
+    FanoutPlayer(const CompiledFrame* frames, const input_event* events, uint32_t frameCount);
+    ~FanoutPlayer();
+
+    // Plays to fd starting offset ns after the shared start.  Call before start().
+    void addTarget(int fd, const char* name, nsecs_t offset);
+
+    // Spreads the targets over threads workers
+    bool start(int threads);
+
+    // Same contract as InputMessenger: the first call anchors the timeline to now
+    nsecs_t nextDeadline(nsecs_t now);
+
+    // Queues every frame due by now to the workers
+    void dispatch(nsecs_t now);
+
+    // All frames have been handed out
+    inline bool isDone() const { return mStart >= 0 && mHeap.empty(); }
+
+    void dumpStats(FILE* output) const;
+
+private:
+    FanoutPlayer(const FanoutPlayer&);
+    FanoutPlayer& operator=(const FanoutPlayer&);
+
+    struct Target {
+        int fd;
+        char name[64];
+        nsecs_t offset;
+        uint32_t next;          // First frame not yet dispatched
+
+        // Written by the target's worker under its lock
+        uint64_t frames;
+        uint64_t writes;
+        uint64_t failed;
+        Histogram lag;          // us
+    };
+
+    // Frames [first, end) of a target, due from deadline
+    struct Span {
+        uint32_t target;
+        uint32_t first;
+        uint32_t end;
+        nsecs_t deadline;
+    };
+
+    struct Worker {
+        FanoutPlayer* player;
+        pthread_t thread;
+        mutable pthread_mutex_t lock;
+        pthread_cond_t ready;
+        std::vector<Span> pending;
+        bool started;
+    };
+
+    // Heap entry, the earliest deadline on top
+    struct Due {
+        nsecs_t deadline;
+        uint32_t target;
+        bool operator<(const Due &other) const { return deadline > other.deadline; }
+    };
+
+    const CompiledFrame* mFrames;
+    const input_event* mEvents;
+    uint32_t mFrameCount;
+
+    std::vector<Target*> mTargets;
+    std::vector<Worker*> mWorkers;
+    std::vector<Due> mHeap;
+    nsecs_t mStart;
+    bool mStopping;
+
+    uint64_t mDispatches;
+    uint64_t mSpans;
+
+    static void* workerMain(void* arg);
+    void run(Worker* worker);
+    void write(const Span &span);
+    nsecs_t deadlineOf(const Target* target, uint32_t frame) const;
+};
+
+#endif // FANOUT_PLAYER
@@ -0,0 +1,287 @@
+#include "FlightRecorder.h"
+#include "MessageFormat.h"
+#include "StreamServer.h"
+#include <sys/socket.h>
+
+FlightRecorder::FlightRecorder(const char* dir, int seconds, uint32_t capacity) :
+    mWindow(seconds * 1000), mCapacity(capacity ? capacity : seconds * MESSAGES_PER_SECOND),
+    mRing(NULL), mWritten(0), mSnapshot(NULL), mSnapshotCount(0), mText(NULL),
+    mBusy(false), mQuit(false), mThreadStarted(false),
+    mListenFD(-1), mClientFD(-1), mCommandLength(0), mDumps(0), mDumpFailures(0) {
+    strncpy(mDir, dir, sizeof(mDir) - 1);
+    mDir[sizeof(mDir) - 1] = '\0';
+    mDumpPath[0] = '\0';
+    pthread_mutex_init(&mLock, NULL);
+    pthread_cond_init(&mWake, NULL);
+}
+
+FlightRecorder::~FlightRecorder() {
+    if(mThreadStarted) {
+        pthread_mutex_lock(&mLock);
+        mQuit = true;
+        pthread_cond_signal(&mWake);
+        pthread_mutex_unlock(&mLock);
+        pthread_join(mThread, NULL);
+    }
+    closeClient();
+    if(mListenFD >= 0) {
+        close(mListenFD);
+    }
+    delete[] mRing;
+    delete[] mSnapshot;
+    delete[] mText;
+    pthread_mutex_destroy(&mLock);
+    pthread_cond_destroy(&mWake);
+}
+
+size_t FlightRecorder::memoryFor(uint32_t capacity) {
+    return 2 * (size_t)capacity * sizeof(MessageRecord) + WRITE_BUFFER;
+}
+
+bool FlightRecorder::start() {
+    if(mCapacity == 0 || mWindow <= 0) {
+        fprintf(stderr, "Flight recorder needs a window of at least a second\n");
+        return false;
+    }
+    mRing = new MessageRecord[mCapacity];
+    mSnapshot = new MessageRecord[mCapacity];
+    mText = new char[WRITE_BUFFER];
+    // Touch every page now so the memory is really ours before a test needs it
+    memset(mRing, 0, mCapacity * sizeof(MessageRecord));
+    memset(mSnapshot, 0, mCapacity * sizeof(MessageRecord));
+
+    if(pthread_create(&mThread, NULL, writerThread, this) != 0) {
+        fprintf(stderr, "could not start flight recorder writer\n");
+        return false;
+    }
+    mThreadStarted = true;
+
+    fprintf(stderr, "Flight recorder: last %d s, %u messages, %u KB, dumping to %s\n",
+            mWindow / 1000, mCapacity, (unsigned)(memoryFor(mCapacity) / 1024), mDir);
+    return true;
+}
+
+void FlightRecorder::add(const Message &msg) {
+    msg.toRecord(&mRing[mWritten % mCapacity]);
+    mWritten++;
+}
+
+// Control socket clients may be any process on the device, so they only get to
+// name a file in the dump directory
+static bool valid_dump_name(const char* name) {
+    return name[0] != '\0' && strchr(name, '/') == NULL && strstr(name, "..") == NULL;
+}
+
+int FlightRecorder::requestDump(const char* name) {
+    if(name && !valid_dump_name(name)) {
+        fprintf(stderr, "Refusing flight recorder dump to %s\n", name);
+        return -2;
+    }
+
+    pthread_mutex_lock(&mLock);
+    if(mBusy) {
+        pthread_mutex_unlock(&mLock);
+        fprintf(stderr, "Flight recorder dump already in progress\n");
+        return -1;
+    }
+
+    // Oldest first, skipping anything older than the window
+    size_t count = mWritten < mCapacity ? mWritten : mCapacity;
+    size_t first = (mWritten - count) % mCapacity;
+    if(count > 0) {
+        int32_t newest = mRing[(mWritten - 1) % mCapacity].timestamp;
+        while(count > 0 && newest - mRing[first].timestamp > mWindow) {
+            first = (first + 1) % mCapacity;
+            count--;
+        }
+    }
+    size_t tail = count < mCapacity - first ? count : mCapacity - first;
+    memcpy(mSnapshot, &mRing[first], tail * sizeof(MessageRecord));
+    memcpy(mSnapshot + tail, mRing, (count - tail) * sizeof(MessageRecord));
+    mSnapshotCount = count;
+
+    int len = name ? snprintf(mDumpPath, sizeof(mDumpPath), "%s/%s", mDir, name) :
+            snprintf(mDumpPath, sizeof(mDumpPath), "%s/flight-%ld.txt", mDir, (long)time(NULL));
+    if(len >= (int)sizeof(mDumpPath)) {
+        pthread_mutex_unlock(&mLock);
+        fprintf(stderr, "Flight recorder dump path is too long\n");
+        return -2;
+    }
+
+    mBusy = true;
+    pthread_cond_signal(&mWake);
+    pthread_mutex_unlock(&mLock);
+    return count;
+}
+
+void* FlightRecorder::writerThread(void* arg) {
+    FlightRecorder* recorder = (FlightRecorder*)arg;
+    pthread_mutex_lock(&recorder->mLock);
+    while(1) {
+        while(!recorder->mBusy && !recorder->mQuit) {
+            pthread_cond_wait(&recorder->mWake, &recorder->mLock);
+        }
+        if(recorder->mQuit) {
+            break;
+        }
+        // The snapshot and path are ours until mBusy is cleared
+        pthread_mutex_unlock(&recorder->mLock);
+        bool ok = recorder->writeSnapshot();
+        pthread_mutex_lock(&recorder->mLock);
+        if(ok) {
+            recorder->mDumps++;
+        } else {
+            recorder->mDumpFailures++;
+        }
+        recorder->mBusy = false;
+    }
+    pthread_mutex_unlock(&recorder->mLock);
+    return NULL;
+}
+
+static bool write_all(int fd, const char* data, size_t len) {
+    while(len > 0) {
+        ssize_t res = write(fd, data, len);
+        if(res < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        data += res;
+        len -= res;
+    }
+    return true;
+}
+
+// Written to a temporary name and renamed so a half written dump is never picked up
+bool FlightRecorder::writeSnapshot() {
+    char tmpPath[PATH_MAX + 8];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", mDumpPath);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "could not create %s, %s\n", tmpPath, strerror(errno));
+        return false;
+    }
+
+    bool ok = true;
+    size_t used = 0;
+    for(size_t i = 0; i < mSnapshotCount && ok; i++) {
+        Message msg;
+        if(!Message::fromRecord(mSnapshot[i], msg)) {
+            continue;
+        }
+        if(WRITE_BUFFER - used < MAX_SERIALIZED_LENGTH) {
+            ok = write_all(fd, mText, used);
+            used = 0;
+        }
+        used += serializeMessage<TextFormat>(msg, mText + used, WRITE_BUFFER - used);
+    }
+    ok = ok && write_all(fd, mText, used);
+    close(fd);
+
+    if(!ok || rename(tmpPath, mDumpPath) < 0) {
+        fprintf(stderr, "could not write %s, %s\n", mDumpPath, strerror(errno));
+        unlink(tmpPath);
+        return false;
+    }
+    fprintf(stderr, "Flight recorder wrote %d messages to %s\n", (int)mSnapshotCount, mDumpPath);
+    return true;
+}
+
+int FlightRecorder::listen(const char* path) {
+    mListenFD = StreamServer::listenUnix(path, 1);
+    if(mListenFD >= 0) {
+        fprintf(stderr, "Flight recorder control on %s\n", path);
+    }
+    return mListenFD;
+}
+
+int FlightRecorder::fillPollFds(struct pollfd* fds, int maxFds) {
+    int n = 0;
+    int fdList[2] = { mListenFD, mClientFD };
+    for(int i = 0; i < 2 && n < maxFds; i++) {
+        if(fdList[i] >= 0) {
+            fds[n].fd = fdList[i];
+            fds[n].events = POLLIN;
+            fds[n].revents = 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+void FlightRecorder::closeClient() {
+    if(mClientFD >= 0) {
+        close(mClientFD);
+        mClientFD = -1;
+    }
+    mCommandLength = 0;
+}
+
+void FlightRecorder::handlePollFds(const struct pollfd* fds, int count) {
+    for(int n = 0; n < count; n++) {
+        if(fds[n].revents == 0) {
+            continue;
+        }
+        if(fds[n].fd == mListenFD) {
+            // One client at a time, a new one replaces the old
+            int fd = accept(mListenFD, NULL, NULL);
+            if(fd >= 0) {
+                closeClient();
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+                mClientFD = fd;
+            }
+        } else if(fds[n].fd == mClientFD) {
+            ssize_t res = recv(mClientFD, mCommand + mCommandLength, sizeof(mCommand) - 1 - mCommandLength,
+                    MSG_DONTWAIT);
+            if(res < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if(res <= 0) {
+                closeClient();
+                continue;
+            }
+            mCommandLength += res;
+            mCommand[mCommandLength] = '\0';
+            if(strchr(mCommand, '\n') || mCommandLength == sizeof(mCommand) - 1) {
+                handleCommand();
+                closeClient();
+            }
+        }
+    }
+}
+
+void FlightRecorder::handleCommand() {
+    char* end = strchr(mCommand, '\n');
+    if(end) {
+        *end = '\0';
+    }
+
+    char reply[PATH_MAX + 64];
+    if(strncmp(mCommand, "dump", 4) == 0 && (mCommand[4] == '\0' || mCommand[4] == ' ')) {
+        const char* name = mCommand[4] == ' ' && mCommand[5] ? mCommand + 5 : NULL;
+        int count = requestDump(name);
+        if(count == -2) {
+            snprintf(reply, sizeof(reply), "bad name, expected a file name in the dump directory\n");
+        } else if(count < 0) {
+            snprintf(reply, sizeof(reply), "busy\n");
+        } else {
+            snprintf(reply, sizeof(reply), "dumping %d messages to %s\n", count, mDumpPath);
+        }
+    } else {
+        snprintf(reply, sizeof(reply), "unknown command, expected dump [name]\n");
+    }
+    send(mClientFD, reply, strlen(reply), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+void FlightRecorder::dumpStats(FILE* output) const {
+    pthread_mutex_lock(&mLock);
+    uint64_t dumps = mDumps;
+    uint64_t failures = mDumpFailures;
+    bool busy = mBusy;
+    pthread_mutex_unlock(&mLock);
+
+    fprintf(output, "Flight recorder\n");
+    fprintf(output, "  %llu messages recorded, %u held, %llu dumps, %llu failed%s\n",
+            (unsigned long long)mWritten, (unsigned)(mWritten < mCapacity ? mWritten : mCapacity),
+            (unsigned long long)dumps, (unsigned long long)failures, busy ? ", dump in progress" : "");
+}
@@ -0,0 +1,87 @@
+#ifndef FLIGHT_RECORDER
+#define FLIGHT_RECORDER
+
+#include "touch_vcr.h"
+#include "Message.h"
+#include <pthread.h>
+
+/* Keeps the last few seconds of recorded messages in memory so they can be
+ * pulled after a test fails, without writing everything to storage all day.
+ *
+ * Messages go into a preallocated ring of MessageRecords, overwriting the
+ * oldest.  A dump copies the wanted window into a second, equally sized buffer
+ * (a memcpy, so capture never pauses) and a writer thread turns that into a text
+ * trace in the background.  Both buffers are allocated up front, so memory use
+ * is fixed at memoryFor(capacity) for the life of the process.
+ *
+ * Dumps are requested with requestDump(), typically from a signal, or by
+ * connecting to the control socket and sending "dump [name]\n". */
+class FlightRecorder {
+public:
+    static const int DEFAULT_SECONDS = 60;
+    // The ring is sized for ten fingers reporting at 200Hz
+    static const uint32_t MESSAGES_PER_SECOND = 2000;
+
+    // Dumps go to dir.  Only messages from the last seconds are
+    // dumped.  A capacity of 0 sizes the ring from seconds.
+    FlightRecorder(const char* dir, int seconds, uint32_t capacity);
+    ~FlightRecorder();
+
+    // Allocates the buffers and starts the writer thread
+    bool start();
+
+    void add(const Message &msg);
+
+    // Snapshots the window and hands it to the writer, to be written as name in
+    // the dump directory.  name can't leave the directory, and NULL picks a
+    // timestamped one.  Returns the number of messages being written, -1 if a
+    // dump is still in progress or -2 for a bad name.
+    int requestDump(const char* name);
+
+    // Control socket, polled like StreamServer
+    int listen(const char* path);
+    int fillPollFds(struct pollfd* fds, int maxFds);
+    void handlePollFds(const struct pollfd* fds, int count);
+
+    static size_t memoryFor(uint32_t capacity);
+    void dumpStats(FILE* output) const;
+
+private:
+    static const size_t WRITE_BUFFER = 64 * 1024;
+    static const size_t MAX_COMMAND = PATH_MAX + 8;
+
+    char mDir[PATH_MAX];
+    int32_t mWindow;            // ms
+    uint32_t mCapacity;
+
+    MessageRecord* mRing;
+    uint64_t mWritten;
+
+    // Handed to the writer thread under mLock
+    MessageRecord* mSnapshot;
+    size_t mSnapshotCount;
+    char mDumpPath[PATH_MAX];
+    char* mText;
+    bool mBusy;
+    bool mQuit;
+    pthread_t mThread;
+    bool mThreadStarted;
+    mutable pthread_mutex_t mLock;
+    pthread_cond_t mWake;
+
+    int mListenFD;
+    int mClientFD;
+    char mCommand[MAX_COMMAND];
+    size_t mCommandLength;
+
+    // Updated by the writer under mLock
+    uint64_t mDumps;
+    uint64_t mDumpFailures;
+
+    static void* writerThread(void* arg);
+    bool writeSnapshot();
+    void handleCommand();
+    void closeClient();
+};
+
+#endif // FLIGHT_RECORDER
@@ -0,0 +1,90 @@
+#include "Histogram.h"
+#include <math.h>
+
+Histogram::Histogram() {
+    clear();
+}
+
+void Histogram::clear() {
+    memset(mBuckets, 0, sizeof(mBuckets));
+    mCount = 0;
+    mMin = 0xffffffff;
+    mMax = 0;
+    mMean = 0;
+    mM2 = 0;
+}
+
+// Values below SUB_BUCKETS map one to one; above that, the top SUB_BITS + 1
+// significant bits pick the bucket
+int Histogram::bucketFor(uint32_t value) {
+    if(value < (uint32_t)SUB_BUCKETS) {
+        return value;
+    }
+    int msb = 31 - __builtin_clz(value);
+    int shift = msb - SUB_BITS;
+    return (shift + 1) * SUB_BUCKETS + ((value >> shift) - SUB_BUCKETS);
+}
+
+uint32_t Histogram::bucketLimit(int bucket) {
+    if(bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    uint64_t base = (uint64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    uint64_t limit = base + ((1ULL << shift) - 1);
+    return limit > 0xffffffffULL ? 0xffffffff : (uint32_t)limit;
+}
+
+void Histogram::record(uint32_t value) {
+    mBuckets[bucketFor(value)]++;
+    mCount++;
+    if(value < mMin) mMin = value;
+    if(value > mMax) mMax = value;
+
+    double delta = value - mMean;
+    mMean += delta / mCount;
+    mM2 += delta * (value - mMean);
+}
+
+// Combines the running moments with Chan's parallel update
+void Histogram::merge(const Histogram &other) {
+    if(other.mCount == 0) {
+        return;
+    }
+    for(int i = 0; i < BUCKETS; i++) {
+        mBuckets[i] += other.mBuckets[i];
+    }
+    uint64_t total = mCount + other.mCount;
+    double delta = other.mMean - mMean;
+    mM2 += other.mM2 + delta * delta * ((double)mCount * other.mCount / total);
+    mMean += delta * other.mCount / total;
+    mCount = total;
+    if(other.mMin < mMin) mMin = other.mMin;
+    if(other.mMax > mMax) mMax = other.mMax;
+}
+
+uint32_t Histogram::quantile(double q) const {
+    if(mCount == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t)ceil(q * mCount);
+    if(target < 1) target = 1;
+
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKETS; i++) {
+        seen += mBuckets[i];
+        if(seen >= target) {
+            uint32_t limit = bucketLimit(i);
+            return limit > mMax ? mMax : limit;
+        }
+    }
+    return mMax;
+}
+
+double Histogram::mean() const {
+    return mMean;
+}
+
+double Histogram::stddev() const {
+    return mCount > 1 ? sqrt(mM2 / (mCount - 1)) : 0;
+}
@@ -0,0 +1,45 @@
+#ifndef HISTOGRAM
+#define HISTOGRAM
+
+#include "touch_vcr.h"
+
+/* Fixed size log-linear histogram of non-negative values.  Each power of two is
+ * split into SUB_BUCKETS linear buckets, so quantiles are accurate to about 1/16th
+ * of the value, and memory use doesn't depend on how many values are recorded. */
+class Histogram {
+public:
+    static const int SUB_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int MAX_BITS = 32;
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS;
+
+    Histogram();
+
+    void clear();
+    void record(uint32_t value);
+    void merge(const Histogram &other);
+
+    // Value at quantile q (0 to 1), the upper bound of its bucket
+    uint32_t quantile(double q) const;
+
+    inline uint64_t count() const { return mCount; }
+    inline uint32_t min() const { return mMin; }
+    inline uint32_t max() const { return mMax; }
+    double mean() const;
+    double stddev() const;
+
+private:
+    uint32_t mBuckets[BUCKETS];
+    uint64_t mCount;
+    uint32_t mMin;
+    uint32_t mMax;
+
+    // Running mean and variance (Welford)
+    double mMean;
+    double mM2;
+
+    static int bucketFor(uint32_t value);
+    static uint32_t bucketLimit(int bucket);
+};
+
+#endif // HISTOGRAM
@@ -1,21 +1,76 @@
 #include "InputMessenger.h"
 #include <algorithm>
 
-extern bool VERBOSE;
-
-// TODO allow alternate message formats
 // TODO have clients construct messages and send them
 
 InputMessenger::InputMessenger() {
-    mTimebase = -1;
+    mTimebase = 0;
     mMotionStart = -1;
     bufferIdx = 0;
+    inFD = -1;
+    outFD = -1;
+    mServer = NULL;
+    mRing = NULL;
+    mFlight = NULL;
+    mStrokes = NULL;
+    mBatchCallback = NULL;
+    mBatchUser = NULL;
+    mSerializer = serializerFor(OUTPUT_TEXT);
+    mHeader = NULL;
     clear_buffer();
 }
 
+void InputMessenger::setFormat(OutputFormat format) {
+    mSerializer = serializerFor(format);
+    mHeader = outputHeader(format);
+}
+
+void InputMessenger::setBatchCallback(MessageBatchCallback callback, void* user) {
+    mBatchCallback = callback;
+    mBatchUser = user;
+    mBatch.clear();
+}
+
+void InputMessenger::flushBatch() {
+    if(mBatchCallback && !mBatch.empty()) {
+        mBatchCallback(&mBatch[0], mBatch.size(), mBatchUser);
+    }
+    mBatch.clear();
+}
+
 void InputMessenger::send(Message msg) {
-    // For now just dump.  Depending on config, we'll tell it to emit a different file format
-    msg.dump(outFD);
+    if(mStrokes) {
+        mStrokes->add(msg);
+    } else if(outFD >= 0) {
+        char text[MAX_SERIALIZED_LENGTH];
+        int len = mSerializer(msg, text, sizeof(text));
+        if(len < 0) {
+            fprintf(stderr, "Unknown message format\n");
+        } else {
+            if(mHeader) {
+                // Header goes out with the first message
+                if(write(outFD, mHeader, strlen(mHeader)) < 0) {
+                    fprintf(stderr, "Failed to write header, %s\n", strerror(errno));
+                }
+                mHeader = NULL;
+            }
+            if(write(outFD, text, len) < len) {
+                fprintf(stderr, "Failed to write message, %s\n", strerror(errno));
+            }
+        }
+    }
+    if(mServer) {
+        mServer->publish(msg);
+    }
+    if(mRing) {
+        mRing->publish(msg);
+    }
+    if(mFlight) {
+        mFlight->add(msg);
+    }
+    if(mBatchCallback) {
+        mBatch.push_back(msg);
+    }
 }
 
 void InputMessenger::add_msg(Message msg) {
@@ -36,7 +91,7 @@ void InputMessenger::fill_queue() {
             msgBuffer[bufferIdx] = 0;
             bufferIdx = 0;
             Message msg;
-            if( Message::fromString(std::string(msgBuffer), msg) ) {
+            if( Message::fromText(msgBuffer, strlen(msgBuffer), msg) ) {
                 add_msg(msg);
                 if(VERBOSE) printf( "Adding message %s\n", msgBuffer);
             } else {
@@ -56,44 +111,37 @@ void InputMessenger::fill_queue() {
     if(VERBOSE) fprintf(stderr, "Done filling queue\n");
 }
 
-// Returns the time until the next message
-int InputMessenger::dequeue(int32_t now, Message &msg) {
+nsecs_t InputMessenger::nextDeadline(nsecs_t now) {
     if( msgQ.empty() ) {
         return -1;
     }
-    
-    if(VERBOSE) printf("Pulling message %d\n", msg.getTimestamp());
-    msg = msgQ.front();
-
-    if(mMotionStart < 1) {
-        mMotionStart = now;
-    }
+    const Message &msg = msgQ.front();
 
     // If there's no timebase, take it from this message
-    if( mTimebase < 1 ) {
+    if( mMotionStart < 0 ) {
+        mMotionStart = now;
         mTimebase = msg.getTimestamp();
     }
 
-    int myDelta = now - mMotionStart;
-    int nextDelta = msg.getTimestamp() - mTimebase;
-    if(VERBOSE) printf("myDelta %d\tnextDelta%d\n",myDelta,nextDelta);
+    return mMotionStart + (nsecs_t)(msg.getTimestamp() - mTimebase) * 1000000LL;
+}
 
-    if( myDelta >= nextDelta ) {
-        // If we read a reset, update the timebase
-        if( msg.isReset() ) {
-            mTimebase = msg.getTimestamp();
-            mMotionStart = now;
-        }
+bool InputMessenger::dequeue(nsecs_t now, Message &msg) {
+    nsecs_t deadline = nextDeadline(now);
+    if( deadline < 0 || now < deadline ) {
+        return false;
+    }
 
-        msgQ.pop();
+    msg = msgQ.front();
+    msgQ.pop();
+    if(VERBOSE) printf("Pulling message %d\n", msg.getTimestamp());
 
-        // Signal that it's time to play the message
-        return 0;
-    } else {
-        // Return how long we have to wait to play the next message
-        int delay = nextDelta - myDelta;
-        return (delay < 0) ? 0 : delay;
+    // If we read a reset, update the timebase
+    if( msg.isReset() ) {
+        mTimebase = msg.getTimestamp();
+        mMotionStart = (now - deadline > MAX_RESET_LATENESS) ? now : deadline;
     }
+    return true;
 }
 
 bool InputMessenger::isEmpty() {
@@ -3,7 +3,16 @@
 
 #include "touch_vcr.h"
 #include "Message.h"
+#include "StreamServer.h"
+#include "ShmRing.h"
+#include "StrokeWriter.h"
+#include "MessageFormat.h"
+#include "FlightRecorder.h"
 #include <queue>
+#include <vector>
+
+// Receives recorded messages in process, see InputMessenger::setBatchCallback
+typedef void (*MessageBatchCallback)(const Message* msgs, size_t count, void* user);
 
 class InputMessenger {
 
@@ -14,20 +23,51 @@ public:
     // All events are based off of android's monotonic clock.  Reset sends the timebase for all forthcoming
     // events, so that we can capture one set of events and replay them later
     void add_msg(Message msg);
-    int dequeue(int32_t now, Message &msg);
+
+    // Absolute CLOCK_MONOTONIC time in ns at which the next message is due, or -1 if
+    // the queue is empty.  The first message anchors the trace's timeline to now.
+    nsecs_t nextDeadline(nsecs_t now);
+    // Pops the next message if it is due at now
+    bool dequeue(nsecs_t now, Message &msg);
     void fill_queue();
     bool isEmpty();
 
     void setInFD(int fd) { inFD = fd; };
     void setOutFD(int fd) { outFD = fd; };
+    // Layout of messages written to outFD, text unless set.  Set it before any
+    // message is sent so a header lands first.
+    void setFormat(OutputFormat format);
+    void setServer(StreamServer* server) { mServer = server; };
+    void setRing(ShmRing* ring) { mRing = ring; };
+    void setFlightRecorder(FlightRecorder* recorder) { mFlight = recorder; };
+    // Record fitted strokes instead of text lines
+    void setStrokeWriter(StrokeWriter* writer) { mStrokes = writer; };
+    // Sent messages are collected and handed to callback on each flushBatch(),
+    // NULL to stop
+    void setBatchCallback(MessageBatchCallback callback, void* user);
+    void flushBatch();
 private:
     std::queue<Message> msgQ;
 
     int inFD;
     int outFD;
+    StreamServer* mServer;
+    ShmRing* mRing;
+    FlightRecorder* mFlight;
+    StrokeWriter* mStrokes;
+    MessageBatchCallback mBatchCallback;
+    void* mBatchUser;
+    std::vector<Message> mBatch;
+    MessageSerializer mSerializer;
+    const char* mHeader;
 
-    int32_t mMotionStart;
+    // Monotonic time of the message at mTimebase.  Deadlines are always computed
+    // from this anchor rather than from the previous message, so they don't drift.
+    nsecs_t mMotionStart;
     int32_t mTimebase;
+
+    // A reset this late means the queue ran dry, so restart the timeline from now
+    static const nsecs_t MAX_RESET_LATENESS = 50000000LL;
     
     static const int MAX_MSG_LENGTH = 200;
     char msgBuffer[MAX_MSG_LENGTH];
@@ -0,0 +1,109 @@
+#include "LoopPlayer.h"
+
+LoopPlayer::LoopPlayer(const Trace &trace, uint32_t count, int gapMs) :
+    mTrace(trace), mOffsets(NULL), mPeriod(0), mCount(count),
+    mJitter(0), mMaxDX(0), mMaxDY(0), mRandom(0x9e3779b9),
+    mAnchor(-1), mLoop(0), mIndex(0), mLoopStart(0), mDX(0), mDY(0), mWrapped(false), mDone(trace.size() == 0) {
+    size_t size = trace.size();
+    mOffsets = new nsecs_t[size + 1];
+    trace.timeline(mOffsets);
+    mPeriod = (size > 0 ? mOffsets[size - 1] : 0) + gapMs * 1000000LL;
+    // A trace that all shares one timestamp and no gap would replay every loop at
+    // once, forever
+    if(mPeriod < 1000000LL) {
+        mPeriod = 1000000LL;
+    }
+}
+
+LoopPlayer::~LoopPlayer() {
+    delete[] mOffsets;
+}
+
+bool LoopPlayer::parseOffsets(const char* spec) {
+    int dx, dy;
+    if(sscanf(spec, "%d,%d", &dx, &dy) != 2 || dx < 0 || dy < 0) {
+        fprintf(stderr, "Bad loop offsets %s, expected dx,dy\n", spec);
+        return false;
+    }
+    setOffsets(dx, dy);
+    return true;
+}
+
+// xorshift32, so every run of a soak test is the same
+uint32_t LoopPlayer::nextRandom() {
+    mRandom ^= mRandom << 13;
+    mRandom ^= mRandom >> 17;
+    mRandom ^= mRandom << 5;
+    return mRandom;
+}
+
+void LoopPlayer::startLoop() {
+    mIndex = 0;
+    mLoopStart = mAnchor + mLoop * mPeriod;
+    if(mJitter > 0) {
+        mLoopStart += nextRandom() % (mJitter + 1);
+    }
+    mDX = mMaxDX > 0 ? (int32_t)(nextRandom() % (2 * mMaxDX + 1)) - mMaxDX : 0;
+    mDY = mMaxDY > 0 ? (int32_t)(nextRandom() % (2 * mMaxDY + 1)) - mMaxDY : 0;
+    if(VERBOSE) fprintf(stderr, "Starting loop %u, offset %d,%d\n", mLoop, mDX, mDY);
+}
+
+nsecs_t LoopPlayer::nextDeadline(nsecs_t now) {
+    if(mDone) {
+        return -1;
+    }
+    if(mAnchor < 0) {
+        mAnchor = now;
+        startLoop();
+    }
+    return mLoopStart + mOffsets[mIndex];
+}
+
+bool LoopPlayer::dequeue(nsecs_t now, Message &msg) {
+    // Once a loop ends, report nothing due until the caller comes back, so one
+    // pass of dequeue calls plays at most one loop however far behind it is
+    if(mWrapped) {
+        mWrapped = false;
+        return false;
+    }
+    while(!mWrapped) {
+        nsecs_t deadline = nextDeadline(now);
+        if(deadline < 0 || now < deadline) {
+            return false;
+        }
+
+        bool valid = mTrace.get(mIndex, msg);
+        if(++mIndex == mTrace.size()) {
+            mLoop++;
+            if(mCount > 0 && mLoop >= mCount) {
+                mDone = true;
+                fprintf(stderr, "Finished %u loops\n", mLoop);
+            } else {
+                startLoop();
+                mWrapped = true;
+            }
+        }
+        if(!valid) {
+            continue;
+        }
+
+        if(msg.isSync() && (mDX != 0 || mDY != 0)) {
+            msg = Message::Sync(msg.getTimestamp(), msg.getTrackingID(), msg.getX() + mDX, msg.getY() + mDY);
+        }
+        return true;
+    }
+    mWrapped = false;
+    return false;
+}
+
+void LoopPlayer::dumpStats(FILE* output) const {
+    fprintf(output, "Loop player\n");
+    fprintf(output, "  loop %u of ", mLoop + (mDone ? 0 : 1));
+    if(mCount > 0) {
+        fprintf(output, "%u", mCount);
+    } else {
+        fprintf(output, "forever");
+    }
+    fprintf(output, ", period %lld ms, %u records per loop\n",
+            (long long)(mPeriod / 1000000LL), (unsigned)mTrace.size());
+}
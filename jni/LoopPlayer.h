@@ -0,0 +1,63 @@
+#ifndef LOOP_PLAYER
+#define LOOP_PLAYER
+
+#include "touch_vcr.h"
+#include "Message.h"
+#include "Trace.h"
+
+/* Replays one parsed trace over and over for soak testing.
+ *
+ * Every message's offset from the start of the trace is worked out once up
+ * front.  Loop k then starts at anchor + k * period, where the period is the
+ * trace's length plus a gap, so the timeline is absolute and nothing accumulates
+ * from one loop to the next.  Each loop can start up to a jitter late and have
+ * its coordinates shifted by a bounded random offset; neither carries over into
+ * the following loop.  Nothing is allocated once playback starts. */
+class LoopPlayer {
+public:
+    static const int DEFAULT_GAP_MS = 500;
+
+    // Plays trace count times, or forever for a count of 0.  The trace must
+    // outlive the player.  Loops are at least 1 ms apart.
+    LoopPlayer(const Trace &trace, uint32_t count, int gapMs);
+    ~LoopPlayer();
+
+    // Each loop starts up to jitterMs late and is shifted by up to +-dx, +-dy
+    void setJitter(int jitterMs) { mJitter = jitterMs * 1000000LL; }
+    void setOffsets(int32_t dx, int32_t dy) { mMaxDX = dx; mMaxDY = dy; }
+    bool parseOffsets(const char* spec);
+
+    // Same contract as InputMessenger: the first call anchors the timeline to now.
+    // A run of dequeue calls stops at the end of a loop even if the next is due.
+    nsecs_t nextDeadline(nsecs_t now);
+    bool dequeue(nsecs_t now, Message &msg);
+
+    inline bool isDone() const { return mDone; }
+    void dumpStats(FILE* output) const;
+
+private:
+    LoopPlayer(const LoopPlayer&);
+    LoopPlayer& operator=(const LoopPlayer&);
+
+    const Trace &mTrace;
+    nsecs_t* mOffsets;          // From the start of a loop, one per record
+    nsecs_t mPeriod;
+    uint32_t mCount;
+
+    nsecs_t mJitter;
+    int32_t mMaxDX, mMaxDY;
+    uint32_t mRandom;
+
+    nsecs_t mAnchor;
+    uint32_t mLoop;
+    size_t mIndex;
+    nsecs_t mLoopStart;
+    int32_t mDX, mDY;
+    bool mWrapped;              // Started a new loop since dequeue last returned false
+    bool mDone;
+
+    void startLoop();
+    uint32_t nextRandom();
+};
+
+#endif // LOOP_PLAYER
@@ -1,4 +1,5 @@
 #include "Message.h"
+#include "MessageFormat.h"
 #include "stdio.h"
 
 Message::Message() {
@@ -9,48 +10,86 @@ Message::Message() {
     mY = -1;
 }
 
+// Parses a space separated decimal integer, advancing *pos.  Bounded by end
+// since the text doesn't have to be NUL terminated.
+static bool parseField(const char** pos, const char* end, int32_t* out) {
+    const char* p = *pos;
+    while(p < end && *p == ' ') p++;
+
+    bool negative = false;
+    if(p < end && *p == '-') {
+        negative = true;
+        p++;
+    }
+    if(p == end || *p < '0' || *p > '9') {
+        return false;
+    }
+    int64_t value = 0;
+    int64_t limit = negative ? 2147483648LL : 2147483647LL;
+    while(p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        if(value > limit) {
+            return false;
+        }
+        p++;
+    }
+    // A field ends at a separator or the end of the line, so 4abc isn't 4
+    if(p < end && *p != ' ' && *p != '\r') {
+        return false;
+    }
+    *out = (int32_t)(negative ? -value : value);
+    *pos = p;
+    return true;
+}
+
+// Nothing but spaces, or the \r of a CRLF line, may follow the last field
+static bool atLineEnd(const char* p, const char* end) {
+    while(p < end && (*p == ' ' || *p == '\r')) p++;
+    return p == end;
+}
+
+bool Message::fromString(const std::string &msgText, Message &msg) {
+    return fromText(msgText.data(), msgText.size(), msg);
+}
+
 // TODO this will not scale to more message types
-bool Message::fromString(std::string msgText, Message &msg) {
-    size_t delim, last_delim;
+bool Message::fromText(const char* text, size_t len, Message &msg) {
+    const char* end = text + len;
+    const char* delim = (const char*)memchr(text, ' ', len);
+    if(!delim) {
+        return false;
+    }
 
     // TODO make delimiter a constant
-    last_delim = 0;
-    delim = msgText.find(' ');
-    if(msgText.substr(0, delim).compare("reset") == 0) {
+    size_t typeLen = delim - text;
+    if(typeLen == 5 && memcmp(text, "reset", 5) == 0) {
         msg.setType(RESET);
-    } else if(msgText.substr(0, delim).compare("stop") == 0) {
+    } else if(typeLen == 4 && memcmp(text, "stop", 4) == 0) {
         msg.setType(STOP);
-    } else if(msgText.substr(0, delim).compare("sync") == 0) {
+    } else if(typeLen == 4 && memcmp(text, "sync", 4) == 0) {
         msg.setType(SYNC);
     } else {
         return false;
     }
 
-    last_delim = delim + 1;
-    delim = msgText.find(' ', last_delim);
-    std::string ts = msgText.substr(last_delim, delim);
-    msg.setTimestamp( strtol(ts.c_str(), NULL, 10) );
+    const char* pos = delim;
+    int32_t value;
+    if(!parseField(&pos, end, &value)) return false;
+    msg.setTimestamp(value);
 
     if( msg.isSync() || msg.isStop() ) {
-        last_delim = delim + 1;
-        delim = msgText.find(' ', last_delim);
-        std::string id = msgText.substr(last_delim, delim);
-        msg.setTrackingID( strtol(id.c_str(), NULL, 10) );
+        if(!parseField(&pos, end, &value)) return false;
+        msg.setTrackingID(value);
     }
 
     if( msg.isSync() ) {
-        last_delim = delim + 1;
-        delim = msgText.find(' ', last_delim);
-        std::string x = msgText.substr(last_delim, delim);
-        msg.setX( strtol(x.c_str(), NULL, 10) );
-
-        last_delim = delim + 1;
-        delim = msgText.find(' ', last_delim);
-        std::string y = msgText.substr(last_delim, delim);
-        msg.setY( strtol(y.c_str(), NULL, 10) );
+        if(!parseField(&pos, end, &value)) return false;
+        msg.setX(value);
+        if(!parseField(&pos, end, &value)) return false;
+        msg.setY(value);
     }
 
-    return true;
+    return atLineEnd(pos, end);
 }
 
 Message Message::Reset(int32_t timestamp) {
@@ -78,16 +117,41 @@ Message Message::Sync(int32_t timestamp, int32_t trackingID, int32_t x, int32_t
     return msg;
 }
 
+bool Message::fromRecord(const MessageRecord &record, Message &msg) {
+    if( record.type != RESET && record.type != STOP && record.type != SYNC ) {
+        return false;
+    }
+    msg.setType((msg_type)record.type);
+    msg.setTimestamp(record.timestamp);
+    msg.setTrackingID(record.trackingID);
+    msg.setX(record.x);
+    msg.setY(record.y);
+    return true;
+}
+
+void Message::toRecord(MessageRecord* record) const {
+    record->timestamp = mTimestamp;
+    record->trackingID = mTrackingID;
+    record->type = mType;
+    record->x = mX;
+    record->y = mY;
+}
+
+int Message::format( char* buf, size_t len ) const {
+    if( isUnset() || len < MAX_TEXT_LENGTH ) {
+        return -1;
+    }
+    return TextFormat::write( buf, *this ) - buf;
+}
+
 void Message::dump( int fd ) {
-    FILE* output = fdopen(fd, "w");
-    if( isReset() ) {
-        fprintf( output, "reset %d\n", mTimestamp );
-    } else if( isStop() ) {
-        fprintf( output, "stop %d %d\n", mTimestamp, mTrackingID );
-    } else if( isSync() ) {
-        fprintf( output, "sync %d %d %d %d\n", mTimestamp, mTrackingID, mX, mY );
-    } else {
+    char text[MAX_TEXT_LENGTH];
+    int len = format(text, sizeof(text));
+    if( len < 0 ) {
         fprintf(stderr, "Unknown message format\n");
+        return;
+    }
+    if( write(fd, text, len) < len ) {
+        fprintf(stderr, "Failed to write message, %s\n", strerror(errno));
     }
-    fflush(output);
 }
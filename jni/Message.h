@@ -12,11 +12,22 @@ enum msg_type {
     RESET
 };
 
+// Fixed size binary form of a message, for formats that avoid text parsing
+struct MessageRecord {
+    int32_t timestamp;
+    int32_t trackingID;
+    int32_t type;
+    int32_t x;
+    int32_t y;
+};
+
 class Message {
 public:
     Message();
 
-    static bool fromString(std::string msgText, Message &msg);
+    static bool fromString(const std::string &msgText, Message &msg);
+    // Parses one line of text (without the newline) straight from a buffer
+    static bool fromText(const char* text, size_t len, Message &msg);
 
     // TODO Serialization/deserialization
     // TODO binary formats
@@ -24,6 +35,10 @@ public:
     static Message Stop(int32_t timestamp, int32_t trackingID);
     static Message Sync(int32_t timestamp, int32_t trackingID, int32_t x, int32_t y);
 
+    // Returns false if the record doesn't hold a valid message
+    static bool fromRecord(const MessageRecord &record, Message &msg);
+    void toRecord(MessageRecord* record) const;
+
     inline int32_t getTimestamp() const { return mTimestamp; }
     inline int32_t getTrackingID() const { return mTrackingID; }
     inline int32_t getX() const { return mX; }
@@ -34,15 +49,22 @@ public:
     inline bool isStop() const { return mType == STOP; }
     inline bool isSync() const { return mType == SYNC; }
 
+    // Longest line written by format(), including the newline
+    static const size_t MAX_TEXT_LENGTH = 64;
+
+    // Writes the text form of the message, newline terminated, into buf, which must
+    // hold MAX_TEXT_LENGTH.  Returns the number of characters written, or -1 for an
+    // unset message.  Other layouts are in MessageFormat.h.
+    int format( char* buf, size_t len ) const;
     void dump( int fd );
 private:
-    inline int32_t setTimestamp(int32_t ts) { mTimestamp = ts; }
-    inline int32_t setTrackingID(int32_t id) { mTrackingID = id; }
-    inline int32_t setX(int32_t x) { mX = x; }
-    inline int32_t setY(int32_t y) { mY = y; }
+    inline void setTimestamp(int32_t ts) { mTimestamp = ts; }
+    inline void setTrackingID(int32_t id) { mTrackingID = id; }
+    inline void setX(int32_t x) { mX = x; }
+    inline void setY(int32_t y) { mY = y; }
 
     inline int32_t getType() const { return mType; }
-    inline int32_t setType(msg_type type) { mType = type; }
+    inline void setType(msg_type type) { mType = type; }
 
     // Time of event in ms
     // Will overflow if the phone is not rebooted within 9 months
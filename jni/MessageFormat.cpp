@@ -0,0 +1,40 @@
+#include "MessageFormat.h"
+
+OutputFormat parseOutputFormat(const char* name) {
+    if(strcmp(name, "text") == 0) {
+        return OUTPUT_TEXT;
+    } else if(strcmp(name, "csv") == 0) {
+        return OUTPUT_CSV;
+    } else if(strcmp(name, "jsonl") == 0) {
+        return OUTPUT_JSON;
+    } else if(strcmp(name, "fixed") == 0) {
+        return OUTPUT_FIXED;
+    }
+    return OUTPUT_UNKNOWN;
+}
+
+MessageSerializer serializerFor(OutputFormat format) {
+    switch(format) {
+    case OUTPUT_CSV:
+        return serializeMessage<CsvFormat>;
+    case OUTPUT_JSON:
+        return serializeMessage<JsonFormat>;
+    case OUTPUT_FIXED:
+        return serializeMessage<FixedFormat>;
+    default:
+        return serializeMessage<TextFormat>;
+    }
+}
+
+const char* outputHeader(OutputFormat format) {
+    switch(format) {
+    case OUTPUT_CSV:
+        return CsvFormat::header();
+    case OUTPUT_JSON:
+        return JsonFormat::header();
+    case OUTPUT_FIXED:
+        return FixedFormat::header();
+    default:
+        return TextFormat::header();
+    }
+}
@@ -0,0 +1,205 @@
+#ifndef MESSAGE_FORMAT
+#define MESSAGE_FORMAT
+
+#include "touch_vcr.h"
+#include "Message.h"
+
+/* Serializers for recorded messages.  Each output format is a policy struct with
+ * a static write() that appends one line for a message at out and returns the new
+ * end; serializeMessage<Format> instantiates the whole path for one format, so the
+ * per-field code is straight line with no format checks.  Integers are written
+ * digit pairs at a time straight into the caller's buffer, in the spirit of
+ * std::to_chars, with no stdio or heap involved.
+ *
+ * Callers that pick a format at run time look up the instantiation once with
+ * serializerFor() and call through the MessageSerializer pointer. */
+
+enum OutputFormat {
+    OUTPUT_TEXT,        // sync 4118 85 215 399
+    OUTPUT_CSV,         // sync,4118,85,215,399
+    OUTPUT_JSON,        // {"type":"sync","t":4118,"id":85,"x":215,"y":399}
+    OUTPUT_FIXED,       // Space padded columns, every line the same length
+    OUTPUT_UNKNOWN
+};
+
+// Longest line any format writes, including the newline
+static const size_t MAX_SERIALIZED_LENGTH = 96;
+
+// Writes msg into buf and returns the length, or -1 if msg is unset or buf is
+// shorter than MAX_SERIALIZED_LENGTH
+typedef int (*MessageSerializer)(const Message &msg, char* buf, size_t len);
+
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Decimal digits of value into out, returns the end
+inline char* writeDecimal(char* out, int32_t value) {
+    uint32_t v = value;
+    if(value < 0) {
+        *out++ = '-';
+        v = 0 - v;
+    }
+    char digits[10];
+    char* p = digits + sizeof(digits);
+    while(v >= 100) {
+        uint32_t pair = (v % 100) * 2;
+        v /= 100;
+        *--p = DIGIT_PAIRS[pair + 1];
+        *--p = DIGIT_PAIRS[pair];
+    }
+    if(v >= 10) {
+        *--p = DIGIT_PAIRS[v * 2 + 1];
+        *--p = DIGIT_PAIRS[v * 2];
+    } else {
+        *--p = '0' + v;
+    }
+    size_t n = digits + sizeof(digits) - p;
+    memcpy(out, p, n);
+    return out + n;
+}
+
+// Right aligned in width columns
+inline char* writeDecimal(char* out, int32_t value, int width) {
+    char digits[12];
+    int n = writeDecimal(digits, value) - digits;
+    while(n < width) {
+        *out++ = ' ';
+        width--;
+    }
+    memcpy(out, digits, n);
+    return out + n;
+}
+
+template<size_t N>
+inline char* writeLiteral(char* out, const char (&text)[N]) {
+    memcpy(out, text, N - 1);
+    return out + N - 1;
+}
+
+inline char* writeType(char* out, const Message &msg) {
+    if(msg.isSync()) return writeLiteral(out, "sync");
+    if(msg.isStop()) return writeLiteral(out, "stop");
+    return writeLiteral(out, "reset");
+}
+
+struct TextFormat {
+    static const char* header() { return NULL; }
+
+    static char* write(char* out, const Message &msg) {
+        out = writeType(out, msg);
+        *out++ = ' ';
+        out = writeDecimal(out, msg.getTimestamp());
+        if(!msg.isReset()) {
+            *out++ = ' ';
+            out = writeDecimal(out, msg.getTrackingID());
+        }
+        if(msg.isSync()) {
+            *out++ = ' ';
+            out = writeDecimal(out, msg.getX());
+            *out++ = ' ';
+            out = writeDecimal(out, msg.getY());
+        }
+        *out++ = '\n';
+        return out;
+    }
+};
+
+// Every row has all five columns, the ones a type doesn't have are left empty
+struct CsvFormat {
+    static const char* header() { return "type,timestamp,id,x,y\n"; }
+
+    static char* write(char* out, const Message &msg) {
+        out = writeType(out, msg);
+        *out++ = ',';
+        out = writeDecimal(out, msg.getTimestamp());
+        *out++ = ',';
+        if(!msg.isReset()) {
+            out = writeDecimal(out, msg.getTrackingID());
+        }
+        *out++ = ',';
+        if(msg.isSync()) {
+            out = writeDecimal(out, msg.getX());
+            *out++ = ',';
+            out = writeDecimal(out, msg.getY());
+        } else {
+            *out++ = ',';
+        }
+        *out++ = '\n';
+        return out;
+    }
+};
+
+struct JsonFormat {
+    static const char* header() { return NULL; }
+
+    static char* write(char* out, const Message &msg) {
+        out = writeLiteral(out, "{\"type\":\"");
+        out = writeType(out, msg);
+        out = writeLiteral(out, "\",\"t\":");
+        out = writeDecimal(out, msg.getTimestamp());
+        if(!msg.isReset()) {
+            out = writeLiteral(out, ",\"id\":");
+            out = writeDecimal(out, msg.getTrackingID());
+        }
+        if(msg.isSync()) {
+            out = writeLiteral(out, ",\"x\":");
+            out = writeDecimal(out, msg.getX());
+            out = writeLiteral(out, ",\"y\":");
+            out = writeDecimal(out, msg.getY());
+        }
+        out = writeLiteral(out, "}\n");
+        return out;
+    }
+};
+
+// Type in 5 columns then four 11 column fields, each preceded by a space; fields
+// a type doesn't have are blank
+struct FixedFormat {
+    static const int TYPE_WIDTH = 5;
+    static const int FIELD_WIDTH = 11;
+    static const size_t LINE_LENGTH = TYPE_WIDTH + 4 * (FIELD_WIDTH + 1) + 1;
+
+    static const char* header() { return NULL; }
+
+    static char* write(char* out, const Message &msg) {
+        char* start = out;
+        out = writeType(out, msg);
+        while(out < start + TYPE_WIDTH) {
+            *out++ = ' ';
+        }
+        *out++ = ' ';
+        out = writeDecimal(out, msg.getTimestamp(), FIELD_WIDTH);
+        if(!msg.isReset()) {
+            *out++ = ' ';
+            out = writeDecimal(out, msg.getTrackingID(), FIELD_WIDTH);
+        }
+        if(msg.isSync()) {
+            *out++ = ' ';
+            out = writeDecimal(out, msg.getX(), FIELD_WIDTH);
+            *out++ = ' ';
+            out = writeDecimal(out, msg.getY(), FIELD_WIDTH);
+        }
+        while(out < start + LINE_LENGTH - 1) {
+            *out++ = ' ';
+        }
+        *out++ = '\n';
+        return out;
+    }
+};
+
+template<class Format>
+int serializeMessage(const Message &msg, char* buf, size_t len) {
+    if(msg.isUnset() || len < MAX_SERIALIZED_LENGTH) {
+        return -1;
+    }
+    return Format::write(buf, msg) - buf;
+}
+
+OutputFormat parseOutputFormat(const char* name);
+MessageSerializer serializerFor(OutputFormat format);
+// Line to write before the first message, or NULL
+const char* outputHeader(OutputFormat format);
+
+#endif // MESSAGE_FORMAT
@@ -0,0 +1,198 @@
+#include "ReplayCompiler.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+ReplayCompiler::ReplayCompiler() : mDeadline(0) {
+}
+
+void ReplayCompiler::writeFrame(const input_event* events, size_t count) {
+    CompiledFrame frame;
+    frame.deadline = mDeadline;
+    frame.firstEvent = mEvents.size();
+    frame.eventCount = count;
+    mFrames.push_back(frame);
+    mEvents.insert(mEvents.end(), events, events + count);
+}
+
+static bool write_all(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while(len > 0) {
+        ssize_t res = write(fd, p, len);
+        if(res < 0) {
+            if(errno == EINTR) continue;
+            return false;
+        }
+        p += res;
+        len -= res;
+    }
+    return true;
+}
+
+void ReplayCompiler::build(const Trace &trace, TouchPanel* panel) {
+    mFrames.clear();
+    mEvents.clear();
+    mDeadline = 0;
+    std::vector<nsecs_t> offsets(trace.size() + 1);
+    trace.timeline(&offsets[0]);
+
+    // A frame is flushed when the first message of the next one arrives, so the
+    // deadline it belongs to is the one of the message before
+    panel->setFrameSink(this);
+    Message msg;
+    for(size_t i = 0; i < trace.size(); i++) {
+        if(trace.get(i, msg)) {
+            panel->replay(msg, 0);
+            mDeadline = offsets[i];
+        }
+    }
+    panel->flushFrame();
+    panel->setFrameSink(NULL);
+}
+
+bool ReplayCompiler::save(const char* path, const DeviceProfile &profile, CompiledReplayHeader* result) const {
+    CompiledReplayHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.eventSize = sizeof(input_event);
+    header.frameCount = mFrames.size();
+    header.eventCount = mEvents.size();
+    header.profile = profile;
+
+    char tmpPath[PATH_MAX + 8];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "could not create %s, %s\n", tmpPath, strerror(errno));
+        return false;
+    }
+    bool ok = write_all(fd, &header, sizeof(header)) &&
+            (mFrames.empty() || write_all(fd, &mFrames[0], mFrames.size() * sizeof(CompiledFrame))) &&
+            (mEvents.empty() || write_all(fd, &mEvents[0], mEvents.size() * sizeof(input_event)));
+    close(fd);
+    if(!ok || rename(tmpPath, path) < 0) {
+        fprintf(stderr, "could not write %s, %s\n", path, strerror(errno));
+        unlink(tmpPath);
+        return false;
+    }
+
+    if(result) {
+        *result = header;
+    }
+    return true;
+}
+
+bool ReplayCompiler::compile(const Trace &trace, TouchPanel* panel, const char* path,
+                             CompiledReplayHeader* result) {
+    ReplayCompiler compiler;
+    compiler.build(trace, panel);
+    DeviceProfile profile;
+    panel->getProfile(&profile);
+    return compiler.save(path, profile, result);
+}
+
+size_t ReplayCompiler::fileSize(const CompiledReplayHeader &header) {
+    return sizeof(header) + (uint64_t)header.frameCount * sizeof(CompiledFrame) +
+           (uint64_t)header.eventCount * sizeof(input_event);
+}
+
+// --- CompiledReplay ---
+
+CompiledReplay::CompiledReplay() :
+    mMapping(NULL), mMappingSize(0), mFrames(NULL), mEvents(NULL), mFrameCount(0),
+    mStart(-1), mNext(0), mWrites(0), mBatchedFrames(0) {
+}
+
+CompiledReplay::~CompiledReplay() {
+    if(mMapping) {
+        munmap(mMapping, mMappingSize);
+    }
+}
+
+bool CompiledReplay::open(const char* path, const DeviceProfile &profile) {
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "could not open compiled replay %s, %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    void* base = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(CompiledReplayHeader)) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    }
+    close(fd);
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "could not map compiled replay %s\n", path);
+        return false;
+    }
+    mMapping = base;
+    mMappingSize = st.st_size;
+
+    const CompiledReplayHeader* header = (const CompiledReplayHeader*)base;
+    if(header->magic != ReplayCompiler::MAGIC || header->version != ReplayCompiler::VERSION ||
+       header->eventSize != sizeof(input_event) ||
+       mMappingSize != ReplayCompiler::fileSize(*header)) {
+        fprintf(stderr, "%s is not a compatible compiled replay\n", path);
+        return false;
+    }
+    if(memcmp(&header->profile, &profile, sizeof(profile)) != 0) {
+        fprintf(stderr, "%s was compiled for a different device or orientation, recompile it\n", path);
+        return false;
+    }
+
+    // emit() writes spans straight out of the mapping, so make sure now that no
+    // frame points outside it
+    const CompiledFrame* frames = (const CompiledFrame*)(header + 1);
+    uint32_t nextEvent = 0;
+    int64_t lastDeadline = 0;
+    for(uint32_t i = 0; i < header->frameCount; i++) {
+        const CompiledFrame &frame = frames[i];
+        if(frame.firstEvent != nextEvent || frame.eventCount > header->eventCount - nextEvent ||
+           frame.deadline < lastDeadline) {
+            fprintf(stderr, "%s is corrupt at frame %u\n", path, i);
+            return false;
+        }
+        nextEvent += frame.eventCount;
+        lastDeadline = frame.deadline;
+    }
+
+    mFrames = frames;
+    mEvents = (const input_event*)(mFrames + header->frameCount);
+    mFrameCount = header->frameCount;
+    return true;
+}
+
+nsecs_t CompiledReplay::nextDeadline(nsecs_t now) {
+    if(mNext >= mFrameCount) {
+        return -1;
+    }
+    if(mStart < 0) {
+        mStart = now;
+    }
+    return mStart + mFrames[mNext].deadline;
+}
+
+void CompiledReplay::emit(nsecs_t now, int fd) {
+    uint32_t first = mNext;
+    while(mNext < mFrameCount && mStart + mFrames[mNext].deadline <= now) {
+        mNext++;
+    }
+    if(mNext == first) {
+        return;
+    }
+
+    const CompiledFrame &last = mFrames[mNext - 1];
+    size_t count = last.firstEvent + last.eventCount - mFrames[first].firstEvent;
+    ssize_t len = count * sizeof(input_event);
+    if(write(fd, &mEvents[mFrames[first].firstEvent], len) < len) {
+        fprintf(stderr, "Failed to write compiled frames, %s\n", strerror(errno));
+    }
+    mWrites++;
+    mBatchedFrames += mNext - first - 1;
+}
+
+void CompiledReplay::dumpStats(FILE* output) const {
+    fprintf(output, "Compiled replay\n");
+    fprintf(output, "  frame %u of %u, %llu writes, %llu frames shared a write\n", mNext, mFrameCount,
+            (unsigned long long)mWrites, (unsigned long long)mBatchedFrames);
+}
@@ -0,0 +1,103 @@
+#ifndef REPLAY_COMPILER
+#define REPLAY_COMPILER
+
+#include "touch_vcr.h"
+#include "Trace.h"
+#include "TouchPanel.h"
+#include <vector>
+
+/* Compiles a trace ahead of time into exactly the input_events TouchPanel::replay
+ * would write to one particular device, so replaying it is nothing but waiting
+ * for a deadline and writing a span of memory.
+ *
+ * File layout: a CompiledReplayHeader, frameCount CompiledFrames in deadline
+ * order, then eventCount input_events.  Each frame's events are contiguous and
+ * frames follow each other, so any run of due frames is also one span.  The
+ * header carries the DeviceProfile the events were encoded for, and a compiled
+ * replay refuses to play on a device with a different one. */
+
+struct CompiledReplayHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t eventSize;         // sizeof(input_event), which differs between ABIs
+    uint32_t frameCount;
+    uint32_t eventCount;
+    uint32_t reserved;
+    DeviceProfile profile;
+};
+
+struct CompiledFrame {
+    int64_t deadline;           // ns from the start of the replay
+    uint32_t firstEvent;
+    uint32_t eventCount;
+};
+
+class ReplayCompiler : public FrameSink {
+public:
+    static const uint32_t MAGIC = 0x52435654;   // "TVCR"
+    static const uint32_t VERSION = 1;
+
+    ReplayCompiler();
+
+    // Encodes trace with panel's frame encoder into memory.  panel's replay state
+    // should be idle, and is again afterwards if every contact in the trace lifts.
+    void build(const Trace &trace, TouchPanel* panel);
+
+    // Writes what was built to path, for a device with profile.  The written
+    // header is copied to result.
+    bool save(const char* path, const DeviceProfile &profile, CompiledReplayHeader* result = NULL) const;
+
+    // build() then save() for panel's own profile
+    static bool compile(const Trace &trace, TouchPanel* panel, const char* path,
+                        CompiledReplayHeader* result = NULL);
+    static size_t fileSize(const CompiledReplayHeader &header);
+
+    inline const CompiledFrame* frames() const { return mFrames.empty() ? NULL : &mFrames[0]; }
+    inline const input_event* events() const { return mEvents.empty() ? NULL : &mEvents[0]; }
+    inline uint32_t frameCount() const { return mFrames.size(); }
+    inline uint32_t eventCount() const { return mEvents.size(); }
+
+    virtual void writeFrame(const input_event* events, size_t count);
+
+private:
+    nsecs_t mDeadline;      // Of the frame being encoded
+    std::vector<CompiledFrame> mFrames;
+    std::vector<input_event> mEvents;
+};
+
+// A compiled replay mapped from disk
+class CompiledReplay {
+public:
+    CompiledReplay();
+    ~CompiledReplay();
+
+    // Maps path and checks it was compiled for profile and that every frame lies
+    // within the file, in order
+    bool open(const char* path, const DeviceProfile &profile);
+
+    // Same contract as InputMessenger: the first call anchors the timeline to now
+    nsecs_t nextDeadline(nsecs_t now);
+
+    // Writes every frame due by now to fd in one write
+    void emit(nsecs_t now, int fd);
+
+    inline bool isDone() const { return mNext >= mFrameCount; }
+    void dumpStats(FILE* output) const;
+
+private:
+    CompiledReplay(const CompiledReplay&);
+    CompiledReplay& operator=(const CompiledReplay&);
+
+    void* mMapping;
+    size_t mMappingSize;
+    const CompiledFrame* mFrames;
+    const input_event* mEvents;
+    uint32_t mFrameCount;
+
+    nsecs_t mStart;
+    uint32_t mNext;
+    uint64_t mWrites;
+    uint64_t mBatchedFrames;    // Written in the same span as an earlier frame
+};
+
+#endif // REPLAY_COMPILER
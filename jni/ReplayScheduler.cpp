@@ -0,0 +1,110 @@
+#include "ReplayScheduler.h"
+#include "Clock.h"
+#include <sys/syscall.h>
+
+// The NDK's API level predates the timerfd wrappers, so go through syscall()
+#ifndef TFD_TIMER_ABSTIME
+#define TFD_TIMER_ABSTIME       1
+#endif
+#ifndef TFD_NONBLOCK
+#define TFD_NONBLOCK            O_NONBLOCK
+#endif
+#ifndef TFD_CLOEXEC
+#define TFD_CLOEXEC             O_CLOEXEC
+#endif
+
+// Frames later than this count as late
+static const nsecs_t LATE_THRESHOLD = 100000LL;
+static const nsecs_t BUDGET_WINDOW = 1000000000LL;
+
+ReplayScheduler::ReplayScheduler(nsecs_t spinWindow, int spinBudget) :
+    mTimerFD(-1), mSpinWindow(spinWindow), mSpinBudget(spinBudget), mDeadline(-1),
+    mBudgetWindowStart(0), mSpunInWindow(0),
+    mFrames(0), mLateFrames(0), mTotalError(0), mMaxError(0), mTotalSpin(0) {
+}
+
+ReplayScheduler::~ReplayScheduler() {
+    if(mTimerFD >= 0) {
+        close(mTimerFD);
+    }
+}
+
+int ReplayScheduler::open() {
+    mTimerFD = syscall(__NR_timerfd_create, CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(mTimerFD < 0) {
+        fprintf(stderr, "could not create replay timer, %s\n", strerror(errno));
+    }
+    return mTimerFD;
+}
+
+bool ReplayScheduler::spinAllowed(nsecs_t now) {
+    if(now - mBudgetWindowStart >= BUDGET_WINDOW) {
+        mBudgetWindowStart = now;
+        mSpunInWindow = 0;
+    }
+    return mSpunInWindow < BUDGET_WINDOW / 100 * mSpinBudget;
+}
+
+void ReplayScheduler::arm(nsecs_t deadline) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    mDeadline = deadline;
+
+    if(deadline >= 0) {
+        nsecs_t wake = deadline;
+        if(spinAllowed(Clock::getMonotonicNs())) {
+            wake -= mSpinWindow;
+        }
+        // An all-zero it_value disarms the timer, so never arm for time zero
+        if(wake < 1) {
+            wake = 1;
+        }
+        spec.it_value.tv_sec = wake / 1000000000LL;
+        spec.it_value.tv_nsec = wake % 1000000000LL;
+    }
+
+    if(syscall(__NR_timerfd_settime, mTimerFD, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        fprintf(stderr, "could not arm replay timer, %s\n", strerror(errno));
+    }
+}
+
+nsecs_t ReplayScheduler::waitForDeadline() {
+    uint64_t expirations;
+    if(read(mTimerFD, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        fprintf(stderr, "could not read replay timer, %s\n", strerror(errno));
+    }
+
+    nsecs_t now = Clock::getMonotonicNs();
+    if(mDeadline < 0 || now >= mDeadline) {
+        return now;
+    }
+
+    nsecs_t spinStart = now;
+    if(spinAllowed(now)) {
+        while(now < mDeadline) {
+            now = Clock::getMonotonicNs();
+        }
+    }
+    mSpunInWindow += now - spinStart;
+    mTotalSpin += now - spinStart;
+    return now;
+}
+
+void ReplayScheduler::noteEmit(nsecs_t deadline, nsecs_t emitted) {
+    nsecs_t error = emitted - deadline;
+    mFrames++;
+    mTotalError += error;
+    if(error > mMaxError) {
+        mMaxError = error;
+    }
+    if(error > LATE_THRESHOLD) {
+        mLateFrames++;
+    }
+}
+
+void ReplayScheduler::dumpStats(FILE* output) const {
+    fprintf(output, "Replay scheduler: %llu frames, mean error %lldus, max %lldus, %llu over %lldus, spun %lldms\n",
+            (unsigned long long)mFrames, (long long)(mFrames ? mTotalError / (nsecs_t)mFrames / 1000 : 0),
+            (long long)(mMaxError / 1000), (unsigned long long)mLateFrames, (long long)(LATE_THRESHOLD / 1000),
+            (long long)(mTotalSpin / 1000000));
+}
@@ -0,0 +1,53 @@
+#ifndef REPLAY_SCHEDULER
+#define REPLAY_SCHEDULER
+
+#include "touch_vcr.h"
+
+/* Gets replayed frames out on time.  A timerfd is armed at an absolute
+ * CLOCK_MONOTONIC time a little before each frame's deadline, so the poll loop
+ * sleeps until then; the last stretch is busy-waited, which is far more precise
+ * than a wakeup.  Spinning is capped to a share of CPU time per second; once the
+ * cap is used up the timer is armed for the deadline itself until the next second. */
+class ReplayScheduler {
+public:
+    static const nsecs_t DEFAULT_SPIN_WINDOW = 200000LL;   // 200us
+    static const int DEFAULT_SPIN_BUDGET = 10;              // Percent of a core
+
+    ReplayScheduler(nsecs_t spinWindow, int spinBudget);
+    ~ReplayScheduler();
+
+    // Returns the timerfd to poll for POLLIN, or -1 on failure
+    int open();
+
+    // Wake up for a frame due at deadline.  A negative deadline disarms the timer.
+    void arm(nsecs_t deadline);
+
+    // Called once the timerfd is readable.  Spins until the armed deadline (when
+    // within budget) and returns the current time.
+    nsecs_t waitForDeadline();
+
+    // Record how late a frame due at deadline actually went out
+    void noteEmit(nsecs_t deadline, nsecs_t emitted);
+
+    void dumpStats(FILE* output) const;
+
+private:
+    int mTimerFD;
+    nsecs_t mSpinWindow;
+    int mSpinBudget;
+    nsecs_t mDeadline;
+
+    // Spin accounting for the current one second window
+    nsecs_t mBudgetWindowStart;
+    nsecs_t mSpunInWindow;
+
+    uint64_t mFrames;
+    uint64_t mLateFrames;
+    nsecs_t mTotalError;
+    nsecs_t mMaxError;
+    nsecs_t mTotalSpin;
+
+    bool spinAllowed(nsecs_t now);
+};
+
+#endif // REPLAY_SCHEDULER
@@ -0,0 +1,189 @@
+#include "ShmRing.h"
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int futex(volatile uint32_t* addr, int op, uint32_t value, const struct timespec* timeout) {
+    return syscall(__NR_futex, addr, op, value, timeout, NULL, 0);
+}
+
+size_t ShmRing::mappingSize(uint32_t capacity) {
+    return sizeof(ShmRingHeader) + capacity * sizeof(ShmRingSlot);
+}
+
+// --- ShmRing ---
+
+ShmRing::ShmRing() : mHeader(NULL), mSlots(NULL), mSize(0), mMask(0) {
+}
+
+ShmRing::~ShmRing() {
+    if(mHeader) {
+        munmap(mHeader, mSize);
+    }
+}
+
+bool ShmRing::create(const char* path, uint32_t capacity) {
+    if(capacity == 0 || capacity > MAX_CAPACITY) {
+        fprintf(stderr, "ring capacity %u is out of range, expected 1 to %u records\n", capacity, MAX_CAPACITY);
+        return false;
+    }
+    uint32_t size = 1;
+    while(size < capacity) {
+        size <<= 1;
+    }
+    capacity = size;
+    mSize = mappingSize(capacity);
+
+    int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "could not create ring %s, %s\n", path, strerror(errno));
+        return false;
+    }
+    if(ftruncate(fd, mSize) < 0) {
+        fprintf(stderr, "could not size ring %s, %s\n", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    void* base = mmap(NULL, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "could not map ring %s, %s\n", path, strerror(errno));
+        return false;
+    }
+
+    mHeader = (ShmRingHeader*)base;
+    mSlots = (ShmRingSlot*)(mHeader + 1);
+    mMask = capacity - 1;
+
+    // The file is freshly truncated, so every slot seq is already 0 (invalid).
+    // Publish the magic last so readers never see a half initialized header.
+    mHeader->version = VERSION;
+    mHeader->recordSize = sizeof(ShmRingSlot);
+    mHeader->capacity = capacity;
+    mHeader->writeSeq = 0;
+    __sync_synchronize();
+    mHeader->magic = MAGIC;
+
+    fprintf(stderr, "Writing %u record ring to %s (%d bytes)\n", capacity, path, (int)mSize);
+    return true;
+}
+
+void ShmRing::publish(const Message &msg) {
+    if(!mHeader) {
+        return;
+    }
+    uint32_t seq = mHeader->writeSeq;
+    ShmRingSlot* slot = &mSlots[seq & mMask];
+
+    // Invalidate, fill, then validate the slot, and only then advance the ring
+    slot->seq = 0;
+    __sync_synchronize();
+    msg.toRecord(&slot->record);
+    __sync_synchronize();
+    slot->seq = seq + 1;
+    __sync_synchronize();
+    mHeader->writeSeq = seq + 1;
+
+    // Readers map the ring read-only and can't announce themselves, so always wake.
+    // With no waiters this is a cheap syscall.
+    futex(&mHeader->writeSeq, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+// --- ShmRingReader ---
+
+ShmRingReader::ShmRingReader() :
+    mHeader(NULL), mSlots(NULL), mSize(0), mMask(0), mReadSeq(0), mLost(0) {
+}
+
+ShmRingReader::~ShmRingReader() {
+    if(mHeader) {
+        munmap((void*)mHeader, mSize);
+    }
+}
+
+bool ShmRingReader::open(const char* path) {
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "could not open ring %s, %s\n", path, strerror(errno));
+        return false;
+    }
+
+    ShmRingHeader header;
+    if(::read(fd, &header, sizeof(header)) < (ssize_t)sizeof(header) || header.magic != ShmRing::MAGIC ||
+       header.version != ShmRing::VERSION || header.recordSize != sizeof(ShmRingSlot) ||
+       header.capacity == 0 || header.capacity > ShmRing::MAX_CAPACITY ||
+       (header.capacity & (header.capacity - 1)) != 0) {
+        fprintf(stderr, "%s is not a compatible ring\n", path);
+        close(fd);
+        return false;
+    }
+
+    mSize = ShmRing::mappingSize(header.capacity);
+    void* base = mmap(NULL, mSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "could not map ring %s, %s\n", path, strerror(errno));
+        return false;
+    }
+
+    mHeader = (const ShmRingHeader*)base;
+    mSlots = (const ShmRingSlot*)(mHeader + 1);
+    mMask = header.capacity - 1;
+    mReadSeq = mHeader->writeSeq;
+    return true;
+}
+
+size_t ShmRingReader::read(Message* msgs, size_t max) {
+    size_t count = 0;
+    while(count < max) {
+        uint32_t writeSeq = mHeader->writeSeq;
+        __sync_synchronize();
+        if(writeSeq == mReadSeq) {
+            break;
+        }
+
+        // Lapped by the writer, skip ahead to the oldest record still in the ring
+        if(writeSeq - mReadSeq > mMask + 1) {
+            mLost += writeSeq - mReadSeq - (mMask + 1);
+            mReadSeq = writeSeq - (mMask + 1);
+        }
+
+        const ShmRingSlot* slot = &mSlots[mReadSeq & mMask];
+        uint32_t expected = mReadSeq + 1;
+        if(slot->seq != expected) {
+            // Being rewritten right now
+            mLost++;
+            mReadSeq++;
+            continue;
+        }
+        __sync_synchronize();
+        MessageRecord record = slot->record;
+        __sync_synchronize();
+        if(slot->seq != expected) {
+            mLost++;
+            mReadSeq++;
+            continue;
+        }
+
+        mReadSeq++;
+        if(Message::fromRecord(record, msgs[count])) {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool ShmRingReader::wait(int timeout) {
+    uint32_t seq = mHeader->writeSeq;
+    if(seq != mReadSeq) {
+        return true;
+    }
+
+    struct timespec ts;
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    futex(const_cast<volatile uint32_t*>(&mHeader->writeSeq), FUTEX_WAIT, seq, timeout < 0 ? NULL : &ts);
+    return mHeader->writeSeq != mReadSeq;
+}
@@ -0,0 +1,82 @@
+#ifndef SHM_RING
+#define SHM_RING
+
+#include "touch_vcr.h"
+#include "Message.h"
+
+/* Single writer, multiple reader ring of MessageRecords in a shared file
+ * mapping.  The writer never waits for readers; each reader keeps its own
+ * position and detects when it has been lapped.
+ *
+ * Layout: a ShmRingHeader followed by capacity ShmRingSlots.  A slot is valid
+ * for sequence n when its seq field holds n + 1, which lets readers verify that
+ * the record they copied wasn't overwritten underneath them.  Readers can block
+ * on header.writeSeq with FUTEX_WAIT; the writer wakes it after every record. */
+
+struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t capacity;              // Power of two
+    volatile uint32_t writeSeq;     // Number of records ever written, wraps
+    uint32_t reserved[3];
+};
+
+struct ShmRingSlot {
+    volatile uint32_t seq;
+    MessageRecord record;
+};
+
+class ShmRing {
+public:
+    static const uint32_t MAGIC = 0x54565352;   // "TVSR"
+    static const uint32_t VERSION = 1;
+    // Keeps the mapping well inside a 32-bit address space
+    static const uint32_t MAX_CAPACITY = 1 << 24;
+
+    ShmRing();
+    ~ShmRing();
+
+    // Creates (or truncates) the backing file at path, capacity is rounded up to a
+    // power of two.  Fails for 0 or more than MAX_CAPACITY.
+    bool create(const char* path, uint32_t capacity);
+    void publish(const Message &msg);
+
+    // Capacity must be at most MAX_CAPACITY
+    static size_t mappingSize(uint32_t capacity);
+
+private:
+    ShmRingHeader* mHeader;
+    ShmRingSlot* mSlots;
+    size_t mSize;
+    uint32_t mMask;
+};
+
+class ShmRingReader {
+public:
+    ShmRingReader();
+    ~ShmRingReader();
+
+    // Maps the ring read-only and starts at the current write position
+    bool open(const char* path);
+
+    // Copies up to max messages into msgs and returns how many were read.
+    // Records overwritten before they could be read are added to the lost count.
+    size_t read(Message* msgs, size_t max);
+
+    // Blocks until the writer publishes past the reader's position, or the timeout
+    // (in ms, -1 for none) expires.  Returns false on timeout.
+    bool wait(int timeout);
+
+    inline uint64_t getLost() const { return mLost; }
+
+private:
+    const ShmRingHeader* mHeader;
+    const ShmRingSlot* mSlots;
+    size_t mSize;
+    uint32_t mMask;
+    uint32_t mReadSeq;
+    uint64_t mLost;
+};
+
+#endif // SHM_RING
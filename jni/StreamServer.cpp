@@ -0,0 +1,290 @@
+#include "StreamServer.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+StreamServer::StreamServer(size_t queueLength, DropPolicy policy) :
+    mListenFD(-1), mQueueLength(queueLength), mPolicy(policy), mLastTimestamp(0),
+    mSerializer(serializerFor(OUTPUT_TEXT)), mHeader(NULL), mSubscriberCount(0) {
+}
+
+void StreamServer::setFormat(OutputFormat format) {
+    mSerializer = serializerFor(format);
+    mHeader = outputHeader(format);
+}
+
+StreamServer::~StreamServer() {
+    while(mSubscriberCount > 0) {
+        removeSubscriber(mSubscriberCount - 1);
+    }
+    if(mListenFD >= 0) {
+        close(mListenFD);
+    }
+}
+
+DropPolicy StreamServer::parseDropPolicy(const char* name) {
+    if(strcmp(name, "newest") == 0) {
+        return DROP_NEWEST;
+    } else if(strcmp(name, "disconnect") == 0) {
+        return DISCONNECT;
+    } else if(strcmp(name, "oldest") != 0) {
+        fprintf(stderr, "Unknown drop policy %s, using oldest\n", name);
+    }
+    return DROP_OLDEST;
+}
+
+int StreamServer::listenUnix(const char* path, int backlog) {
+    struct sockaddr_un addr;
+    socklen_t addrLen;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    addrLen = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    if(path[0] == '@') {
+        addr.sun_path[0] = '\0';
+    } else {
+        unlink(path);
+        addrLen += 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) {
+        fprintf(stderr, "could not create socket, %s\n", strerror(errno));
+        return -1;
+    }
+    if(bind(fd, (struct sockaddr*)&addr, addrLen) < 0 || ::listen(fd, backlog) < 0) {
+        fprintf(stderr, "could not listen on %s, %s\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+int StreamServer::listen(const char* path) {
+    mListenFD = listenUnix(path, MAX_SUBSCRIBERS);
+    if(mListenFD < 0) {
+        return -1;
+    }
+
+    fprintf(stderr, "Serving touch stream on %s\n", path);
+    return mListenFD;
+}
+
+void StreamServer::acceptSubscriber() {
+    int fd = accept(mListenFD, NULL, NULL);
+    if(fd < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK) {
+            fprintf(stderr, "accept failed, %s\n", strerror(errno));
+        }
+        return;
+    }
+    if(mSubscriberCount >= MAX_SUBSCRIBERS) {
+        fprintf(stderr, "Too many subscribers, rejecting fd %d\n", fd);
+        close(fd);
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    Subscriber* sub = &mSubscribers[mSubscriberCount++];
+    sub->fd = fd;
+    sub->ring = new Entry[mQueueLength];
+    sub->head = 0;
+    sub->count = 0;
+    sub->headOffset = 0;
+    memset(&sub->stats, 0, sizeof(sub->stats));
+    sub->stats.fd = fd;
+
+    if(mHeader) {
+        Entry entry;
+        entry.length = strlen(mHeader);
+        entry.timestamp = mLastTimestamp;
+        memcpy(entry.text, mHeader, entry.length);
+        enqueue(sub, entry);
+    }
+    if(VERBOSE) fprintf(stderr, "Subscriber connected on fd %d\n", fd);
+}
+
+void StreamServer::removeSubscriber(size_t index) {
+    Subscriber* sub = &mSubscribers[index];
+    if(VERBOSE) {
+        fprintf(stderr, "Subscriber on fd %d disconnected: sent %llu dropped %llu\n", sub->fd,
+                (unsigned long long)sub->stats.sent, (unsigned long long)sub->stats.dropped);
+    }
+    close(sub->fd);
+    delete[] sub->ring;
+
+    // Keep the array packed
+    mSubscriberCount--;
+    if(index != mSubscriberCount) {
+        mSubscribers[index] = mSubscribers[mSubscriberCount];
+    }
+}
+
+void StreamServer::publish(const Message &msg) {
+    if(mSubscriberCount == 0) {
+        return;
+    }
+
+    // Format once for everybody
+    Entry entry;
+    int len = mSerializer(msg, entry.text, sizeof(entry.text));
+    if(len < 0) {
+        return;
+    }
+    entry.length = len;
+    entry.timestamp = msg.getTimestamp();
+    mLastTimestamp = entry.timestamp;
+
+    size_t i = 0;
+    while(i < mSubscriberCount) {
+        Subscriber* sub = &mSubscribers[i];
+        if(!enqueue(sub, entry) || !flush(sub)) {
+            removeSubscriber(i);
+            continue;
+        }
+        i++;
+    }
+}
+
+// Returns false if the subscriber should be disconnected
+bool StreamServer::enqueue(Subscriber* sub, const Entry &entry) {
+    if(sub->count == mQueueLength) {
+        sub->stats.dropped++;
+        switch(mPolicy) {
+        case DISCONNECT:
+            return false;
+        case DROP_NEWEST:
+            return true;
+        case DROP_OLDEST:
+            if(sub->headOffset == 0) {
+                sub->head = (sub->head + 1) % mQueueLength;
+                sub->count--;
+                break;
+            }
+            // The head is half written and has to go out whole, so drop the
+            // incoming message instead
+            return true;
+        }
+    }
+    sub->ring[(sub->head + sub->count) % mQueueLength] = entry;
+    sub->count++;
+    return true;
+}
+
+// Writes as much of the queue as the socket takes.  Returns false on error.
+bool StreamServer::flush(Subscriber* sub) {
+    while(sub->count > 0) {
+        Entry* entry = &sub->ring[sub->head];
+        ssize_t res = send(sub->fd, entry->text + sub->headOffset, entry->length - sub->headOffset,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(res < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        sub->stats.bytes += res;
+        sub->headOffset += res;
+        if(sub->headOffset < entry->length) {
+            return true;
+        }
+        sub->headOffset = 0;
+        sub->head = (sub->head + 1) % mQueueLength;
+        sub->count--;
+        sub->stats.sent++;
+    }
+    return true;
+}
+
+int StreamServer::fillPollFds(struct pollfd* fds, int maxFds) {
+    int n = 0;
+    if(mListenFD >= 0 && n < maxFds) {
+        fds[n].fd = mListenFD;
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        n++;
+    }
+    for(size_t i = 0; i < mSubscriberCount && n < maxFds; i++) {
+        fds[n].fd = mSubscribers[i].fd;
+        fds[n].events = POLLIN | (mSubscribers[i].count > 0 ? POLLOUT : 0);
+        fds[n].revents = 0;
+        n++;
+    }
+    return n;
+}
+
+void StreamServer::handlePollFds(const struct pollfd* fds, int count) {
+    bool accepting = false;
+    for(int n = 0; n < count; n++) {
+        if(fds[n].revents == 0) {
+            continue;
+        }
+        if(fds[n].fd == mListenFD) {
+            accepting = true;
+            continue;
+        }
+
+        // Subscribers may have been removed since the poll set was built, so look
+        // them up by fd
+        size_t i;
+        for(i = 0; i < mSubscriberCount; i++) {
+            if(mSubscribers[i].fd == fds[n].fd) break;
+        }
+        if(i == mSubscriberCount) {
+            continue;
+        }
+        Subscriber* sub = &mSubscribers[i];
+
+        bool alive = !(fds[n].revents & (POLLERR | POLLNVAL));
+        if(alive && (fds[n].revents & (POLLIN | POLLHUP))) {
+            // Subscribers don't talk; anything read is discarded and EOF means gone
+            char discard[64];
+            ssize_t res = recv(sub->fd, discard, sizeof(discard), MSG_DONTWAIT);
+            alive = res > 0 || (res < 0 && (errno == EAGAIN || errno == EINTR));
+        }
+        if(alive && (fds[n].revents & POLLOUT)) {
+            alive = flush(sub);
+        }
+        if(!alive) {
+            removeSubscriber(i);
+        }
+    }
+
+    // Accept last so new subscribers don't shift the entries above
+    if(accepting) {
+        acceptSubscriber();
+    }
+}
+
+bool StreamServer::getStats(size_t index, SubscriberStats* outStats) const {
+    if(index >= mSubscriberCount) {
+        return false;
+    }
+    const Subscriber* sub = &mSubscribers[index];
+    *outStats = sub->stats;
+    outStats->queued = sub->count;
+    outStats->lag = sub->count > 0 ? mLastTimestamp - sub->ring[sub->head].timestamp : 0;
+    return true;
+}
+
+void StreamServer::dumpStats(FILE* output) const {
+    fprintf(output, "%d subscribers\n", (int)mSubscriberCount);
+    for(size_t i = 0; i < mSubscriberCount; i++) {
+        SubscriberStats stats;
+        getStats(i, &stats);
+        fprintf(output, "  fd %d: sent %llu dropped %llu bytes %llu queued %d lag %dms\n",
+                stats.fd, (unsigned long long)stats.sent, (unsigned long long)stats.dropped,
+                (unsigned long long)stats.bytes, (int)stats.queued, stats.lag);
+    }
+}
@@ -0,0 +1,91 @@
+#ifndef STREAM_SERVER
+#define STREAM_SERVER
+
+#include "touch_vcr.h"
+#include "Message.h"
+#include "MessageFormat.h"
+
+enum DropPolicy {
+    DROP_OLDEST,    // Discard the oldest queued message to make room
+    DROP_NEWEST,    // Discard the message being published
+    DISCONNECT      // Hang up on the subscriber
+};
+
+/* Serves the recorded message stream on a Unix domain socket.  Any number of
+ * subscribers (up to MAX_SUBSCRIBERS) can connect; each one gets its own bounded
+ * queue so a slow reader only ever loses its own messages and never blocks
+ * recording or the other subscribers. */
+class StreamServer {
+public:
+    static const int MAX_SUBSCRIBERS = 16;
+
+    struct SubscriberStats {
+        int fd;
+        uint64_t sent;          // Messages fully written
+        uint64_t dropped;       // Messages discarded by the drop policy
+        uint64_t bytes;
+        size_t queued;          // Messages waiting to be written
+        int32_t lag;            // ms between the oldest queued and the newest published message
+    };
+
+    StreamServer(size_t queueLength, DropPolicy policy);
+    ~StreamServer();
+
+    // Paths starting with '@' are bound in the abstract namespace
+    int listen(const char* path);
+
+    // Creates a non-blocking listening Unix socket at path, with the same naming
+    // rules.  Returns the fd or -1.
+    static int listenUnix(const char* path, int backlog);
+
+    // Subscribers get the same layout as the recording, text unless set.  Formats
+    // with a header send it to each subscriber as it connects.
+    void setFormat(OutputFormat format);
+
+    void publish(const Message &msg);
+
+    // Poll integration.  fillPollFds() writes the listening socket and all
+    // subscribers into fds and returns how many were used; handlePollFds() must be
+    // called with the same entries after poll() returns.
+    int fillPollFds(struct pollfd* fds, int maxFds);
+    void handlePollFds(const struct pollfd* fds, int count);
+
+    size_t getSubscriberCount() const { return mSubscriberCount; }
+    bool getStats(size_t index, SubscriberStats* outStats) const;
+    void dumpStats(FILE* output) const;
+
+    static DropPolicy parseDropPolicy(const char* name);
+
+private:
+    struct Entry {
+        int32_t timestamp;
+        uint16_t length;
+        char text[MAX_SERIALIZED_LENGTH];
+    };
+
+    struct Subscriber {
+        int fd;
+        Entry* ring;
+        size_t head;
+        size_t count;
+        size_t headOffset;      // Bytes of the head entry already written
+        SubscriberStats stats;
+    };
+
+    int mListenFD;
+    size_t mQueueLength;
+    DropPolicy mPolicy;
+    int32_t mLastTimestamp;
+    MessageSerializer mSerializer;
+    const char* mHeader;
+
+    Subscriber mSubscribers[MAX_SUBSCRIBERS];
+    size_t mSubscriberCount;
+
+    void acceptSubscriber();
+    void removeSubscriber(size_t index);
+    bool enqueue(Subscriber* sub, const Entry &entry);
+    bool flush(Subscriber* sub);
+};
+
+#endif // STREAM_SERVER
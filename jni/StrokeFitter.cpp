@@ -0,0 +1,102 @@
+#include "StrokeFitter.h"
+#include <math.h>
+
+static inline int32_t roundToInt(double value) {
+    return (int32_t)floor(value + 0.5);
+}
+
+void StrokeFitter::fit(const StrokeSample* samples, size_t count, double maxError,
+        std::vector<StrokeSegment> &out) {
+    if(count >= 2) {
+        fitRange(samples, 0, count - 1, maxError, out);
+    }
+}
+
+void StrokeFitter::fitRange(const StrokeSample* samples, size_t first, size_t last, double maxError,
+        std::vector<StrokeSegment> &out) {
+    const StrokeSample &p0 = samples[first];
+    const StrokeSample &p3 = samples[last];
+    double duration = p3.t - p0.t;
+    double dx = p3.x - p0.x;
+    double dy = p3.y - p0.y;
+
+    // Least squares for the inner control points, relative to p0, with both
+    // end points fixed:  sum over samples of |B1*P1 + B2*P2 - (S - B3*P3)|^2
+    double c11 = 0, c12 = 0, c22 = 0;
+    double rx1 = 0, rx2 = 0, ry1 = 0, ry2 = 0;
+    for(size_t i = first + 1; i < last; i++) {
+        double u = (samples[i].t - p0.t) / duration;
+        double v = 1 - u;
+        double b1 = 3 * u * v * v;
+        double b2 = 3 * u * u * v;
+        double b3 = u * u * u;
+        double sx = samples[i].x - p0.x - b3 * dx;
+        double sy = samples[i].y - p0.y - b3 * dy;
+        c11 += b1 * b1;
+        c12 += b1 * b2;
+        c22 += b2 * b2;
+        rx1 += b1 * sx;
+        rx2 += b2 * sx;
+        ry1 += b1 * sy;
+        ry2 += b2 * sy;
+    }
+
+    double x1, y1, x2, y2;
+    double det = c11 * c22 - c12 * c12;
+    if(last - first >= 3 && fabs(det) > 1e-12) {
+        x1 = (rx1 * c22 - rx2 * c12) / det;
+        y1 = (ry1 * c22 - ry2 * c12) / det;
+        x2 = (c11 * rx2 - c12 * rx1) / det;
+        y2 = (c11 * ry2 - c12 * ry1) / det;
+    } else {
+        // Too few samples to pin the curve down, go straight at constant speed
+        x1 = dx / 3;
+        y1 = dy / 3;
+        x2 = dx * 2 / 3;
+        y2 = dy * 2 / 3;
+    }
+
+    StrokeSegment segment;
+    segment.duration = p3.t - p0.t;
+    segment.x1 = roundToInt(x1 * QUARTER);
+    segment.y1 = roundToInt(y1 * QUARTER);
+    segment.x2 = roundToInt(x2 * QUARTER);
+    segment.y2 = roundToInt(y2 * QUARTER);
+    segment.x3 = p3.x - p0.x;
+    segment.y3 = p3.y - p0.y;
+
+    // Check the quantized curve, since that's what gets replayed
+    double worst = 0;
+    size_t worstIndex = first;
+    for(size_t i = first + 1; i < last; i++) {
+        int32_t x, y;
+        evaluate(segment, p0.x, p0.y, samples[i].t - p0.t, &x, &y);
+        double ex = x - samples[i].x;
+        double ey = y - samples[i].y;
+        double error = ex * ex + ey * ey;
+        if(error > worst) {
+            worst = error;
+            worstIndex = i;
+        }
+    }
+
+    if(worst > maxError * maxError && worstIndex > first) {
+        fitRange(samples, first, worstIndex, maxError, out);
+        fitRange(samples, worstIndex, last, maxError, out);
+    } else {
+        out.push_back(segment);
+    }
+}
+
+void StrokeFitter::evaluate(const StrokeSegment &segment, int32_t x0, int32_t y0, double t,
+        int32_t* x, int32_t* y) {
+    double u = segment.duration > 0 ? t / segment.duration : 1;
+    if(u < 0) u = 0;
+    if(u > 1) u = 1;
+    double v = 1 - u;
+    double b1 = 3 * u * v * v / QUARTER;
+    double b2 = 3 * u * u * v / QUARTER;
+    double b3 = u * u * u;
+    *x = x0 + roundToInt(b1 * segment.x1 + b2 * segment.x2 + b3 * segment.x3);
+    *y = y0 + roundToInt(b1 * segment.y1 + b2 * segment.y2 + b3 * segment.y3);
+}
@@ -0,0 +1,45 @@
+#ifndef STROKE_FITTER
+#define STROKE_FITTER
+
+#include "touch_vcr.h"
+#include <vector>
+
+struct StrokeSample {
+    int32_t t;          // ms
+    int32_t x;
+    int32_t y;
+};
+
+// One cubic Bezier piece of a stroke.  The start point is the end of the previous
+// piece (or the stroke's first sample); p3 always lands exactly on a sample.
+// Inner control points are in quarter pixels, relative to the start point.
+struct StrokeSegment {
+    int32_t duration;   // ms
+    int32_t x1, y1;
+    int32_t x2, y2;
+    int32_t x3, y3;     // Whole pixels, relative to the start point
+};
+
+/* Fits a stroke (one finger's samples between touch-down and lift) with piecewise
+ * cubic Beziers parameterised by time, so one set of control points describes
+ * both the path and how fast the finger moved along it.  Each piece is a least
+ * squares fit with its end points pinned to samples; pieces that miss any sample
+ * by more than the error bound are split at the worst sample and refit. */
+class StrokeFitter {
+public:
+    static const int QUARTER = 4;   // Inner control point resolution, per pixel
+
+    // Samples must be in time order with no two at the same time
+    static void fit(const StrokeSample* samples, size_t count, double maxError,
+            std::vector<StrokeSegment> &out);
+
+    // Position at time t (ms) on the piece starting at (x0, y0)
+    static void evaluate(const StrokeSegment &segment, int32_t x0, int32_t y0, double t,
+            int32_t* x, int32_t* y);
+
+private:
+    static void fitRange(const StrokeSample* samples, size_t first, size_t last, double maxError,
+            std::vector<StrokeSegment> &out);
+};
+
+#endif // STROKE_FITTER
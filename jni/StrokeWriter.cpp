@@ -0,0 +1,77 @@
+#include "StrokeWriter.h"
+#include "TraceCodec.h"
+
+StrokeWriter::StrokeWriter(int fd, double maxError) : mFD(fd), mMaxError(maxError) {
+    for(int i = 0; i < MAX_CONTACTS; i++) {
+        mContacts[i].active = false;
+        mContacts[i].msgs.reserve(MAX_STROKE_MESSAGES);
+    }
+}
+
+StrokeWriter::Contact* StrokeWriter::findContact(int32_t trackingID) {
+    Contact* free = NULL;
+    for(int i = 0; i < MAX_CONTACTS; i++) {
+        if(mContacts[i].active && mContacts[i].trackingID == trackingID) {
+            return &mContacts[i];
+        }
+        if(!mContacts[i].active && !free) {
+            free = &mContacts[i];
+        }
+    }
+    if(free) {
+        free->active = true;
+        free->trackingID = trackingID;
+        free->msgs.clear();
+    }
+    return free;
+}
+
+void StrokeWriter::writeStroke(Contact* contact) {
+    mOut.clear();
+    TraceCodec::encode(FORMAT_STROKE, &contact->msgs[0], contact->msgs.size(), mOut, mMaxError);
+    contact->msgs.clear();
+
+    size_t done = 0;
+    while(done < mOut.size()) {
+        ssize_t res = write(mFD, &mOut[done], mOut.size() - done);
+        if(res < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "Failed to write stroke, %s\n", strerror(errno));
+            return;
+        }
+        done += res;
+    }
+}
+
+void StrokeWriter::add(const Message &msg) {
+    if(msg.isReset()) {
+        flush();
+        Contact reset;
+        reset.msgs.push_back(msg);
+        writeStroke(&reset);
+        return;
+    }
+
+    Contact* contact = findContact(msg.getTrackingID());
+    if(!contact) {
+        fprintf(stderr, "Too many contacts, dropping tracking id %d\n", msg.getTrackingID());
+        return;
+    }
+    contact->msgs.push_back(msg);
+
+    if(msg.isStop()) {
+        writeStroke(contact);
+        contact->active = false;
+    } else if(contact->msgs.size() >= MAX_STROKE_MESSAGES) {
+        writeStroke(contact);
+    }
+}
+
+void StrokeWriter::flush() {
+    for(int i = 0; i < MAX_CONTACTS; i++) {
+        if(mContacts[i].active && !mContacts[i].msgs.empty()) {
+            writeStroke(&mContacts[i]);
+        }
+        mContacts[i].active = false;
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef STROKE_WRITER
+#define STROKE_WRITER
+
+#include "touch_vcr.h"
+#include "Message.h"
+#include <vector>
+
+/* Records straight into the stroke format.  Syncs are held per tracking id until
+ * the finger lifts, then the stroke is fitted and written out as its own block,
+ * so a stroke costs nothing to write until it ends.  Buffers are reused, so once
+ * the first few strokes have been seen recording doesn't allocate. */
+class StrokeWriter {
+public:
+    static const int MAX_CONTACTS = 16;
+    // Longer strokes are written out in pieces, so a finger held down forever
+    // doesn't grow the buffer without bound
+    static const size_t MAX_STROKE_MESSAGES = 1024;
+
+    StrokeWriter(int fd, double maxError);
+
+    void add(const Message &msg);
+
+    // Writes out every stroke still in progress
+    void flush();
+
+private:
+    struct Contact {
+        bool active;
+        int32_t trackingID;
+        std::vector<Message> msgs;
+    };
+
+    int mFD;
+    double mMaxError;
+    Contact mContacts[MAX_CONTACTS];
+    std::vector<char> mOut;
+
+    Contact* findContact(int32_t trackingID);
+    void writeStroke(Contact* contact);
+};
+
+#endif // STROKE_WRITER
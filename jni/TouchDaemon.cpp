@@ -0,0 +1,469 @@
+#include "TouchDaemon.h"
+#include "StreamServer.h"
+#include "MessageFormat.h"
+#include "Clock.h"
+#include <sys/socket.h>
+
+TouchDaemon::TouchDaemon(TouchVcr* vcr, TraceCache* cache) :
+    mVcr(vcr), mCache(cache), mListenFD(-1), mNextJobId(1), mRunning(NULL),
+    mRecordFD(-1), mRecordFirst(-1), mRecorded(0), mRecordDropped(0),
+    mCompleted(0), mCancelled(0), mFailed(0) {
+    mWakePipe[0] = mWakePipe[1] = -1;
+    for(int i = 0; i < MAX_CLIENTS; i++) {
+        mClients[i].fd = -1;
+        mClients[i].length = 0;
+    }
+    pthread_mutex_init(&mLock, NULL);
+}
+
+TouchDaemon::~TouchDaemon() {
+    // Nothing may call back into us once we're gone
+    mVcr->stopRecording();
+    mVcr->stop();
+    for(int i = 0; i < MAX_CLIENTS; i++) {
+        closeClient(&mClients[i]);
+    }
+    delete mRunning;
+    for(size_t i = 0; i < mQueue.size(); i++) {
+        delete mQueue[i];
+    }
+    int fds[] = { mListenFD, mWakePipe[0], mWakePipe[1] };
+    for(int i = 0; i < 3; i++) {
+        if(fds[i] >= 0) close(fds[i]);
+    }
+    pthread_mutex_destroy(&mLock);
+}
+
+int TouchDaemon::listen(const char* path) {
+    if(pipe(mWakePipe) < 0) {
+        fprintf(stderr, "could not create wake pipe, %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(mWakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(mWakePipe[1], F_SETFL, O_NONBLOCK);
+
+    mListenFD = StreamServer::listenUnix(path, MAX_CLIENTS);
+    if(mListenFD >= 0) {
+        fprintf(stderr, "Taking jobs on %s\n", path);
+    }
+    return mListenFD;
+}
+
+int TouchDaemon::fillPollFds(struct pollfd* fds, int maxFds) {
+    int n = 0;
+    int fixed[2] = { mListenFD, mWakePipe[0] };
+    for(int i = 0; i < 2 && n < maxFds; i++) {
+        fds[n].fd = fixed[i];
+        fds[n].events = POLLIN;
+        fds[n].revents = 0;
+        n++;
+    }
+    pthread_mutex_lock(&mLock);
+    for(int i = 0; i < MAX_CLIENTS && n < maxFds; i++) {
+        if(mClients[i].fd >= 0) {
+            fds[n].fd = mClients[i].fd;
+            fds[n].events = POLLIN | (mClients[i].output.empty() ? 0 : POLLOUT);
+            fds[n].revents = 0;
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&mLock);
+    return n;
+}
+
+int TouchDaemon::timeout(nsecs_t now) const {
+    if(!mRunning || mRunning->end < 0) {
+        return -1;
+    }
+    nsecs_t left = mRunning->end - now;
+    return left <= 0 ? 0 : (int)((left + 999999) / 1000000);
+}
+
+TouchDaemon::Client* TouchDaemon::findClient(int fd) {
+    for(int i = 0; i < MAX_CLIENTS; i++) {
+        if(fd >= 0 && mClients[i].fd == fd) {
+            return &mClients[i];
+        }
+    }
+    return NULL;
+}
+
+// Appends text to what's waiting for client if all of it fits within limit.
+// Caller holds mLock.
+bool TouchDaemon::queueOutput(Client* client, const char* text, size_t len, size_t limit) {
+    if(client->output.size() + len > limit) {
+        return false;
+    }
+    client->output.insert(client->output.end(), text, text + len);
+    return true;
+}
+
+// Writes as much of the waiting output as the socket takes.  Caller holds mLock.
+void TouchDaemon::flushOutput(Client* client) {
+    size_t done = 0;
+    while(done < client->output.size()) {
+        ssize_t res = send(client->fd, &client->output[done], client->output.size() - done,
+                MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(res < 0 && errno == EINTR) {
+            continue;
+        }
+        if(res <= 0) {
+            // Full, or gone and about to be noticed by poll
+            break;
+        }
+        done += res;
+    }
+    client->output.erase(client->output.begin(), client->output.begin() + done);
+}
+
+void TouchDaemon::reply(int fd, const char* text) {
+    Client* client = findClient(fd);
+    if(!client) {
+        if(fd >= 0) {
+            send(fd, text, strlen(text), MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        return;
+    }
+    pthread_mutex_lock(&mLock);
+    // Replies may use the headroom above what recorded messages can fill
+    if(queueOutput(client, text, strlen(text), MAX_CLIENT_OUTPUT + MAX_REPLY_OUTPUT)) {
+        flushOutput(client);
+    }
+    pthread_mutex_unlock(&mLock);
+}
+
+void TouchDaemon::closeClient(Client* client) {
+    if(client->fd < 0) {
+        return;
+    }
+    int fd = client->fd;
+
+    // Its jobs have nobody to report to, so they go too
+    for(std::deque<Job*>::iterator it = mQueue.begin(); it != mQueue.end(); ) {
+        if((*it)->clientFD == fd) {
+            delete *it;
+            it = mQueue.erase(it);
+            mCancelled++;
+        } else {
+            ++it;
+        }
+    }
+    if(mRunning && mRunning->clientFD == fd) {
+        cancel(mRunning->id, -1);
+        if(mRunning) {
+            mRunning->clientFD = -1;
+        }
+    }
+
+    pthread_mutex_lock(&mLock);
+    client->fd = -1;
+    client->output.clear();
+    pthread_mutex_unlock(&mLock);
+    close(fd);
+    client->length = 0;
+}
+
+void TouchDaemon::handlePollFds(const struct pollfd* fds, int count) {
+    nsecs_t now = Clock::getMonotonicNs();
+    for(int n = 0; n < count; n++) {
+        if(fds[n].revents == 0) {
+            continue;
+        }
+        if(fds[n].fd == mListenFD) {
+            int fd = accept(mListenFD, NULL, NULL);
+            if(fd < 0) {
+                continue;
+            }
+            Client* client = NULL;
+            for(int i = 0; i < MAX_CLIENTS && !client; i++) {
+                if(mClients[i].fd < 0) client = &mClients[i];
+            }
+            if(!client) {
+                reply(fd, "error too many clients\n");
+                close(fd);
+                continue;
+            }
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+            client->output.reserve(MAX_CLIENT_OUTPUT + MAX_REPLY_OUTPUT);
+            pthread_mutex_lock(&mLock);
+            client->fd = fd;
+            pthread_mutex_unlock(&mLock);
+            client->length = 0;
+        } else if(fds[n].fd == mWakePipe[0]) {
+            char buf[64];
+            while(read(mWakePipe[0], buf, sizeof(buf)) > 0) {
+            }
+            finishSpans();
+        } else {
+            Client* client = NULL;
+            for(int i = 0; i < MAX_CLIENTS && !client; i++) {
+                if(mClients[i].fd == fds[n].fd) client = &mClients[i];
+            }
+            if(!client) {
+                continue;
+            }
+            if(fds[n].revents & POLLOUT) {
+                pthread_mutex_lock(&mLock);
+                flushOutput(client);
+                pthread_mutex_unlock(&mLock);
+            }
+            if(!(fds[n].revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))) {
+                continue;
+            }
+            ssize_t res = recv(client->fd, client->command + client->length,
+                    sizeof(client->command) - 1 - client->length, MSG_DONTWAIT);
+            if(res < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            if(res <= 0) {
+                closeClient(client);
+                continue;
+            }
+            client->length += res;
+            client->command[client->length] = '\0';
+
+            // Run every whole line, keep the rest for later
+            char* line = client->command;
+            char* eol;
+            while(client->fd >= 0 && (eol = strchr(line, '\n'))) {
+                *eol = '\0';
+                handleCommand(client, line);
+                line = eol + 1;
+            }
+            if(client->fd >= 0) {
+                client->length -= line - client->command;
+                memmove(client->command, line, client->length + 1);
+                if(client->length == sizeof(client->command) - 1) {
+                    reply(client->fd, "error command too long\n");
+                    client->length = 0;
+                }
+            }
+        }
+    }
+
+    // Timed recordings end here, and the next job starts as soon as the last one is done
+    now = Clock::getMonotonicNs();
+    if(mRunning && mRunning->end >= 0 && now >= mRunning->end) {
+        cancel(mRunning->id, -1);
+    }
+    startNext(now);
+}
+
+void TouchDaemon::handleCommand(Client* client, char* line) {
+    char text[PATH_MAX + 64];
+    Job* job = NULL;
+    if(strncmp(line, "replay ", 7) == 0 && line[7]) {
+        job = new Job();
+        job->type = JOB_REPLAY;
+        snprintf(job->path, sizeof(job->path), "%s", line + 7);
+        job->duration = 0;
+    } else if(strcmp(line, "record") == 0 || strncmp(line, "record ", 7) == 0) {
+        job = new Job();
+        job->type = JOB_RECORD;
+        job->path[0] = '\0';
+        job->duration = line[6] ? strtoll(line + 7, NULL, 10) * 1000000LL : 0;
+    } else if(strncmp(line, "cancel ", 7) == 0) {
+        cancel(strtoul(line + 7, NULL, 10), client->fd);
+    } else if(strcmp(line, "status") == 0) {
+        snprintf(text, sizeof(text), "status running %d queued %d completed %llu cancelled %llu failed %llu "
+                "wait p50 %uus p99 %uus first p50 %uus p99 %uus\n",
+                mRunning ? (int)mRunning->id : 0, (int)mQueue.size(), (unsigned long long)mCompleted,
+                (unsigned long long)mCancelled, (unsigned long long)mFailed, mWait.quantile(0.5),
+                mWait.quantile(0.99), mFirst.quantile(0.5), mFirst.quantile(0.99));
+        reply(client->fd, text);
+    } else {
+        reply(client->fd, "error unknown command, expected replay <trace>, record [<ms>], cancel <job> or status\n");
+    }
+
+    if(job) {
+        job->id = mNextJobId++;
+        job->clientFD = client->fd;
+        job->submitted = Clock::getMonotonicNs();
+        job->started = -1;
+        job->end = -1;
+        job->span = 0;
+        snprintf(text, sizeof(text), "queued %u %d\n", job->id, (int)mQueue.size() + (mRunning ? 1 : 0));
+        reply(client->fd, text);
+        mQueue.push_back(job);
+    }
+}
+
+void TouchDaemon::cancel(uint32_t id, int replyFD) {
+    for(std::deque<Job*>::iterator it = mQueue.begin(); it != mQueue.end(); ++it) {
+        if((*it)->id == id) {
+            Job* job = *it;
+            mQueue.erase(it);
+            finishJob(job, "cancelled", -1, Clock::getMonotonicNs());
+            return;
+        }
+    }
+    if(mRunning && mRunning->id == id) {
+        if(mRunning->type == JOB_REPLAY) {
+            // Reported once the session has lifted its contacts
+            mVcr->cancel(mRunning->span);
+        } else {
+            mVcr->stopRecording();
+            pthread_mutex_lock(&mLock);
+            mRecordFD = -1;
+            nsecs_t first = mRecordFirst;
+            pthread_mutex_unlock(&mLock);
+            Job* job = mRunning;
+            mRunning = NULL;
+            nsecs_t now = Clock::getMonotonicNs();
+            finishJob(job, job->end >= 0 && now >= job->end ? "completed" : "cancelled", first, now);
+        }
+        return;
+    }
+    char text[64];
+    snprintf(text, sizeof(text), "error no job %u\n", id);
+    reply(replyFD, text);
+}
+
+void TouchDaemon::startNext(nsecs_t now) {
+    while(!mRunning && !mQueue.empty()) {
+        Job* job = mQueue.front();
+        mQueue.pop_front();
+        if(startJob(job, now)) {
+            mRunning = job;
+        } else {
+            finishJob(job, "failed", -1, Clock::getMonotonicNs());
+        }
+    }
+}
+
+bool TouchDaemon::startJob(Job* job, nsecs_t now) {
+    job->started = now;
+    if(job->type == JOB_RECORD) {
+        pthread_mutex_lock(&mLock);
+        mRecordFD = job->clientFD;
+        mRecordFirst = -1;
+        pthread_mutex_unlock(&mLock);
+        mVcr->startRecording(onRecord, this);
+        job->end = job->duration > 0 ? now + job->duration : -1;
+        return true;
+    }
+
+    Trace trace;
+    if(!trace.load(job->path, mCache)) {
+        return false;
+    }
+    std::vector<Message> msgs;
+    msgs.reserve(trace.size());
+    Message msg;
+    for(size_t i = 0; i < trace.size(); i++) {
+        if(trace.get(i, msg)) {
+            msgs.push_back(msg);
+        }
+    }
+    job->span = mVcr->replay(msgs.empty() ? NULL : &msgs[0], msgs.size(), onSpanDone, this);
+    return true;
+}
+
+static void format_us(char* text, size_t size, nsecs_t from, nsecs_t to) {
+    if(from < 0 || to < 0) {
+        snprintf(text, size, "-");
+    } else {
+        snprintf(text, size, "%lld", (long long)((to - from) / 1000));
+    }
+}
+
+void TouchDaemon::finishJob(Job* job, const char* outcome, nsecs_t first, nsecs_t now) {
+    if(strcmp(outcome, "completed") == 0) {
+        mCompleted++;
+    } else if(strcmp(outcome, "cancelled") == 0) {
+        mCancelled++;
+    } else {
+        mFailed++;
+    }
+    if(job->started >= 0) {
+        nsecs_t waitUs = (job->started - job->submitted) / 1000;
+        mWait.record(waitUs < 0 ? 0 : waitUs > 0xffffffffLL ? 0xffffffff : waitUs);
+    }
+    if(first >= 0) {
+        nsecs_t firstUs = (first - job->submitted) / 1000;
+        mFirst.record(firstUs < 0 ? 0 : firstUs > 0xffffffffLL ? 0xffffffff : firstUs);
+    }
+
+    char wait[24], firstText[24], total[24], text[128];
+    format_us(wait, sizeof(wait), job->submitted, job->started);
+    format_us(firstText, sizeof(firstText), job->submitted, first);
+    format_us(total, sizeof(total), job->submitted, now);
+    snprintf(text, sizeof(text), "done %u %s wait %s first %s total %s\n", job->id, outcome, wait, firstText, total);
+    reply(job->clientFD, text);
+    delete job;
+}
+
+// Replay jobs end on the session thread, pick them up here
+void TouchDaemon::finishSpans() {
+    pthread_mutex_lock(&mLock);
+    std::vector<SpanResult> done;
+    done.swap(mSpansDone);
+    pthread_mutex_unlock(&mLock);
+
+    for(size_t i = 0; i < done.size(); i++) {
+        if(!mRunning || mRunning->type != JOB_REPLAY || mRunning->span != done[i].span) {
+            continue;
+        }
+        Job* job = mRunning;
+        mRunning = NULL;
+        // The span may have waited behind one the session was already playing
+        job->started = done[i].started >= 0 ? done[i].started : job->started;
+        finishJob(job, done[i].completed ? "completed" : "cancelled", done[i].firstEvent, done[i].finished);
+    }
+}
+
+void TouchDaemon::onSpanDone(const SpanResult &result, void* user) {
+    TouchDaemon* daemon = (TouchDaemon*)user;
+    pthread_mutex_lock(&daemon->mLock);
+    daemon->mSpansDone.push_back(result);
+    pthread_mutex_unlock(&daemon->mLock);
+    char c = 0;
+    ssize_t res = write(daemon->mWakePipe[1], &c, 1);
+    (void)res;
+}
+
+// Session thread.  A client too slow to keep up loses whole messages rather
+// than holding up the device.
+void TouchDaemon::onRecord(const Message* msgs, size_t count, void* user) {
+    TouchDaemon* daemon = (TouchDaemon*)user;
+    char text[MAX_SERIALIZED_LENGTH];
+    MessageSerializer serializer = serializerFor(OUTPUT_TEXT);
+
+    pthread_mutex_lock(&daemon->mLock);
+    Client* client = daemon->findClient(daemon->mRecordFD);
+    if(client) {
+        if(daemon->mRecordFirst < 0) {
+            daemon->mRecordFirst = Clock::getMonotonicNs();
+        }
+        for(size_t i = 0; i < count; i++) {
+            int len = serializer(msgs[i], text, sizeof(text));
+            if(len <= 0) {
+                continue;
+            }
+            if(daemon->queueOutput(client, text, len, MAX_CLIENT_OUTPUT)) {
+                daemon->mRecorded++;
+            } else {
+                daemon->mRecordDropped++;
+            }
+        }
+        daemon->flushOutput(client);
+    }
+    pthread_mutex_unlock(&daemon->mLock);
+}
+
+void TouchDaemon::dumpStats(FILE* output) const {
+    pthread_mutex_lock(&mLock);
+    uint64_t recorded = mRecorded;
+    uint64_t dropped = mRecordDropped;
+    pthread_mutex_unlock(&mLock);
+
+    fprintf(output, "Daemon\n");
+    fprintf(output, "  running %u, %d queued, %llu completed, %llu cancelled, %llu failed\n",
+            mRunning ? mRunning->id : 0, (int)mQueue.size(), (unsigned long long)mCompleted,
+            (unsigned long long)mCancelled, (unsigned long long)mFailed);
+    fprintf(output, "  queue wait p50 %uus p99 %uus max %uus, first event p50 %uus p99 %uus max %uus\n",
+            mWait.quantile(0.5), mWait.quantile(0.99), mWait.max(),
+            mFirst.quantile(0.5), mFirst.quantile(0.99), mFirst.max());
+    fprintf(output, "  %llu messages recorded, %llu dropped for slow clients\n",
+            (unsigned long long)recorded, (unsigned long long)dropped);
+}
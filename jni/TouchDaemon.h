@@ -0,0 +1,117 @@
+#ifndef TOUCH_DAEMON
+#define TOUCH_DAEMON
+
+#include "touch_vcr.h"
+#include "TouchVcr.h"
+#include "TraceCache.h"
+#include "Histogram.h"
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+/* Runs record and replay jobs against an already open TouchVcr session, so a
+ * test step doesn't pay for finding, opening and configuring the device.
+ *
+ * Clients connect to a Unix socket and send one command per line:
+ *   replay <trace>      replay a text or stroke trace file
+ *   record [<ms>]       stream recorded messages back as text, until cancelled
+ *                       or for ms
+ *   cancel <job>        drop a queued job or stop a running one
+ *   status              running job, queue length and job statistics
+ * Jobs from every client share one queue and run one at a time.  A job is
+ * acknowledged with "queued <job> <jobs ahead>" and, once it ends, its client
+ * gets "done <job> completed|cancelled|failed wait <us> first <us> total <us>",
+ * where wait is the time from submission until it started and first until its
+ * first event was replayed or recorded ("-" if there was none).  Jobs of a
+ * client that disconnects are cancelled.  A client too slow to read its output
+ * loses whole recorded messages, never part of a line. */
+class TouchDaemon {
+public:
+    static const int MAX_CLIENTS = 8;
+    static const int MAX_POLL_FDS = MAX_CLIENTS + 2;
+    // Replies and recorded messages waiting for a slow client, in whole lines
+    static const size_t MAX_CLIENT_OUTPUT = 64 * 1024;
+    static const size_t MAX_REPLY_OUTPUT = 16 * 1024;
+
+    TouchDaemon(TouchVcr* vcr, TraceCache* cache);
+    ~TouchDaemon();
+
+    int listen(const char* path);
+    int fillPollFds(struct pollfd* fds, int maxFds);
+    void handlePollFds(const struct pollfd* fds, int count);
+
+    // Poll timeout in ms until a timed record job is due to end, -1 for none
+    int timeout(nsecs_t now) const;
+
+    void dumpStats(FILE* output) const;
+
+private:
+    TouchDaemon(const TouchDaemon&);
+    TouchDaemon& operator=(const TouchDaemon&);
+
+    enum JobType {
+        JOB_REPLAY,
+        JOB_RECORD
+    };
+
+    struct Job {
+        uint32_t id;
+        JobType type;
+        int clientFD;           // -1 once the client has gone
+        char path[PATH_MAX];
+        nsecs_t duration;       // Record jobs, 0 for until cancelled
+        nsecs_t submitted;
+        nsecs_t started;
+        nsecs_t end;
+        uint32_t span;
+    };
+
+    // Output is shared with the session thread, under mLock
+    struct Client {
+        int fd;
+        char command[PATH_MAX + 16];
+        size_t length;
+        std::vector<char> output;
+    };
+
+    TouchVcr* mVcr;
+    TraceCache* mCache;
+    int mListenFD;
+    int mWakePipe[2];
+    Client mClients[MAX_CLIENTS];
+
+    uint32_t mNextJobId;
+    std::deque<Job*> mQueue;
+    Job* mRunning;
+
+    // Shared with the session thread
+    mutable pthread_mutex_t mLock;
+    std::vector<SpanResult> mSpansDone;
+    int mRecordFD;
+    nsecs_t mRecordFirst;
+    uint64_t mRecorded;
+    uint64_t mRecordDropped;
+
+    uint64_t mCompleted;
+    uint64_t mCancelled;
+    uint64_t mFailed;
+    Histogram mWait;            // us
+    Histogram mFirst;           // us
+
+    static void onSpanDone(const SpanResult &result, void* user);
+    static void onRecord(const Message* msgs, size_t count, void* user);
+
+    void handleCommand(Client* client, char* line);
+    void closeClient(Client* client);
+    void cancel(uint32_t id, int replyFD);
+    void startNext(nsecs_t now);
+    bool startJob(Job* job, nsecs_t now);
+    void finishJob(Job* job, const char* outcome, nsecs_t first, nsecs_t now);
+    void finishSpans();
+    void reply(int fd, const char* text);
+    Client* findClient(int fd);
+    bool queueOutput(Client* client, const char* text, size_t len, size_t limit);
+    void flushOutput(Client* client);
+};
+
+#endif // TOUCH_DAEMON
@@ -1,12 +1,51 @@
 #include "TouchPanel.h"
 #include <fcntl.h>
 #include <linux/fb.h>
+#include <math.h>
 
 TouchPanel::TouchPanel(const char* device, int slotCount, InputMessenger* messenger, int width, int height) : 
     mDeviceName(device), mSlotCount(slotCount), mMessenger(messenger), screenWidth(width), screenHeight(height) {
-    delete[] mSlots;
     mSlots = new Slot[slotCount];
     mUsingSlotsProtocol = true;
+    mDeviceFD = -1;
+    mCurrentSlot = 0;
+    mFilter = NULL;
+    mFrameSink = NULL;
+    memset(&mXInfo, 0, sizeof(mXInfo));
+    memset(&mYInfo, 0, sizeof(mYInfo));
+    mRotation = 0;
+    mFlipX = false;
+    mFlipY = false;
+
+    mReplaySlots = new ReplayContact[slotCount];
+    for(int i = 0; i < slotCount; i++) {
+        mReplaySlots[i].trackingId = -1;
+        mReplaySlots[i].pending = false;
+        mReplaySlots[i].fresh = false;
+        mReplaySlots[i].lifting = false;
+    }
+    mReplayCurrentSlot = -1;
+    mFrameTimestamp = -1;
+    mFrameOpen = false;
+    mFramesWritten = 0;
+
+    // Worst case per slot is SLOT, TRACKING_ID, X, Y, PRESSURE and SYN_MT_REPORT,
+    // plus the closing SYN_REPORT
+    mFrameEventCapacity = slotCount * 6 + 1;
+    mFrameEvents = new input_event[mFrameEventCapacity];
+    mFrameEventCount = 0;
+}
+
+TouchPanel::~TouchPanel() {
+    delete[] mSlots;
+    delete[] mReplaySlots;
+    delete[] mFrameEvents;
+}
+
+void TouchPanel::setOrientation(int rotation, bool flipX, bool flipY) {
+    mRotation = rotation;
+    mFlipX = flipX;
+    mFlipY = flipY;
 }
 
 void TouchPanel::reset() {
@@ -98,6 +137,13 @@ int TouchPanel::openDevice()
     return mDeviceFD;
 }
 
+// Uses an already open device (uinput, or a plain file for benchmarking) instead of
+// opening mDeviceName.  Axes have to be set up with configureAxes().
+void TouchPanel::attachDevice(int fd, bool usingSlotsProtocol) {
+    mDeviceFD = fd;
+    mUsingSlotsProtocol = usingSlotsProtocol;
+}
+
 /* How to get device resolution
 void set_device_details(const char *device) {
     int fb = open(device, O_RDONLY);
@@ -145,25 +191,47 @@ void TouchPanel::readSlotsConfig() {
 
 
 bool TouchPanel::readConfig() {
-    input_absinfo info;
+    input_absinfo xInfo;
+    input_absinfo yInfo;
 
     // Grab the resolution from the device
     readSlotsConfig();
 
-    if(getAbsoluteAxisInfo(ABS_MT_POSITION_X, &info) < 1) {
+    if(getAbsoluteAxisInfo(ABS_MT_POSITION_X, &xInfo) < 1) {
         return false;
     }
-    mXScale = float(screenWidth) / (info.maximum - info.minimum + 1);
-
-    if(getAbsoluteAxisInfo(ABS_MT_POSITION_Y, &info) < 1) {
+    if(getAbsoluteAxisInfo(ABS_MT_POSITION_Y, &yInfo) < 1) {
         return false;
     }
-    mYScale = float(screenHeight) / (info.maximum - info.minimum + 1);
 
-    fprintf(stderr, "xScale: %f, yScale: %f\n", mXScale, mYScale);
+    configureAxes(xInfo, yInfo);
     return true;
 }
 
+// Builds the panel <-> screen transforms from the axis ranges and orientation
+void TouchPanel::configureAxes(const input_absinfo &xInfo, const input_absinfo &yInfo) {
+    mXInfo = xInfo;
+    mYInfo = yInfo;
+    mTransform = AffineTransform::Calibration(xInfo, yInfo, screenWidth, screenHeight,
+            mRotation, mFlipX, mFlipY);
+    mInverse = mTransform.inverse();
+    mTransform.dump(stderr);
+}
+
+void TouchPanel::getProfile(DeviceProfile* profile) const {
+    memset(profile, 0, sizeof(*profile));
+    profile->screenWidth = screenWidth;
+    profile->screenHeight = screenHeight;
+    profile->rotation = mRotation;
+    profile->flags = (mFlipX ? PROFILE_FLIP_X : 0) | (mFlipY ? PROFILE_FLIP_Y : 0) |
+            (mUsingSlotsProtocol ? PROFILE_SLOTS : 0);
+    profile->slotCount = mSlotCount;
+    profile->xMin = mXInfo.minimum;
+    profile->xMax = mXInfo.maximum;
+    profile->yMin = mYInfo.minimum;
+    profile->yMax = mYInfo.maximum;
+}
+
 void TouchPanel::clearSlots(int32_t initialSlot) {
     if (mSlots) {
         for (size_t i = 0; i < mSlotCount; i++) {
@@ -265,16 +333,23 @@ void TouchPanel::process(const input_event* rawEvent) {
             Slot* slot = &mSlots[i];
             if(slot->mState == DONE) {
                 slot->mState = NOT_IN_USE;    
-                Message msg;
-                msg = Message::Stop(timestamp, slot->getTrackingId()); 
-                mMessenger->send(msg);
+                // Filtered out contacts never started, so don't stop them either
+                if(!mFilter || slot->mReported) {
+                    Message msg;
+                    msg = Message::Stop(timestamp, slot->getTrackingId()); 
+                    mMessenger->send(msg);
+                }
+                slot->mReported = false;
             }
             if(slot->mState == IN_USE) {
-                int32_t x = slot->getX() * mXScale;
-                int32_t y = slot->getY() * mYScale;
-                Message msg;
-                msg = Message::Sync(timestamp, slot->getTrackingId(), x, y);
-                mMessenger->send(msg);
+                int32_t x, y;
+                mTransform.apply(slot->getX(), slot->getY(), &x, &y);
+                if(!mFilter || mFilter->accept(slot->getTrackingId(), x, y)) {
+                    Message msg;
+                    msg = Message::Sync(timestamp, slot->getTrackingId(), x, y);
+                    mMessenger->send(msg);
+                    slot->mReported = true;
+                }
                 if(!mUsingSlotsProtocol) {
                     slot->mState = DONE;
                 }
@@ -304,50 +379,177 @@ void TouchPanel::process(const input_event* rawEvent) {
 */
 
 void TouchPanel::replay( Message msg, int now ) {
+    if( !msg.isSync() && !msg.isStop() ) {
+        return;
+    }
+
+    // A new timestamp starts a new frame
+    if( mFrameOpen && msg.getTimestamp() != mFrameTimestamp ) {
+        flushFrame();
+    }
+
+    int32_t slotIndex = findReplaySlot(msg.getTrackingID(), msg.isSync());
+    if( slotIndex < 0 ) {
+        if( msg.isSync() ) {
+            fprintf(stderr, "No free slot to replay tracking id %d\n", msg.getTrackingID());
+        }
+        return;
+    }
+    ReplayContact* contact = &mReplaySlots[slotIndex];
+
+    // A contact can only change once per frame, so a second update for the
+    // same tracking id closes the current frame
+    if( mFrameOpen && (contact->pending || contact->lifting) ) {
+        flushFrame();
+    }
+    mFrameOpen = true;
+    mFrameTimestamp = msg.getTimestamp();
+
     if( msg.isSync() ) {
 #ifdef DEBUG
         printf("Replaying sync %d %d %d %d\n", msg.getTimestamp(), msg.getTrackingID(), msg.getX(), msg.getY() );
 #endif
-        if(mUsingSlotsProtocol) {
-            send_event(EV_ABS, ABS_MT_TRACKING_ID, msg.getTrackingID()); 
-        } else {
-            send_event(EV_ABS, ABS_MT_TRACKING_ID, 0); 
+        mInverse.apply(msg.getX(), msg.getY(), &contact->pendingX, &contact->pendingY);
+        if( contact->trackingId < 0 ) {
+            contact->trackingId = msg.getTrackingID();
+            contact->fresh = true;
         }
-        send_event(EV_ABS, ABS_MT_POSITION_X, msg.getX()/mXScale); 
-        send_event(EV_ABS, ABS_MT_POSITION_Y, msg.getY()/mYScale); 
-        send_event(EV_ABS, ABS_MT_PRESSURE, 30); 
-        if(!mUsingSlotsProtocol) {
-            send_event(EV_SYN, SYN_MT_REPORT, 0); 
-        }
-        send_event(EV_SYN, SYN_REPORT, 0); 
-    }
-    if( msg.isStop() ) {
+        contact->pending = true;
+    } else {
 #ifdef DEBUG
         printf("Replaying stop %d\n", msg.getTimestamp() );
 #endif
-        if(mUsingSlotsProtocol) {
-            send_event(EV_ABS, ABS_MT_TRACKING_ID, -1); 
+        contact->lifting = true;
+    }
+}
+
+void TouchPanel::flushFrame() {
+    if( !mFrameOpen ) {
+        return;
+    }
+    mFrameOpen = false;
+
+    buildFrame();
+    if( mUsingSlotsProtocol && mFrameEventCount == 1 ) {
+        // Nothing changed, don't send an empty report
+        return;
+    }
+
+    if( mFrameSink ) {
+        mFrameSink->writeFrame(mFrameEvents, mFrameEventCount);
+        mFramesWritten++;
+        return;
+    }
+
+    int res = write(mDeviceFD, mFrameEvents, mFrameEventCount * sizeof(input_event));
+    if( res < (int)(mFrameEventCount * sizeof(input_event)) ) {
+        fprintf(stderr, "Failed to write frame %d, %s\n", mFrameTimestamp, strerror(errno));
+        return;
+    }
+    mFramesWritten++;
+}
+
+// Returns the slot replaying trackingId, optionally assigning the lowest free slot
+int32_t TouchPanel::findReplaySlot(int32_t trackingId, bool allocate) {
+    int32_t freeSlot = -1;
+    for(size_t i = 0; i < mSlotCount; i++) {
+        if( mReplaySlots[i].trackingId == trackingId ) {
+            return i;
+        }
+        if( freeSlot < 0 && mReplaySlots[i].trackingId < 0 ) {
+            freeSlot = i;
+        }
+    }
+    return allocate ? freeSlot : -1;
+}
+
+// Encodes the pending contact changes into mFrameEvents
+void TouchPanel::buildFrame() {
+    mFrameEventCount = 0;
+
+    for(size_t i = 0; i < mSlotCount; i++) {
+        ReplayContact* contact = &mReplaySlots[i];
+        if( contact->trackingId < 0 ) {
+            continue;
+        }
+
+        if( mUsingSlotsProtocol ) {
+            // Slots keep their state on the device, so only send what changed
+            if( !contact->pending && !contact->lifting ) {
+                continue;
+            }
+            bool moveX = contact->fresh || contact->pendingX != contact->x;
+            bool moveY = contact->fresh || contact->pendingY != contact->y;
+            if( !contact->lifting && !moveX && !moveY ) {
+                contact->pending = false;
+                continue;
+            }
+
+            if( mReplayCurrentSlot != (int32_t)i ) {
+                queue_event(EV_ABS, ABS_MT_SLOT, i);
+                mReplayCurrentSlot = i;
+            }
+            if( contact->lifting ) {
+                queue_event(EV_ABS, ABS_MT_TRACKING_ID, -1);
+            } else {
+                if( contact->fresh ) {
+                    queue_event(EV_ABS, ABS_MT_TRACKING_ID, contact->trackingId);
+                }
+                if( moveX ) {
+                    queue_event(EV_ABS, ABS_MT_POSITION_X, contact->pendingX);
+                }
+                if( moveY ) {
+                    queue_event(EV_ABS, ABS_MT_POSITION_Y, contact->pendingY);
+                }
+                if( contact->fresh ) {
+                    queue_event(EV_ABS, ABS_MT_PRESSURE, 30);
+                }
+            }
         } else {
-            send_event(EV_SYN, SYN_MT_REPORT, 0); 
+            // Without slots every active contact is reported in every frame
+            if( !contact->lifting ) {
+                queue_event(EV_ABS, ABS_MT_TRACKING_ID, i);
+                queue_event(EV_ABS, ABS_MT_POSITION_X, contact->pending ? contact->pendingX : contact->x);
+                queue_event(EV_ABS, ABS_MT_POSITION_Y, contact->pending ? contact->pendingY : contact->y);
+                queue_event(EV_ABS, ABS_MT_PRESSURE, 30);
+                queue_event(EV_SYN, SYN_MT_REPORT, 0);
+            }
         }
-        send_event(EV_SYN, SYN_REPORT, 0); 
+
+        if( contact->lifting ) {
+            contact->trackingId = -1;
+        } else if( contact->pending ) {
+            contact->x = contact->pendingX;
+            contact->y = contact->pendingY;
+        }
+        contact->pending = false;
+        contact->fresh = false;
+        contact->lifting = false;
     }
+
+    if( !mUsingSlotsProtocol && mFrameEventCount == 0 ) {
+        // All contacts lifted
+        queue_event(EV_SYN, SYN_MT_REPORT, 0);
+    }
+    queue_event(EV_SYN, SYN_REPORT, 0);
 }
 
-void TouchPanel::send_event(int type, int code, int value) {
+void TouchPanel::queue_event(int type, int code, int value) {
     /* Emergency backup method
      * slow, but reliable
     char cmd[100];
     sprintf(cmd, "sendevent /dev/input/event3 %d %d %d",type, code, value); 
     system(cmd); */
-    struct input_event event;
-    int res;
+    if( mFrameEventCount >= mFrameEventCapacity ) {
+        fprintf(stderr, "Replay frame overflow, dropping event %d %d %d\n", type, code, value);
+        return;
+    }
+    struct input_event* event = &mFrameEvents[mFrameEventCount++];
 
-    memset(&event, 0, sizeof(event));
-    event.type = type;
-    event.code = code;
-    event.value = value;
-    res = write(mDeviceFD, &event, sizeof(event));
+    memset(event, 0, sizeof(*event));
+    event->type = type;
+    event->code = code;
+    event->value = value;
 }
 
 void TouchPanel::finishSync() {
@@ -365,6 +567,7 @@ TouchPanel::Slot::Slot() {
 
 void TouchPanel::Slot::clear() {
     mState = NOT_IN_USE;
+    mReported = false;
     mHaveAbsMTTouchMinor = false;
     mHaveAbsMTWidthMinor = false;
     mHaveAbsMTToolType = false;
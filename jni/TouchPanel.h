@@ -5,6 +5,8 @@
 #include "InputMessenger.h"
 #include "Message.h"
 #include "Clock.h"
+#include "AffineTransform.h"
+#include "CaptureFilter.h"
 
 enum SlotState {
     IN_USE,
@@ -12,6 +14,29 @@ enum SlotState {
     NOT_IN_USE
 };
 
+// Everything about the target device that replayed events depend on.  A
+// compiled replay is only valid for a device with the same profile.
+struct DeviceProfile {
+    int32_t screenWidth;
+    int32_t screenHeight;
+    int32_t rotation;
+    int32_t flags;              // PROFILE_* below
+    int32_t slotCount;
+    int32_t xMin, xMax;
+    int32_t yMin, yMax;
+};
+
+static const int32_t PROFILE_FLIP_X = 1;
+static const int32_t PROFILE_FLIP_Y = 2;
+static const int32_t PROFILE_SLOTS = 4;
+
+// Receives encoded replay frames in place of the device, see ReplayCompiler
+class FrameSink {
+public:
+    virtual ~FrameSink() {}
+    virtual void writeFrame(const input_event* events, size_t count) = 0;
+};
+
 /* Keeps track of the state of multi-touch protocol. */
 class TouchPanel {
 public:
@@ -35,6 +60,7 @@ public:
     private:
         friend class TouchPanel;
         SlotState mState;
+        bool mReported;         // A sync for the current contact passed the capture filter
         bool mHaveAbsMTTouchMinor;
         bool mHaveAbsMTWidthMinor;
         bool mHaveAbsMTToolType;
@@ -58,12 +84,36 @@ public:
     TouchPanel(const char* device, int numSlots, InputMessenger* messenger, int screenWidth, int screenHeight);
     ~TouchPanel();
 
+    // Replayed messages are gathered into frames.  Messages that share a timestamp
+    // go out together, terminated by a single SYN_REPORT; a frame is written when a
+    // message with a new timestamp arrives or when flushFrame() is called.
     void replay( Message msg, int now );
+    void flushFrame();
+    // Non-empty frames written so far, to the device or the sink
+    inline uint64_t getFramesWritten() const { return mFramesWritten; }
     void configure(size_t slotCount, bool usingSlotsProtocol);
     void reset();
     void process(const input_event* rawEvent);
     void finishSync();
     int openDevice();
+    void attachDevice(int fd, bool usingSlotsProtocol);
+
+    // Replayed frames go to sink instead of the device while one is set
+    void setFrameSink(FrameSink* sink) { mFrameSink = sink; }
+    void getProfile(DeviceProfile* profile) const;
+
+    // Optional, decides which touches are recorded
+    void setCaptureFilter(CaptureFilter* filter) { mFilter = filter; }
+
+    // Orientation of the screen relative to the panel, applied when the axis
+    // configuration is read.  Must be set before openDevice().
+    void setOrientation(int rotation, bool flipX, bool flipY);
+    void configureAxes(const input_absinfo &xInfo, const input_absinfo &yInfo);
+
+    // Panel to screen, used when recording
+    inline const AffineTransform& getTransform() const { return mTransform; }
+    // Screen to panel, used when replaying
+    inline const AffineTransform& getInverseTransform() const { return mInverse; }
 
     inline size_t getSlotCount() const { return mSlotCount; }
     inline const Slot* getSlot(size_t index) const { return &mSlots[index]; }
@@ -77,21 +127,52 @@ private:
     bool mUsingSlotsProtocol;
     const char* mDeviceName;
 
-    float mXScale;
-    float mYScale;
+    int mRotation;
+    bool mFlipX;
+    bool mFlipY;
+    AffineTransform mTransform;
+    AffineTransform mInverse;
+    input_absinfo mXInfo;
+    input_absinfo mYInfo;
 
     int screenWidth;
     int screenHeight;
 
     InputMessenger* mMessenger;
+    CaptureFilter* mFilter;
+    FrameSink* mFrameSink;
     Clock mInputClock;
 
+    // Device side state of a contact being replayed
+    struct ReplayContact {
+        int32_t trackingId;     // -1 when the slot is free
+        int32_t x;              // Last values written to the device
+        int32_t y;
+        int32_t pendingX;
+        int32_t pendingY;
+        bool pending;           // Updated in the current frame
+        bool fresh;             // Touched down in the current frame
+        bool lifting;           // Lifted in the current frame
+    };
+
+    ReplayContact* mReplaySlots;
+    int32_t mReplayCurrentSlot;     // Last ABS_MT_SLOT written to the device
+    int32_t mFrameTimestamp;
+    bool mFrameOpen;
+    uint64_t mFramesWritten;
+
+    input_event* mFrameEvents;
+    size_t mFrameEventCount;
+    size_t mFrameEventCapacity;
+
     void clearSlots(int32_t initialSlot);
     bool getAbsoluteAxisValue(int32_t axis, int32_t* outValue);
     bool getAbsoluteAxisInfo(int32_t axis, input_absinfo* outValue);
     bool readConfig();
     void readSlotsConfig();
-    void send_event(int code, int type, int value);
+    int32_t findReplaySlot(int32_t trackingId, bool allocate);
+    void buildFrame();
+    void queue_event(int type, int code, int value);
 };
 
 #endif // TOUCHPANEL
@@ -0,0 +1,137 @@
+#include "TouchProfiler.h"
+
+static const char* AXIS_NAMES[] = {
+    "slot", "major", "minor", "wmajor", "wminor", "orient", "x", "y",
+    "tool", "blob", "id", "pressure", "dist"
+};
+
+TouchProfiler::TouchProfiler(int outFD, int periodMs) :
+    mOutFD(outFD), mPeriod(periodMs * 1000000LL), mCurrent(0), mFilled(0),
+    mLastReport(-1), mFrameEvents(0), mTouchDown(false) {
+    memset(mFrameAxes, 0, sizeof(mFrameAxes));
+}
+
+nsecs_t TouchProfiler::toNs(const timeval &time) {
+    return time.tv_sec * 1000000000LL + time.tv_usec * 1000LL;
+}
+
+void TouchProfiler::clearSlice(Slice &slice, nsecs_t start) {
+    slice.start = start;
+    slice.frames = 0;
+    slice.events = 0;
+    slice.maxFrameEvents = 0;
+    memset(slice.axisUpdates, 0, sizeof(slice.axisUpdates));
+    slice.intervals.clear();
+    slice.latency.clear();
+}
+
+void TouchProfiler::process(const input_event* rawEvent) {
+    mFrameEvents++;
+
+    if(rawEvent->type == EV_ABS) {
+        int axis = rawEvent->code - FIRST_AXIS;
+        if(axis >= 0 && axis < AXIS_COUNT) {
+            mFrameAxes[axis]++;
+        }
+        if(rawEvent->code == ABS_MT_TRACKING_ID && rawEvent->value >= 0) {
+            mTouchDown = true;
+        }
+    } else if(rawEvent->type == EV_SYN && rawEvent->code == SYN_REPORT) {
+        finishFrame(toNs(rawEvent->time));
+    }
+}
+
+void TouchProfiler::finishFrame(nsecs_t eventTime) {
+    // Take the receive time before anything else so the summary write isn't counted
+    nsecs_t received = 0;
+    if(mTouchDown) {
+        // evdev stamps events with CLOCK_REALTIME by default
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        received = now.tv_sec * 1000000000LL + now.tv_nsec;
+    }
+
+    if(mFilled == 0) {
+        clearSlice(mSlices[0], eventTime);
+        mFilled = 1;
+    } else if(eventTime - mSlices[mCurrent].start >= mPeriod) {
+        emitSummary(eventTime);
+        mCurrent = (mCurrent + 1) % WINDOW_SLICES;
+        if(mFilled < WINDOW_SLICES) {
+            mFilled++;
+        }
+        clearSlice(mSlices[mCurrent], eventTime);
+    }
+
+    Slice &slice = mSlices[mCurrent];
+    slice.frames++;
+    slice.events += mFrameEvents;
+    if(mFrameEvents > slice.maxFrameEvents) {
+        slice.maxFrameEvents = mFrameEvents;
+    }
+    for(int i = 0; i < AXIS_COUNT; i++) {
+        slice.axisUpdates[i] += mFrameAxes[i];
+    }
+    mFrameEvents = 0;
+    memset(mFrameAxes, 0, sizeof(mFrameAxes));
+
+    // Gaps longer than a period are the finger being lifted, not jitter
+    if(mLastReport >= 0 && eventTime - mLastReport < mPeriod) {
+        slice.intervals.record((eventTime - mLastReport) / 1000);
+    }
+    mLastReport = eventTime;
+
+    if(mTouchDown) {
+        nsecs_t latency = (received - eventTime) / 1000;
+        slice.latency.record(latency < 0 ? 0 : latency > 0xffffffffLL ? 0xffffffff : latency);
+        mTouchDown = false;
+    }
+}
+
+void TouchProfiler::emitSummary(nsecs_t windowEnd) {
+    // Oldest slice still in the window is the one after the current, once full
+    int oldest = mFilled < WINDOW_SLICES ? 0 : (mCurrent + 1) % WINDOW_SLICES;
+    clearSlice(mWindow, mSlices[oldest].start);
+    for(int i = 0; i < mFilled; i++) {
+        const Slice &slice = mSlices[i];
+        mWindow.frames += slice.frames;
+        mWindow.events += slice.events;
+        if(slice.maxFrameEvents > mWindow.maxFrameEvents) {
+            mWindow.maxFrameEvents = slice.maxFrameEvents;
+        }
+        for(int k = 0; k < AXIS_COUNT; k++) {
+            mWindow.axisUpdates[k] += slice.axisUpdates[k];
+        }
+        mWindow.intervals.merge(slice.intervals);
+        mWindow.latency.merge(slice.latency);
+    }
+
+    char line[512];
+    double seconds = (windowEnd - mWindow.start) / 1e9;
+    double frames = mWindow.frames ? mWindow.frames : 1;
+    const Histogram &intervals = mWindow.intervals;
+
+    int len = snprintf(line, sizeof(line),
+            "profile %lld %.1fs rate=%.1fHz interval p50=%u p99=%u max=%uus jitter=%.0fus events/frame=%.1f max=%u",
+            (long long)(windowEnd / 1000000LL), seconds, mWindow.frames / seconds,
+            intervals.quantile(0.5), intervals.quantile(0.99), intervals.max(), intervals.stddev(),
+            mWindow.events / frames, mWindow.maxFrameEvents);
+    if(mWindow.latency.count() > 0 && len < (int)sizeof(line)) {
+        len += snprintf(line + len, sizeof(line) - len, " touchdown n=%llu p50=%u max=%uus",
+                (unsigned long long)mWindow.latency.count(), mWindow.latency.quantile(0.5), mWindow.latency.max());
+    }
+    for(int i = 0; i < AXIS_COUNT && len < (int)sizeof(line); i++) {
+        if(mWindow.axisUpdates[i] > 0) {
+            len += snprintf(line + len, sizeof(line) - len, " %s=%.0fHz", AXIS_NAMES[i],
+                    mWindow.axisUpdates[i] / seconds);
+        }
+    }
+    if(len > (int)sizeof(line) - 2) {
+        len = sizeof(line) - 2;
+    }
+    line[len++] = '\n';
+
+    if(write(mOutFD, line, len) < len) {
+        fprintf(stderr, "Failed to write profile, %s\n", strerror(errno));
+    }
+}
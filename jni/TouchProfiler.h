@@ -0,0 +1,57 @@
+#ifndef TOUCH_PROFILER
+#define TOUCH_PROFILER
+
+#include "touch_vcr.h"
+#include "Histogram.h"
+
+/* Qualifies touch hardware from the raw evdev stream instead of recording it.
+ * Every period it writes one summary line covering the last WINDOW_SLICES
+ * periods: the report rate, the inter-report interval distribution and jitter,
+ * events per frame, how often each MT axis is updated, and how long touch-down
+ * frames took to reach user space (the kernel event timestamp against our receive
+ * time).  Each slice is a fixed set of counters and histograms, so memory use is
+ * constant however long it runs. */
+class TouchProfiler {
+public:
+    static const int DEFAULT_PERIOD_MS = 1000;
+    static const int WINDOW_SLICES = 4;
+
+    TouchProfiler(int outFD, int periodMs);
+
+    void process(const input_event* rawEvent);
+
+private:
+    // The MT axes, ABS_MT_SLOT through ABS_MT_DISTANCE
+    static const int FIRST_AXIS = ABS_MT_SLOT;
+    static const int AXIS_COUNT = ABS_MT_DISTANCE - ABS_MT_SLOT + 1;
+
+    struct Slice {
+        nsecs_t start;
+        uint64_t frames;
+        uint64_t events;
+        uint32_t maxFrameEvents;
+        uint32_t axisUpdates[AXIS_COUNT];
+        Histogram intervals;    // us between reports
+        Histogram latency;      // us from kernel timestamp to receipt, touch-down frames only
+    };
+
+    int mOutFD;
+    nsecs_t mPeriod;
+
+    Slice mSlices[WINDOW_SLICES];
+    int mCurrent;
+    int mFilled;
+    Slice mWindow;              // Scratch for merging the slices
+
+    nsecs_t mLastReport;
+    uint32_t mFrameEvents;
+    uint32_t mFrameAxes[AXIS_COUNT];
+    bool mTouchDown;
+
+    void finishFrame(nsecs_t eventTime);
+    void emitSummary(nsecs_t windowEnd);
+    static void clearSlice(Slice &slice, nsecs_t start);
+    static nsecs_t toNs(const timeval &time);
+};
+
+#endif // TOUCH_PROFILER
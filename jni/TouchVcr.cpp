@@ -0,0 +1,324 @@
+#include "TouchVcr.h"
+#include "Clock.h"
+#include <algorithm>
+
+// Shared by the whole core, touch_vcr -v turns it on
+bool VERBOSE = false;
+
+static const int EVENT_BATCH = 64;
+
+TouchVcr::TouchVcr(const char* device, int screenWidth, int screenHeight) :
+    mPanel(mDevice, SLOT_COUNT, &mMessenger, screenWidth, screenHeight), mDeviceFD(-1), mOwnsFD(false), mTimerFD(-1),
+    mScheduler(ReplayScheduler::DEFAULT_SPIN_WINDOW, ReplayScheduler::DEFAULT_SPIN_BUDGET),
+    mRunning(false), mStopping(false), mNextSpanId(1), mRecordChanged(false), mRecordCallback(NULL),
+    mRecordUser(NULL), mSpansDone(0), mSpansCancelled(0), mMessagesReplayed(0) {
+    snprintf(mDevice, sizeof(mDevice), "%s", device ? device : "");
+    mWakePipe[0] = mWakePipe[1] = -1;
+    pthread_mutex_init(&mLock, NULL);
+}
+
+TouchVcr::~TouchVcr() {
+    stop();
+    if(mOwnsFD) {
+        close(mDeviceFD);
+    }
+    pthread_mutex_destroy(&mLock);
+}
+
+void TouchVcr::setOrientation(int rotation, bool flipX, bool flipY) {
+    mPanel.setOrientation(rotation, flipX, flipY);
+}
+
+bool TouchVcr::open() {
+    mDeviceFD = mPanel.openDevice();
+    mOwnsFD = mDeviceFD >= 0;
+    return mDeviceFD >= 0;
+}
+
+void TouchVcr::attach(int fd, const input_absinfo &xInfo, const input_absinfo &yInfo) {
+    mDeviceFD = fd;
+    mOwnsFD = false;
+    mPanel.attachDevice(fd, true);
+    mPanel.configureAxes(xInfo, yInfo);
+}
+
+bool TouchVcr::start() {
+    if(mRunning) {
+        return true;
+    }
+    if(mTimerFD < 0 && (mTimerFD = mScheduler.open()) < 0) {
+        return false;
+    }
+    if(pipe(mWakePipe) < 0) {
+        fprintf(stderr, "could not create wake pipe, %s\n", strerror(errno));
+        return false;
+    }
+    fcntl(mWakePipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(mWakePipe[1], F_SETFL, O_NONBLOCK);
+
+    mStopping = false;
+    if(pthread_create(&mThread, NULL, threadMain, this) != 0) {
+        fprintf(stderr, "could not start session thread, %s\n", strerror(errno));
+        return false;
+    }
+    mRunning = true;
+    return true;
+}
+
+void TouchVcr::stop() {
+    if(!mRunning) {
+        return;
+    }
+    pthread_mutex_lock(&mLock);
+    mStopping = true;
+    pthread_mutex_unlock(&mLock);
+    wake();
+    pthread_join(mThread, NULL);
+    mRunning = false;
+    close(mWakePipe[0]);
+    close(mWakePipe[1]);
+    mWakePipe[0] = mWakePipe[1] = -1;
+}
+
+void TouchVcr::wake() {
+    char c = 0;
+    if(mWakePipe[1] >= 0) {
+        // A full pipe already means a wakeup is pending
+        ssize_t res = write(mWakePipe[1], &c, 1);
+        (void)res;
+    }
+}
+
+void TouchVcr::startRecording(RecordCallback callback, void* user) {
+    pthread_mutex_lock(&mLock);
+    mRecordCallback = callback;
+    mRecordUser = user;
+    mRecordChanged = true;
+    pthread_mutex_unlock(&mLock);
+    wake();
+}
+
+void TouchVcr::stopRecording() {
+    startRecording(NULL, NULL);
+}
+
+uint32_t TouchVcr::replay(const Message* msgs, size_t count, ReplayCallback done, void* user) {
+    Span* span = new Span();
+    span->trace.assign(msgs, count);
+    span->offsets.resize(count + 1);
+    span->trace.timeline(&span->offsets[0]);
+    span->next = 0;
+    span->frameMark = 0;
+    span->done = done;
+    span->user = user;
+    span->result.completed = false;
+    span->result.submitted = Clock::getMonotonicNs();
+    span->result.started = -1;
+    span->result.firstEvent = -1;
+    span->result.finished = -1;
+
+    pthread_mutex_lock(&mLock);
+    uint32_t id = span->result.span = mNextSpanId++;
+    mSubmitted.push_back(span);
+    pthread_mutex_unlock(&mLock);
+    wake();
+    return id;
+}
+
+void TouchVcr::cancel(uint32_t span) {
+    pthread_mutex_lock(&mLock);
+    mCancelled.push_back(span);
+    pthread_mutex_unlock(&mLock);
+    wake();
+}
+
+void* TouchVcr::threadMain(void* arg) {
+    ((TouchVcr*)arg)->run();
+    return NULL;
+}
+
+// Picks up everything the API side queued.  Returns false once stopping, with
+// every remaining span moved to cancelled.
+bool TouchVcr::takeRequests(std::vector<Span*> &cancelled) {
+    pthread_mutex_lock(&mLock);
+    bool stopping = mStopping;
+    if(mRecordChanged) {
+        mMessenger.setBatchCallback(mRecordCallback, mRecordUser);
+        mRecordChanged = false;
+    }
+    mSpans.insert(mSpans.end(), mSubmitted.begin(), mSubmitted.end());
+    mSubmitted.clear();
+    std::vector<uint32_t> ids;
+    ids.swap(mCancelled);
+    pthread_mutex_unlock(&mLock);
+
+    for(std::deque<Span*>::iterator it = mSpans.begin(); it != mSpans.end(); ) {
+        if(stopping || std::find(ids.begin(), ids.end(), (*it)->result.span) != ids.end()) {
+            lift(*it);
+            cancelled.push_back(*it);
+            it = mSpans.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return !stopping;
+}
+
+// Replays whatever of span is due by now
+void TouchVcr::play(Span* span, nsecs_t now) {
+    size_t count = span->trace.size();
+    Message msg;
+    while(span->next < count && span->result.started + span->offsets[span->next] <= now) {
+        if(span->trace.get(span->next, msg)) {
+            mPanel.replay(msg, now / 1000000LL);
+            std::vector<int32_t>::iterator it = std::find(span->down.begin(), span->down.end(), msg.getTrackingID());
+            if(msg.isSync() && it == span->down.end()) {
+                span->down.push_back(msg.getTrackingID());
+            } else if(msg.isStop() && it != span->down.end()) {
+                span->down.erase(it);
+            }
+        }
+        span->next++;
+    }
+}
+
+// Stamps span's first frame once the panel has actually written one for it
+void TouchVcr::noteFirstFrame(Span* span) {
+    if(span->result.firstEvent < 0 && mPanel.getFramesWritten() != span->frameMark) {
+        span->result.firstEvent = Clock::getMonotonicNs();
+    }
+}
+
+// Lifts the contacts a span stopped part way through left down
+void TouchVcr::lift(Span* span) {
+    if(span->down.empty()) {
+        return;
+    }
+    Message msg;
+    int32_t timestamp = 0;
+    if(span->next > 0 && span->trace.get(span->next - 1, msg)) {
+        timestamp = msg.getTimestamp();
+    }
+    for(size_t i = 0; i < span->down.size(); i++) {
+        mPanel.replay(Message::Stop(timestamp + 1, span->down[i]), 0);
+    }
+    mPanel.flushFrame();
+    span->down.clear();
+}
+
+void TouchVcr::report(Span* span, bool completed) {
+    span->result.completed = completed;
+    span->result.finished = Clock::getMonotonicNs();
+    if(span->done) {
+        span->done(span->result, span->user);
+    }
+    delete span;
+}
+
+void TouchVcr::run() {
+    struct pollfd fds[3];
+    input_event events[EVENT_BATCH];
+    std::vector<Span*> finished;
+    std::vector<Span*> cancelled;
+    int deviceFD = mDeviceFD;
+    nsecs_t now = Clock::getMonotonicNs();
+
+    while(1) {
+        bool running = takeRequests(cancelled);
+
+        // Play what's due, moving on to the next span as soon as one ends
+        nsecs_t deadline = -1;
+        while(running && !mSpans.empty()) {
+            Span* span = mSpans.front();
+            if(span->result.started < 0) {
+                span->result.started = now;
+                span->frameMark = mPanel.getFramesWritten();
+            }
+            if(span->next < span->trace.size()) {
+                nsecs_t due = span->result.started + span->offsets[span->next];
+                if(due > now) {
+                    deadline = due;
+                    break;
+                }
+                mScheduler.noteEmit(due, now);
+                play(span, now);
+                noteFirstFrame(span);
+                if(span->next < span->trace.size()) {
+                    deadline = span->result.started + span->offsets[span->next];
+                    break;
+                }
+            }
+            mPanel.flushFrame();
+            noteFirstFrame(span);
+            mSpans.pop_front();
+            finished.push_back(span);
+        }
+        mPanel.flushFrame();
+        if(!mSpans.empty() && mSpans.front()->result.started >= 0) {
+            noteFirstFrame(mSpans.front());
+        }
+
+        pthread_mutex_lock(&mLock);
+        mSpansDone += finished.size();
+        mSpansCancelled += cancelled.size();
+        for(size_t i = 0; i < finished.size(); i++) {
+            mMessagesReplayed += finished[i]->trace.size();
+        }
+        pthread_mutex_unlock(&mLock);
+        for(size_t i = 0; i < finished.size(); i++) {
+            report(finished[i], true);
+        }
+        for(size_t i = 0; i < cancelled.size(); i++) {
+            report(cancelled[i], false);
+        }
+        finished.clear();
+        cancelled.clear();
+        if(!running) {
+            break;
+        }
+
+        mScheduler.arm(deadline);
+        fds[0].fd = deviceFD;
+        fds[0].events = POLLIN;
+        fds[1].fd = mWakePipe[0];
+        fds[1].events = POLLIN;
+        fds[2].fd = mTimerFD;
+        fds[2].events = POLLIN;
+        int res = poll(fds, 3, -1);
+        now = Clock::getMonotonicNs();
+        if(res < 0) {
+            continue;
+        }
+
+        if(fds[2].revents & POLLIN) {
+            now = mScheduler.waitForDeadline();
+        }
+        if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            deviceFD = -1;
+        } else if(fds[0].revents & POLLIN) {
+            ssize_t len = read(deviceFD, events, sizeof(events));
+            if(len < (ssize_t)sizeof(input_event)) {
+                // A uinput fd, or the device went away
+                deviceFD = -1;
+            } else {
+                for(size_t i = 0; i < len / sizeof(input_event); i++) {
+                    mPanel.process(&events[i]);
+                }
+                mMessenger.flushBatch();
+            }
+        }
+        if(fds[1].revents & POLLIN) {
+            char buf[64];
+            while(read(mWakePipe[0], buf, sizeof(buf)) > 0) {
+            }
+        }
+    }
+}
+
+void TouchVcr::dumpStats(FILE* output) const {
+    pthread_mutex_lock(&mLock);
+    fprintf(output, "Session: %llu spans played (%llu messages), %llu cancelled, %d queued\n",
+            (unsigned long long)mSpansDone, (unsigned long long)mMessagesReplayed,
+            (unsigned long long)mSpansCancelled, (int)mSubmitted.size());
+    pthread_mutex_unlock(&mLock);
+}
@@ -0,0 +1,119 @@
+#ifndef TOUCH_VCR_SESSION
+#define TOUCH_VCR_SESSION
+
+#include "touch_vcr.h"
+#include "TouchPanel.h"
+#include "InputMessenger.h"
+#include "ReplayScheduler.h"
+#include "Trace.h"
+#include <pthread.h>
+#include <deque>
+#include <vector>
+
+/* Record and replay from inside another process, without touch_vcr's main()
+ * or any text in between.
+ *
+ * A session owns one device and a thread that does everything touch_vcr's poll
+ * loop does for it: recorded messages are handed to a callback in a batch per
+ * device read, and submitted spans of messages are replayed one after another,
+ * each on its own timeline starting when the span before it finishes.  Every
+ * span reports back once it has been played or cancelled.  Callbacks run on the
+ * session thread and must not block for long; they may call back into the
+ * session. */
+// What became of a replayed span.  Times are CLOCK_MONOTONIC ns, -1 for never.
+struct SpanResult {
+    uint32_t span;
+    bool completed;         // Played to the end rather than cancelled
+    nsecs_t submitted;
+    nsecs_t started;
+    nsecs_t firstEvent;     // When its first frame was written
+    nsecs_t finished;
+};
+
+class TouchVcr {
+public:
+    typedef MessageBatchCallback RecordCallback;
+    typedef void (*ReplayCallback)(const SpanResult &result, void* user);
+
+    TouchVcr(const char* device, int screenWidth, int screenHeight);
+    ~TouchVcr();
+
+    // Setup, before start()
+    void setOrientation(int rotation, bool flipX, bool flipY);
+    bool open();
+    // Uses an already open device such as a uinput panel.  The fd stays the caller's.
+    void attach(int fd, const input_absinfo &xInfo, const input_absinfo &yInfo);
+
+    bool start();
+    // Stops the session thread.  Spans not played yet complete as cancelled.
+    void stop();
+
+    // Delivers recorded messages to callback until stopRecording()
+    void startRecording(RecordCallback callback, void* user);
+    void stopRecording();
+
+    // Copies count messages and queues them to play after every span before.
+    // Returns the span's id, which done gets back along with how it went.
+    uint32_t replay(const Message* msgs, size_t count, ReplayCallback done, void* user);
+
+    // Stops a queued or playing span, lifting any contacts it left down
+    void cancel(uint32_t span);
+
+    void dumpStats(FILE* output) const;
+
+private:
+    TouchVcr(const TouchVcr&);
+    TouchVcr& operator=(const TouchVcr&);
+
+    static const int SLOT_COUNT = 10;
+
+    struct Span {
+        SpanResult result;
+        Trace trace;
+        std::vector<nsecs_t> offsets;
+        size_t next;
+        uint64_t frameMark;             // Panel frame count when it started
+        std::vector<int32_t> down;      // Tracking ids this span has touching
+        ReplayCallback done;
+        void* user;
+    };
+
+    char mDevice[PATH_MAX];
+    InputMessenger mMessenger;
+    TouchPanel mPanel;
+    int mDeviceFD;
+    bool mOwnsFD;
+    int mTimerFD;
+    ReplayScheduler mScheduler;
+
+    pthread_t mThread;
+    bool mRunning;
+    int mWakePipe[2];
+
+    // Everything below is shared with the session thread
+    mutable pthread_mutex_t mLock;
+    bool mStopping;
+    uint32_t mNextSpanId;
+    std::deque<Span*> mSubmitted;
+    std::vector<uint32_t> mCancelled;
+    bool mRecordChanged;
+    RecordCallback mRecordCallback;
+    void* mRecordUser;
+    uint64_t mSpansDone;
+    uint64_t mSpansCancelled;
+    uint64_t mMessagesReplayed;
+
+    // Session thread only
+    std::deque<Span*> mSpans;
+
+    static void* threadMain(void* arg);
+    void run();
+    void wake();
+    bool takeRequests(std::vector<Span*> &cancelled);
+    void play(Span* span, nsecs_t now);
+    void noteFirstFrame(Span* span);
+    void lift(Span* span);
+    void report(Span* span, bool completed);
+};
+
+#endif // TOUCH_VCR_SESSION
@@ -0,0 +1,165 @@
+#include "Trace.h"
+#include "TraceCache.h"
+#include "TraceCodec.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+Trace::Trace() : mOwned(NULL), mMapping(NULL), mMappingSize(0), mRecords(NULL), mCount(0) {
+}
+
+Trace::~Trace() {
+    clear();
+}
+
+void Trace::clear() {
+    delete[] mOwned;
+    if(mMapping) {
+        munmap(mMapping, mMappingSize);
+    }
+    mOwned = NULL;
+    mMapping = NULL;
+    mMappingSize = 0;
+    mRecords = NULL;
+    mCount = 0;
+}
+
+void Trace::adopt(void* mapping, size_t mappingSize, size_t offset, size_t count) {
+    clear();
+    mMapping = mapping;
+    mMappingSize = mappingSize;
+    mRecords = (const MessageRecord*)((const char*)mapping + offset);
+    mCount = count;
+}
+
+bool Trace::get(size_t index, Message &msg) const {
+    if(index >= mCount) {
+        return false;
+    }
+    return Message::fromRecord(mRecords[index], msg);
+}
+
+void Trace::timeline(nsecs_t* offsets) const {
+    nsecs_t base = 0;
+    int32_t timebase = mCount > 0 ? mRecords[0].timestamp : 0;
+    nsecs_t offset = 0;
+    for(size_t i = 0; i < mCount; i++) {
+        if(mRecords[i].type == RESET) {
+            base = offset;
+            timebase = mRecords[i].timestamp;
+        }
+        offset = base + (nsecs_t)(mRecords[i].timestamp - timebase) * 1000000LL;
+        offsets[i] = offset;
+    }
+}
+
+bool Trace::parse(const char* text, size_t len) {
+    clear();
+
+    // At most one record per line
+    size_t lines = 0;
+    for(size_t i = 0; i < len; i++) {
+        if(text[i] == '\n') lines++;
+    }
+    mOwned = new MessageRecord[lines + 1];
+
+    const char* end = text + len;
+    const char* line = text;
+    int lineNumber = 0;
+    int32_t lastTimestamp = INT_MIN;
+    while(line < end) {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if(!eol) eol = end;
+        lineNumber++;
+
+        if(eol > line) {
+            Message msg;
+            if(!Message::fromText(line, eol - line, msg)) {
+                fprintf(stderr, "Failed to parse line %d: %.*s\n", lineNumber, (int)(eol - line), line);
+            } else if(msg.getTimestamp() < lastTimestamp && !msg.isReset()) {
+                fprintf(stderr, "Line %d goes back in time, skipping\n", lineNumber);
+            } else {
+                lastTimestamp = msg.isReset() ? INT_MIN : msg.getTimestamp();
+                msg.toRecord(&mOwned[mCount++]);
+            }
+        }
+        line = eol + 1;
+    }
+
+    mRecords = mOwned;
+    return true;
+}
+
+bool Trace::parseStrokes(const char* data, size_t len, int sampleRate) {
+    clear();
+
+    std::vector<Message> msgs;
+    bool ok = TraceCodec::decode(FORMAT_STROKE, data, len, msgs, sampleRate);
+    if(!ok) {
+        fprintf(stderr, "Stroke trace is malformed, keeping the %d messages before the damage\n",
+                (int)msgs.size());
+    }
+
+    assign(msgs.empty() ? NULL : &msgs[0], msgs.size());
+    return true;
+}
+
+void Trace::assign(const Message* msgs, size_t count) {
+    clear();
+    mOwned = new MessageRecord[count + 1];
+    for(size_t i = 0; i < count; i++) {
+        msgs[i].toRecord(&mOwned[mCount++]);
+    }
+    mRecords = mOwned;
+}
+
+bool Trace::load(const char* path, TraceCache* cache, int sampleRate) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        fprintf(stderr, "could not open trace %s, %s\n", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if(fstat(fd, &st) < 0) {
+        close(fd);
+        return false;
+    }
+
+    size_t len = st.st_size;
+    if(len == 0) {
+        close(fd);
+        clear();
+        return true;
+    }
+    void* text = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(text == MAP_FAILED) {
+        fprintf(stderr, "could not map trace %s, %s\n", path, strerror(errno));
+        return false;
+    }
+
+    // Stroke traces are binary, anything else is taken to be text
+    uint32_t magic = 0;
+    memcpy(&magic, text, len < sizeof(magic) ? len : sizeof(magic));
+    bool strokes = magic == TraceCodec::STROKE_MAGIC;
+
+    bool ok = true;
+    if(cache) {
+        // The same strokes regenerated at another rate are a different trace
+        uint64_t hash = TraceCache::hash(text, len);
+        if(strokes) {
+            hash = TraceCache::hash(&sampleRate, sizeof(sampleRate), hash);
+        }
+        if(!cache->lookup(hash, len, this)) {
+            ok = strokes ? parseStrokes((const char*)text, len, sampleRate) : parse((const char*)text, len);
+            if(ok) {
+                cache->store(hash, len, mRecords, mCount);
+            }
+        }
+    } else {
+        ok = strokes ? parseStrokes((const char*)text, len, sampleRate) : parse((const char*)text, len);
+    }
+
+    munmap(text, len);
+    return ok;
+}
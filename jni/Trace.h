@@ -0,0 +1,54 @@
+#ifndef TRACE
+#define TRACE
+
+#include "touch_vcr.h"
+#include "Message.h"
+
+class TraceCache;
+
+/* An immutable, fully parsed trace.  The records either live in memory mapped
+ * from the trace cache or in a buffer owned by the trace. */
+class Trace {
+public:
+    Trace();
+    ~Trace();
+
+    // Parses a text trace.  Lines that aren't valid messages are reported and skipped.
+    bool parse(const char* text, size_t len);
+
+    // Decodes a stroke trace, regenerating samples at sampleRate Hz (0 for the
+    // recorded sample count)
+    bool parseStrokes(const char* data, size_t len, int sampleRate);
+
+    // Loads a text or stroke trace from path, going through the cache if one is given
+    bool load(const char* path, TraceCache* cache, int sampleRate = 0);
+
+    // Copies count messages
+    void assign(const Message* msgs, size_t count);
+
+    // Takes ownership of a mapping holding count records at offset
+    void adopt(void* mapping, size_t mappingSize, size_t offset, size_t count);
+
+    inline size_t size() const { return mCount; }
+    inline const MessageRecord* records() const { return mRecords; }
+    bool get(size_t index, Message &msg) const;
+
+    // Fills offsets (size() entries) with when each record is due, in ns from the
+    // first.  A reset restarts the trace's clock from wherever the record before
+    // it was due.
+    void timeline(nsecs_t* offsets) const;
+
+private:
+    Trace(const Trace&);
+    Trace& operator=(const Trace&);
+
+    void clear();
+
+    MessageRecord* mOwned;
+    void* mMapping;
+    size_t mMappingSize;
+    const MessageRecord* mRecords;
+    size_t mCount;
+};
+
+#endif // TRACE
@@ -0,0 +1,247 @@
+#include "TraceCache.h"
+#include "Trace.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+// The directory plus the longest name kept in it, a temporary entry
+static const size_t PATH_LENGTH = PATH_MAX + 64;
+
+struct CacheEntry {
+    char name[32];
+    off_t size;
+    time_t mtime;
+
+    bool operator<(const CacheEntry &other) const { return mtime < other.mtime; }
+};
+
+TraceCache::TraceCache(const char* dir, uint64_t maxBytes) :
+    mMaxBytes(maxBytes), mHits(0), mMisses(0), mLoadedHits(0), mLoadedMisses(0) {
+    strncpy(mDir, dir, sizeof(mDir) - 1);
+    mDir[sizeof(mDir) - 1] = '\0';
+    if(mkdir(mDir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "could not create cache directory %s, %s\n", mDir, strerror(errno));
+    }
+    readStats(&mLoadedHits, &mLoadedMisses);
+    mHits = mLoadedHits;
+    mMisses = mLoadedMisses;
+}
+
+TraceCache::~TraceCache() {
+    saveStats();
+}
+
+// 64 bit FNV-1a
+uint64_t TraceCache::hash(const void* data, size_t len, uint64_t seed) {
+    const uint8_t* p = (const uint8_t*)data;
+    uint64_t h = seed;
+    for(size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+void TraceCache::entryPath(uint64_t hash, char* path, size_t len) const {
+    snprintf(path, len, "%s/%016llx.tvc", mDir, (unsigned long long)hash);
+}
+
+bool TraceCache::lookup(uint64_t hash, uint64_t sourceSize, Trace* trace) {
+    char path[PATH_LENGTH];
+    entryPath(hash, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        mMisses++;
+        return false;
+    }
+
+    struct stat st;
+    void* base = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(TraceCacheHeader)) {
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(base == MAP_FAILED) {
+        mMisses++;
+        return false;
+    }
+
+    const TraceCacheHeader* header = (const TraceCacheHeader*)base;
+    if(header->magic != MAGIC || header->version != VERSION || header->recordSize != sizeof(MessageRecord) ||
+       header->hash != hash || header->sourceSize != sourceSize ||
+       (uint64_t)st.st_size != sizeof(TraceCacheHeader) + (uint64_t)header->count * sizeof(MessageRecord)) {
+        fprintf(stderr, "Discarding stale cache entry %s\n", path);
+        munmap(base, st.st_size);
+        unlink(path);
+        mMisses++;
+        return false;
+    }
+
+    // Mark as recently used
+    utimes(path, NULL);
+
+    trace->adopt(base, st.st_size, sizeof(TraceCacheHeader), header->count);
+    mHits++;
+    return true;
+}
+
+void TraceCache::store(uint64_t hash, uint64_t sourceSize, const MessageRecord* records, size_t count) {
+    char path[PATH_LENGTH];
+    char tmpPath[PATH_LENGTH];
+    entryPath(hash, path, sizeof(path));
+    if(snprintf(tmpPath, sizeof(tmpPath), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(tmpPath)) {
+        fprintf(stderr, "cache directory %s is too long\n", mDir);
+        return;
+    }
+
+    TraceCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = MAGIC;
+    header.version = VERSION;
+    header.recordSize = sizeof(MessageRecord);
+    header.count = count;
+    header.hash = hash;
+    header.sourceSize = sourceSize;
+
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "could not write cache entry %s, %s\n", tmpPath, strerror(errno));
+        return;
+    }
+    size_t recordBytes = count * sizeof(MessageRecord);
+    bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header) &&
+              write(fd, records, recordBytes) == (ssize_t)recordBytes;
+    close(fd);
+
+    // Rename into place so readers never see a partial entry
+    if(!ok || rename(tmpPath, path) < 0) {
+        fprintf(stderr, "could not store cache entry %s, %s\n", path, strerror(errno));
+        unlink(tmpPath);
+        return;
+    }
+    evict();
+}
+
+// Every entry counts toward the cap, but only the MAX_ENTRIES oldest are kept
+// as candidates, in a heap with the newest of them on top.  If deleting all of
+// them isn't enough, the directory is scanned again.
+void TraceCache::evict() {
+    static CacheEntry entries[MAX_ENTRIES];
+    bool truncated = true;
+    while(truncated) {
+        int count = 0;
+        uint64_t total = 0;
+        truncated = false;
+        if(!scanEntries(entries, &count, &total, &truncated) || total <= mMaxBytes) {
+            return;
+        }
+
+        std::sort_heap(entries, entries + count);
+        int deleted = 0;
+        for(int i = 0; i < count && total > mMaxBytes; i++) {
+            char path[PATH_LENGTH];
+            if(snprintf(path, sizeof(path), "%s/%s", mDir, entries[i].name) < (int)sizeof(path) &&
+               unlink(path) == 0) {
+                total -= entries[i].size;
+                deleted++;
+            }
+        }
+        if(deleted == 0) {
+            return;
+        }
+    }
+}
+
+bool TraceCache::scanEntries(CacheEntry* entries, int* count, uint64_t* total, bool* truncated) const {
+    DIR* dir = opendir(mDir);
+    if(!dir) {
+        return false;
+    }
+    struct dirent* de;
+    while((de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+        if(len < 4 || len >= sizeof(entries[0].name) || strcmp(de->d_name + len - 4, ".tvc") != 0) {
+            continue;
+        }
+        char path[PATH_LENGTH];
+        struct stat st;
+        if(snprintf(path, sizeof(path), "%s/%s", mDir, de->d_name) >= (int)sizeof(path) ||
+           stat(path, &st) < 0) {
+            continue;
+        }
+        *total += st.st_size;
+
+        if(*count == MAX_ENTRIES) {
+            *truncated = true;
+            if(st.st_mtime >= entries[0].mtime) {
+                continue;
+            }
+            std::pop_heap(entries, entries + *count);
+            (*count)--;
+        }
+        CacheEntry &entry = entries[*count];
+        strcpy(entry.name, de->d_name);
+        entry.size = st.st_size;
+        entry.mtime = st.st_mtime;
+        (*count)++;
+        std::push_heap(entries, entries + *count);
+    }
+    closedir(dir);
+    return true;
+}
+
+bool TraceCache::readStats(uint64_t* hits, uint64_t* misses) const {
+    char path[PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/stats", mDir);
+    FILE* f = fopen(path, "r");
+    if(!f) {
+        return false;
+    }
+    unsigned long long h, m;
+    bool ok = fscanf(f, "hits %llu misses %llu", &h, &m) == 2;
+    fclose(f);
+    if(ok) {
+        *hits = h;
+        *misses = m;
+    }
+    return ok;
+}
+
+// Adds this cache's counts to whatever other processes sharing the directory
+// have saved since we read the file, and renames the result into place
+void TraceCache::saveStats() {
+    uint64_t hits = mHits - mLoadedHits;
+    uint64_t misses = mMisses - mLoadedMisses;
+    if(hits == 0 && misses == 0) {
+        return;
+    }
+    uint64_t savedHits = 0, savedMisses = 0;
+    readStats(&savedHits, &savedMisses);
+
+    char path[PATH_LENGTH];
+    char tmpPath[PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s/stats", mDir);
+    snprintf(tmpPath, sizeof(tmpPath), "%s/stats.%d.tmp", mDir, (int)getpid());
+    FILE* f = fopen(tmpPath, "w");
+    if(!f) {
+        return;
+    }
+    fprintf(f, "hits %llu misses %llu\n", (unsigned long long)(savedHits + hits),
+            (unsigned long long)(savedMisses + misses));
+    if(fclose(f) != 0 || rename(tmpPath, path) < 0) {
+        fprintf(stderr, "could not save cache stats %s, %s\n", path, strerror(errno));
+        unlink(tmpPath);
+        return;
+    }
+    mLoadedHits = mHits;
+    mLoadedMisses = mMisses;
+}
+
+void TraceCache::dumpStats(FILE* output) const {
+    uint64_t total = mHits + mMisses;
+    fprintf(output, "Trace cache %s: %llu hits %llu misses (%.0f%% hit rate)\n", mDir,
+            (unsigned long long)mHits, (unsigned long long)mMisses, total ? 100.0 * mHits / total : 0.0);
+}
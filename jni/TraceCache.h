@@ -0,0 +1,61 @@
+#ifndef TRACE_CACHE
+#define TRACE_CACHE
+
+#include "touch_vcr.h"
+#include "Message.h"
+
+class Trace;
+struct CacheEntry;
+
+struct TraceCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t count;
+    uint64_t hash;          // Of the source text
+    uint64_t sourceSize;
+};
+
+/* Directory of parsed traces keyed by a hash of their text.  Each entry is a
+ * TraceCacheHeader followed by the MessageRecords, ready to be mapped.  Entries
+ * are evicted least recently used first (by mtime, which is bumped on every hit)
+ * once the directory grows past its size cap.  Hit and miss counts are kept in
+ * a stats file next to the entries; a cache adds its own counts to the file
+ * once, when it is destroyed. */
+class TraceCache {
+public:
+    static const uint32_t MAGIC = 0x54564354;   // "TVCT"
+    static const uint32_t VERSION = 1;
+    static const int MAX_ENTRIES = 1024;
+    static const uint64_t HASH_SEED = 0xcbf29ce484222325ULL;
+
+    TraceCache(const char* dir, uint64_t maxBytes);
+    ~TraceCache();
+
+    // Pass a previous hash as seed to extend it with more data
+    static uint64_t hash(const void* data, size_t len, uint64_t seed = HASH_SEED);
+
+    // Maps the entry for the given source into trace.  Returns false on a miss.
+    bool lookup(uint64_t hash, uint64_t sourceSize, Trace* trace);
+    void store(uint64_t hash, uint64_t sourceSize, const MessageRecord* records, size_t count);
+
+    inline uint64_t getHits() const { return mHits; }
+    inline uint64_t getMisses() const { return mMisses; }
+    void dumpStats(FILE* output) const;
+
+private:
+    char mDir[PATH_MAX];
+    uint64_t mMaxBytes;
+    uint64_t mHits;         // Including those from the stats file
+    uint64_t mMisses;
+    uint64_t mLoadedHits;   // Read from the stats file
+    uint64_t mLoadedMisses;
+
+    void entryPath(uint64_t hash, char* path, size_t len) const;
+    bool readStats(uint64_t* hits, uint64_t* misses) const;
+    void saveStats();
+    void evict();
+    bool scanEntries(CacheEntry* entries, int* count, uint64_t* total, bool* truncated) const;
+};
+
+#endif // TRACE_CACHE
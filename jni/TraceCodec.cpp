@@ -0,0 +1,564 @@
+#include "TraceCodec.h"
+#include "MessageFormat.h"
+#include <algorithm>
+#include <math.h>
+
+const double TraceCodec::DEFAULT_MAX_ERROR = 1.0;
+
+// Record types in stroke blocks, alongside RESET
+static const int STROKE_RECORD = 4;
+static const uint32_t STROKE_STOPPED = 1;
+static const uint32_t STROKE_SAMPLES = 2;
+
+static inline uint32_t zigzag(int32_t value) {
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value) {
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static inline void putVarint(std::vector<char> &out, uint32_t value) {
+    while(value >= 0x80) {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+static inline bool getVarint(const uint8_t** pos, const uint8_t* end, uint32_t* out) {
+    uint32_t value = 0;
+    for(int shift = 0; shift < 35 && *pos < end; shift += 7) {
+        uint8_t b = *(*pos)++;
+        value |= (uint32_t)(b & 0x7f) << shift;
+        if(!(b & 0x80)) {
+            *out = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+TraceFormat TraceCodec::parseFormat(const char* name) {
+    if(strcmp(name, "text") == 0) {
+        return FORMAT_TEXT;
+    } else if(strcmp(name, "record") == 0) {
+        return FORMAT_RECORD;
+    } else if(strcmp(name, "packed") == 0) {
+        return FORMAT_PACKED;
+    } else if(strcmp(name, "stroke") == 0) {
+        return FORMAT_STROKE;
+    } else if(strcmp(name, "csv") == 0) {
+        return FORMAT_CSV;
+    } else if(strcmp(name, "jsonl") == 0) {
+        return FORMAT_JSON;
+    } else if(strcmp(name, "fixed") == 0) {
+        return FORMAT_FIXED;
+    }
+    return FORMAT_UNKNOWN;
+}
+
+bool TraceCodec::canDecode(TraceFormat format) {
+    return format == FORMAT_TEXT || format == FORMAT_RECORD || format == FORMAT_PACKED || format == FORMAT_STROKE;
+}
+
+const char* TraceCodec::header(TraceFormat format) {
+    return format == FORMAT_CSV ? CsvFormat::header() : NULL;
+}
+
+size_t TraceCodec::splitPoint(TraceFormat format, const char* data, size_t len, bool atEnd) {
+    switch(format) {
+    case FORMAT_TEXT: {
+        if(atEnd) {
+            return len;
+        }
+        for(size_t i = len; i > 0; i--) {
+            if(data[i - 1] == '\n') {
+                return i;
+            }
+        }
+        return 0;
+    }
+    case FORMAT_RECORD:
+        return len - len % sizeof(MessageRecord);
+    case FORMAT_PACKED:
+        return blockSplitPoint(PACKED_MAGIC, data, len, atEnd);
+    case FORMAT_STROKE:
+        return blockSplitPoint(STROKE_MAGIC, data, len, atEnd);
+    default:
+        return len;
+    }
+}
+
+size_t TraceCodec::blockSplitPoint(uint32_t magic, const char* data, size_t len, bool atEnd) {
+    size_t pos = 0;
+    while(len - pos >= sizeof(PackedBlockHeader)) {
+        PackedBlockHeader header;
+        memcpy(&header, data + pos, sizeof(header));
+        size_t blockLen = sizeof(header) + header.payloadBytes;
+        if(header.magic != magic) {
+            // A corrupt header takes the rest of the input with it so decode()
+            // can report it
+            return len;
+        }
+        if(blockLen > len - pos) {
+            break;
+        }
+        pos += blockLen;
+    }
+    return atEnd ? len : pos;
+}
+
+bool TraceCodec::decode(TraceFormat format, const char* data, size_t len, std::vector<Message> &out,
+        int sampleRate) {
+    switch(format) {
+    case FORMAT_TEXT:
+        return decodeText(data, len, out);
+    case FORMAT_RECORD:
+        return decodeRecords(data, len, out);
+    case FORMAT_PACKED:
+        return decodePacked(data, len, out);
+    case FORMAT_STROKE:
+        return decodeStrokes(data, len, out, sampleRate);
+    default:
+        return false;
+    }
+}
+
+bool TraceCodec::decodeText(const char* data, size_t len, std::vector<Message> &out) {
+    bool ok = true;
+    const char* end = data + len;
+    const char* line = data;
+    while(line < end) {
+        const char* eol = (const char*)memchr(line, '\n', end - line);
+        if(!eol) eol = end;
+        if(eol > line) {
+            Message msg;
+            if(Message::fromText(line, eol - line, msg)) {
+                out.push_back(msg);
+            } else {
+                ok = false;
+            }
+        }
+        line = eol + 1;
+    }
+    return ok;
+}
+
+bool TraceCodec::decodeRecords(const char* data, size_t len, std::vector<Message> &out) {
+    bool ok = len % sizeof(MessageRecord) == 0;
+    size_t count = len / sizeof(MessageRecord);
+    out.reserve(out.size() + count);
+    for(size_t i = 0; i < count; i++) {
+        MessageRecord record;
+        memcpy(&record, data + i * sizeof(record), sizeof(record));
+        Message msg;
+        if(Message::fromRecord(record, msg)) {
+            out.push_back(msg);
+        } else {
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+bool TraceCodec::decodePacked(const char* data, size_t len, std::vector<Message> &out) {
+    size_t pos = 0;
+    while(len - pos >= sizeof(PackedBlockHeader)) {
+        PackedBlockHeader header;
+        memcpy(&header, data + pos, sizeof(header));
+        if(header.magic != PACKED_MAGIC || header.payloadBytes > len - pos - sizeof(header)) {
+            return false;
+        }
+
+        const uint8_t* p = (const uint8_t*)data + pos + sizeof(header);
+        const uint8_t* end = p + header.payloadBytes;
+        int32_t timestamp = header.baseTimestamp;
+        int32_t trackingID = 0;
+        int32_t x = 0;
+        int32_t y = 0;
+        out.reserve(out.size() + header.count);
+
+        for(uint32_t i = 0; i < header.count; i++) {
+            uint32_t value;
+            if(p >= end) return false;
+            int type = *p++;
+            if(!getVarint(&p, end, &value)) return false;
+            timestamp += unzigzag(value);
+
+            if(type == SYNC || type == STOP) {
+                if(!getVarint(&p, end, &value)) return false;
+                trackingID += unzigzag(value);
+            }
+            if(type == SYNC) {
+                if(!getVarint(&p, end, &value)) return false;
+                x += unzigzag(value);
+                if(!getVarint(&p, end, &value)) return false;
+                y += unzigzag(value);
+                out.push_back(Message::Sync(timestamp, trackingID, x, y));
+            } else if(type == STOP) {
+                out.push_back(Message::Stop(timestamp, trackingID));
+            } else if(type == RESET) {
+                out.push_back(Message::Reset(timestamp));
+            } else {
+                return false;
+            }
+        }
+        pos += sizeof(header) + header.payloadBytes;
+    }
+    return pos == len;
+}
+
+void TraceCodec::encode(TraceFormat format, const Message* msgs, size_t count, std::vector<char> &out,
+        double maxError) {
+    switch(format) {
+    case FORMAT_TEXT:
+        encodeLines<TextFormat>(msgs, count, out);
+        break;
+    case FORMAT_CSV:
+        encodeLines<CsvFormat>(msgs, count, out);
+        break;
+    case FORMAT_JSON:
+        encodeLines<JsonFormat>(msgs, count, out);
+        break;
+    case FORMAT_FIXED:
+        encodeLines<FixedFormat>(msgs, count, out);
+        break;
+    case FORMAT_RECORD: {
+        size_t start = out.size();
+        out.resize(start + count * sizeof(MessageRecord));
+        for(size_t i = 0; i < count; i++) {
+            MessageRecord record;
+            msgs[i].toRecord(&record);
+            memcpy(&out[start + i * sizeof(record)], &record, sizeof(record));
+        }
+        break;
+    }
+    case FORMAT_PACKED:
+        encodePacked(msgs, count, out);
+        break;
+    case FORMAT_STROKE:
+        encodeStrokes(msgs, count, out, maxError);
+        break;
+    default:
+        break;
+    }
+}
+
+// Serializes straight into out, trimming to what was written once done
+template<class Format>
+void TraceCodec::encodeLines(const Message* msgs, size_t count, std::vector<char> &out) {
+    size_t pos = out.size();
+    out.resize(pos + count * MAX_SERIALIZED_LENGTH);
+    for(size_t i = 0; i < count; i++) {
+        int len = serializeMessage<Format>(msgs[i], &out[pos], MAX_SERIALIZED_LENGTH);
+        if(len > 0) {
+            pos += len;
+        }
+    }
+    out.resize(pos);
+}
+
+void TraceCodec::encodePacked(const Message* msgs, size_t count, std::vector<char> &out) {
+    for(size_t first = 0; first < count; first += PACKED_BLOCK_RECORDS) {
+        size_t n = count - first < PACKED_BLOCK_RECORDS ? count - first : PACKED_BLOCK_RECORDS;
+
+        size_t headerPos = out.size();
+        out.resize(headerPos + sizeof(PackedBlockHeader));
+
+        PackedBlockHeader header;
+        header.magic = PACKED_MAGIC;
+        header.count = n;
+        header.baseTimestamp = msgs[first].getTimestamp();
+
+        int32_t timestamp = header.baseTimestamp;
+        int32_t trackingID = 0;
+        int32_t x = 0;
+        int32_t y = 0;
+        for(size_t i = first; i < first + n; i++) {
+            const Message &msg = msgs[i];
+            int type = msg.isSync() ? SYNC : msg.isStop() ? STOP : RESET;
+            out.push_back((char)type);
+            putVarint(out, zigzag(msg.getTimestamp() - timestamp));
+            timestamp = msg.getTimestamp();
+
+            if(type == SYNC || type == STOP) {
+                putVarint(out, zigzag(msg.getTrackingID() - trackingID));
+                trackingID = msg.getTrackingID();
+            }
+            if(type == SYNC) {
+                putVarint(out, zigzag(msg.getX() - x));
+                putVarint(out, zigzag(msg.getY() - y));
+                x = msg.getX();
+                y = msg.getY();
+            }
+        }
+
+        header.payloadBytes = out.size() - headerPos - sizeof(header);
+        memcpy(&out[headerPos], &header, sizeof(header));
+    }
+}
+
+// --- Strokes ---
+
+struct PendingStroke {
+    int type;
+    int32_t start;
+    int32_t trackingID;
+    bool stopped;
+    int32_t stopTime;
+    std::vector<StrokeSample> samples;
+};
+
+static bool earlierMessage(const Message &a, const Message &b) {
+    return a.getTimestamp() < b.getTimestamp();
+}
+
+void TraceCodec::encodeStrokes(const Message* msgs, size_t count, std::vector<char> &out, double maxError) {
+    std::vector<PendingStroke> strokes;
+    std::vector<size_t> open;
+    std::vector<StrokeSegment> segments;
+
+    for(size_t first = 0; first < count; first += PACKED_BLOCK_RECORDS) {
+        size_t n = count - first < PACKED_BLOCK_RECORDS ? count - first : PACKED_BLOCK_RECORDS;
+        strokes.clear();
+        open.clear();
+
+        // Gather each tracking id's samples into strokes, in order of touch-down
+        for(size_t i = first; i < first + n; i++) {
+            const Message &msg = msgs[i];
+            if(msg.isReset()) {
+                open.clear();
+                strokes.push_back(PendingStroke());
+                strokes.back().type = RESET;
+                strokes.back().start = msg.getTimestamp();
+                continue;
+            }
+
+            size_t index = strokes.size();
+            for(size_t k = 0; k < open.size(); k++) {
+                if(strokes[open[k]].trackingID == msg.getTrackingID()) {
+                    index = open[k];
+                    if(msg.isStop()) {
+                        open.erase(open.begin() + k);
+                    }
+                    break;
+                }
+            }
+            if(index == strokes.size()) {
+                strokes.push_back(PendingStroke());
+                PendingStroke &stroke = strokes.back();
+                stroke.type = STROKE_RECORD;
+                stroke.start = msg.getTimestamp();
+                stroke.trackingID = msg.getTrackingID();
+                stroke.stopped = false;
+                if(msg.isSync()) {
+                    open.push_back(index);
+                }
+            }
+
+            PendingStroke &stroke = strokes[index];
+            if(msg.isStop()) {
+                stroke.stopped = true;
+                stroke.stopTime = msg.getTimestamp();
+            } else if(msg.isSync()) {
+                StrokeSample sample = { msg.getTimestamp(), msg.getX(), msg.getY() };
+                // Two samples at the same time, the later one wins
+                if(!stroke.samples.empty() && stroke.samples.back().t >= sample.t) {
+                    stroke.samples.back() = sample;
+                } else {
+                    stroke.samples.push_back(sample);
+                }
+            }
+        }
+
+        size_t headerPos = out.size();
+        out.resize(headerPos + sizeof(PackedBlockHeader));
+
+        PackedBlockHeader header;
+        header.magic = STROKE_MAGIC;
+        header.count = strokes.size();
+        header.baseTimestamp = strokes.empty() ? 0 : strokes[0].start;
+
+        int32_t timestamp = header.baseTimestamp;
+        int32_t trackingID = 0;
+        int32_t x = 0;
+        int32_t y = 0;
+        for(size_t i = 0; i < strokes.size(); i++) {
+            const PendingStroke &stroke = strokes[i];
+            out.push_back((char)stroke.type);
+            putVarint(out, zigzag(stroke.start - timestamp));
+            timestamp = stroke.start;
+            if(stroke.type == RESET) {
+                continue;
+            }
+
+            putVarint(out, zigzag(stroke.trackingID - trackingID));
+            trackingID = stroke.trackingID;
+            putVarint(out, (stroke.stopped ? STROKE_STOPPED : 0) | (stroke.samples.empty() ? 0 : STROKE_SAMPLES));
+
+            int32_t last = stroke.start;
+            if(!stroke.samples.empty()) {
+                const StrokeSample &p0 = stroke.samples[0];
+                putVarint(out, zigzag(p0.x - x));
+                putVarint(out, zigzag(p0.y - y));
+                x = p0.x;
+                y = p0.y;
+
+                segments.clear();
+                StrokeFitter::fit(&stroke.samples[0], stroke.samples.size(), maxError, segments);
+                putVarint(out, stroke.samples.size());
+                putVarint(out, segments.size());
+                for(size_t k = 0; k < segments.size(); k++) {
+                    const StrokeSegment &segment = segments[k];
+                    putVarint(out, segment.duration);
+                    putVarint(out, zigzag(segment.x1));
+                    putVarint(out, zigzag(segment.y1));
+                    putVarint(out, zigzag(segment.x2));
+                    putVarint(out, zigzag(segment.y2));
+                    putVarint(out, zigzag(segment.x3));
+                    putVarint(out, zigzag(segment.y3));
+                }
+                last = stroke.samples.back().t;
+            }
+            if(stroke.stopped) {
+                putVarint(out, stroke.stopTime - last);
+            }
+        }
+
+        header.payloadBytes = out.size() - headerPos - sizeof(header);
+        memcpy(&out[headerPos], &header, sizeof(header));
+    }
+}
+
+// Puts back the syncs of one stroke, at sampleRate or spread evenly with the
+// recorded sample count
+static void regenerate(int32_t start, int32_t trackingID, int32_t x0, int32_t y0, uint32_t sampleCount,
+        const std::vector<StrokeSegment> &segments, int sampleRate, std::vector<Message> &out) {
+    int32_t end = start;
+    for(size_t i = 0; i < segments.size(); i++) {
+        end += segments[i].duration;
+    }
+    if(segments.empty() || end == start) {
+        out.push_back(Message::Sync(start, trackingID, x0, y0));
+        return;
+    }
+
+    double step = sampleRate > 0 ? 1000.0 / sampleRate :
+            sampleCount > 1 ? double(end - start) / (sampleCount - 1) : end - start;
+    size_t segment = 0;
+    int32_t segmentStart = start;
+    int32_t lastTime = start - 1;
+    for(uint32_t k = 0; ; k++) {
+        int32_t t = start + (int32_t)floor(k * step + 0.5);
+        if(t > end) {
+            t = end;
+        }
+        if(t > lastTime) {
+            while(segment + 1 < segments.size() && t > segmentStart + segments[segment].duration) {
+                segmentStart += segments[segment].duration;
+                x0 += segments[segment].x3;
+                y0 += segments[segment].y3;
+                segment++;
+            }
+            int32_t x, y;
+            StrokeFitter::evaluate(segments[segment], x0, y0, t - segmentStart, &x, &y);
+            out.push_back(Message::Sync(t, trackingID, x, y));
+            lastTime = t;
+        }
+        if(t == end) {
+            break;
+        }
+    }
+}
+
+// Blocks are written as strokes end, so a stroke can start before ones in
+// earlier blocks; merge across blocks up to the next reset.  Whatever decoded
+// before any damage is merged too.
+bool TraceCodec::decodeStrokes(const char* data, size_t len, std::vector<Message> &out, int sampleRate) {
+    size_t epoch = out.size();
+    bool ok = decodeStrokeBlocks(data, len, out, sampleRate, &epoch);
+    std::stable_sort(out.begin() + epoch, out.end(), earlierMessage);
+    return ok;
+}
+
+// Decodes the blocks unmerged, except that messages before each reset are
+// merged and *epoch moved past it
+bool TraceCodec::decodeStrokeBlocks(const char* data, size_t len, std::vector<Message> &out, int sampleRate,
+        size_t* epoch) {
+    std::vector<StrokeSegment> segments;
+    size_t pos = 0;
+    while(len - pos >= sizeof(PackedBlockHeader)) {
+        PackedBlockHeader header;
+        memcpy(&header, data + pos, sizeof(header));
+        if(header.magic != STROKE_MAGIC || header.payloadBytes > len - pos - sizeof(header)) {
+            return false;
+        }
+
+        const uint8_t* p = (const uint8_t*)data + pos + sizeof(header);
+        const uint8_t* end = p + header.payloadBytes;
+        int32_t timestamp = header.baseTimestamp;
+        int32_t trackingID = 0;
+        int32_t x = 0;
+        int32_t y = 0;
+
+        for(uint32_t i = 0; i < header.count; i++) {
+            uint32_t value;
+            if(p >= end) return false;
+            int type = *p++;
+            if(!getVarint(&p, end, &value)) return false;
+            timestamp += unzigzag(value);
+
+            if(type == RESET) {
+                // Time can restart after a reset, so only merge within an epoch
+                std::stable_sort(out.begin() + *epoch, out.end(), earlierMessage);
+                out.push_back(Message::Reset(timestamp));
+                *epoch = out.size();
+                continue;
+            } else if(type != STROKE_RECORD) {
+                return false;
+            }
+
+            uint32_t flags;
+            if(!getVarint(&p, end, &value)) return false;
+            trackingID += unzigzag(value);
+            if(!getVarint(&p, end, &flags)) return false;
+
+            int32_t last = timestamp;
+            if(flags & STROKE_SAMPLES) {
+                uint32_t sampleCount, segmentCount;
+                if(!getVarint(&p, end, &value)) return false;
+                x += unzigzag(value);
+                if(!getVarint(&p, end, &value)) return false;
+                y += unzigzag(value);
+                if(!getVarint(&p, end, &sampleCount)) return false;
+                if(!getVarint(&p, end, &segmentCount)) return false;
+                if(segmentCount > (size_t)(end - p)) return false;
+
+                segments.resize(segmentCount);
+                for(uint32_t k = 0; k < segmentCount; k++) {
+                    uint32_t fields[7];
+                    for(int f = 0; f < 7; f++) {
+                        if(!getVarint(&p, end, &fields[f])) return false;
+                    }
+                    StrokeSegment &segment = segments[k];
+                    segment.duration = fields[0];
+                    segment.x1 = unzigzag(fields[1]);
+                    segment.y1 = unzigzag(fields[2]);
+                    segment.x2 = unzigzag(fields[3]);
+                    segment.y2 = unzigzag(fields[4]);
+                    segment.x3 = unzigzag(fields[5]);
+                    segment.y3 = unzigzag(fields[6]);
+                    last += segment.duration;
+                }
+                regenerate(timestamp, trackingID, x, y, sampleCount, segments, sampleRate, out);
+            }
+            if(flags & STROKE_STOPPED) {
+                if(!getVarint(&p, end, &value)) return false;
+                out.push_back(Message::Stop(last + value, trackingID));
+            }
+        }
+        pos += sizeof(header) + header.payloadBytes;
+    }
+    return pos == len;
+}
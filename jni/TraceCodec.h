@@ -0,0 +1,89 @@
+#ifndef TRACE_CODEC
+#define TRACE_CODEC
+
+#include "touch_vcr.h"
+#include "Message.h"
+#include "StrokeFitter.h"
+#include <vector>
+
+enum TraceFormat {
+    FORMAT_TEXT,        // Lines written by Message::dump
+    FORMAT_RECORD,      // Raw MessageRecords
+    FORMAT_PACKED,      // Blocks of varint deltas, see below
+    FORMAT_STROKE,      // Blocks of fitted strokes, see below
+    FORMAT_CSV,         // Output only, the layouts from MessageFormat.h
+    FORMAT_JSON,
+    FORMAT_FIXED,
+    FORMAT_UNKNOWN
+};
+
+/* Packed blocks start with a PackedBlockHeader, followed by count records of:
+ *   type byte, zigzag varint timestamp delta, and for stop/sync the zigzag varint
+ *   tracking id delta, and for sync the x and y deltas.
+ * Deltas are against the previous record in the same block; the first record's
+ * timestamp is relative to baseTimestamp and everything else starts from zero.
+ * Blocks never depend on each other, so a trace can be split and encoded
+ * chunk by chunk and the blocks simply concatenated.
+ *
+ * Stroke blocks use the same header with STROKE_MAGIC, and count is the number
+ * of stroke and reset records.  A stroke is one tracking id's syncs up to its
+ * stop, fitted by StrokeFitter:
+ *   type byte (STROKE_RECORD), zigzag varint start time delta, zigzag varint
+ *   tracking id delta, varint flags (STROKE_STOPPED, STROKE_SAMPLES), then if it
+ *   has samples the zigzag varint start x and y deltas (against the previous
+ *   stroke's start), varint sample count and segment count, and each segment as
+ *   varint duration and six zigzag varint control point offsets; finally if it
+ *   stopped, the varint ms from the last sample to the stop.
+ * A reset is its type byte and time delta.  Decoding regenerates the syncs,
+ * either at a fixed rate or with as many samples as were recorded, and merges
+ * the strokes of all the blocks decoded together back into time order, one
+ * reset to the next.  Strokes still open at the end of a block simply continue
+ * in a new stroke in the next one. */
+struct PackedBlockHeader {
+    uint32_t magic;
+    uint32_t count;
+    uint32_t payloadBytes;
+    int32_t baseTimestamp;
+};
+
+class TraceCodec {
+public:
+    static const uint32_t PACKED_MAGIC = 0x4b505654;   // "TVPK"
+    static const uint32_t STROKE_MAGIC = 0x4b535654;   // "TVSK"
+    static const size_t PACKED_BLOCK_RECORDS = 4096;
+    static const double DEFAULT_MAX_ERROR;              // Pixels
+
+    static TraceFormat parseFormat(const char* name);
+    static bool canDecode(TraceFormat format);
+    // Written once at the start of the output, or NULL
+    static const char* header(TraceFormat format);
+
+    // Length of the longest prefix of data that holds only whole lines, records or
+    // blocks.  At the end of the input pass atEnd so a final unterminated line counts.
+    static size_t splitPoint(TraceFormat format, const char* data, size_t len, bool atEnd);
+
+    // Appends the messages in data, which must hold whole units.  Returns false if
+    // anything was malformed; the valid messages are still appended.  Strokes are
+    // regenerated at sampleRate Hz, or with their recorded sample count for 0.
+    static bool decode(TraceFormat format, const char* data, size_t len, std::vector<Message> &out,
+            int sampleRate = 0);
+
+    // Strokes are fitted to within maxError pixels of every sample
+    static void encode(TraceFormat format, const Message* msgs, size_t count, std::vector<char> &out,
+            double maxError = DEFAULT_MAX_ERROR);
+
+private:
+    static bool decodeText(const char* data, size_t len, std::vector<Message> &out);
+    static bool decodeRecords(const char* data, size_t len, std::vector<Message> &out);
+    static bool decodePacked(const char* data, size_t len, std::vector<Message> &out);
+    static void encodePacked(const Message* msgs, size_t count, std::vector<char> &out);
+    static bool decodeStrokes(const char* data, size_t len, std::vector<Message> &out, int sampleRate);
+    static bool decodeStrokeBlocks(const char* data, size_t len, std::vector<Message> &out, int sampleRate,
+            size_t* epoch);
+    static void encodeStrokes(const Message* msgs, size_t count, std::vector<char> &out, double maxError);
+    template<class Format>
+    static void encodeLines(const Message* msgs, size_t count, std::vector<char> &out);
+    static size_t blockSplitPoint(uint32_t magic, const char* data, size_t len, bool atEnd);
+};
+
+#endif // TRACE_CODEC
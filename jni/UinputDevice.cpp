@@ -0,0 +1,60 @@
+#include "UinputDevice.h"
+#include <linux/uinput.h>
+
+static const char* UINPUT_PATH = "/dev/uinput";
+
+UinputDevice::UinputDevice() : mFD(-1) {
+}
+
+UinputDevice::~UinputDevice() {
+    if(mFD >= 0) {
+        ioctl(mFD, UI_DEV_DESTROY);
+        close(mFD);
+    }
+}
+
+static void set_abs(uinput_user_dev* dev, int code, int32_t minimum, int32_t maximum) {
+    dev->absmin[code] = minimum;
+    dev->absmax[code] = maximum;
+}
+
+// Uses the uinput_user_dev setup, which older kernels than UI_DEV_SETUP understand.
+// Only what TouchPanel::buildFrame sends is advertised: a BTN_TOUCH that never goes
+// down would make Android take the contacts for hovering.
+bool UinputDevice::create(const char* name, const input_absinfo &xInfo, const input_absinfo &yInfo, int slotCount) {
+    mFD = open(UINPUT_PATH, O_WRONLY | O_NONBLOCK);
+    if(mFD < 0) {
+        fprintf(stderr, "could not open %s, %s\n", UINPUT_PATH, strerror(errno));
+        return false;
+    }
+
+    static const int absCodes[] = { ABS_MT_SLOT, ABS_MT_POSITION_X, ABS_MT_POSITION_Y, ABS_MT_TRACKING_ID,
+                                    ABS_MT_PRESSURE };
+    bool ok = ioctl(mFD, UI_SET_EVBIT, EV_SYN) == 0 &&
+              ioctl(mFD, UI_SET_EVBIT, EV_ABS) == 0 &&
+              ioctl(mFD, UI_SET_PROPBIT, INPUT_PROP_DIRECT) == 0;
+    for(size_t i = 0; ok && i < sizeof(absCodes)/sizeof(absCodes[0]); i++) {
+        ok = ioctl(mFD, UI_SET_ABSBIT, absCodes[i]) == 0;
+    }
+
+    uinput_user_dev dev;
+    memset(&dev, 0, sizeof(dev));
+    snprintf(dev.name, sizeof(dev.name), "%s", name);
+    dev.id.bustype = BUS_VIRTUAL;
+    dev.id.vendor = 0x1;
+    dev.id.product = 0x1;
+    dev.id.version = 1;
+    set_abs(&dev, ABS_MT_SLOT, 0, slotCount - 1);
+    set_abs(&dev, ABS_MT_POSITION_X, xInfo.minimum, xInfo.maximum);
+    set_abs(&dev, ABS_MT_POSITION_Y, yInfo.minimum, yInfo.maximum);
+    set_abs(&dev, ABS_MT_TRACKING_ID, 0, 65535);
+    set_abs(&dev, ABS_MT_PRESSURE, 0, 255);
+
+    if(!ok || write(mFD, &dev, sizeof(dev)) != (ssize_t)sizeof(dev) || ioctl(mFD, UI_DEV_CREATE) < 0) {
+        fprintf(stderr, "could not create uinput device %s, %s\n", name, strerror(errno));
+        close(mFD);
+        mFD = -1;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef UINPUT_DEVICE
+#define UINPUT_DEVICE
+
+#include "touch_vcr.h"
+
+/* A virtual multitouch panel created through /dev/uinput, speaking the slots
+ * protocol with the given axis ranges.  The device goes away when this does. */
+class UinputDevice {
+public:
+    UinputDevice();
+    ~UinputDevice();
+
+    bool create(const char* name, const input_absinfo &xInfo, const input_absinfo &yInfo, int slotCount);
+
+    // Events written here come out of the virtual device
+    inline int getFD() const { return mFD; }
+
+private:
+    UinputDevice(const UinputDevice&);
+    UinputDevice& operator=(const UinputDevice&);
+
+    int mFD;
+};
+
+#endif // UINPUT_DEVICE
@@ -2,14 +2,55 @@
 #include "TouchPanel.h"
 #include "InputMessenger.h"
 #include "Clock.h"
+#include "StreamServer.h"
+#include "ShmRing.h"
+#include "CaptureFilter.h"
+#include "Trace.h"
+#include "TraceCache.h"
+#include "ReplayScheduler.h"
+#include "TouchProfiler.h"
+#include "LoopPlayer.h"
+#include "StrokeWriter.h"
+#include "TraceCodec.h"
+#include "FlightRecorder.h"
+#include "ReplayCompiler.h"
+#include "UinputDevice.h"
+#include "FanoutPlayer.h"
+#include "TouchDaemon.h"
 
+#include <signal.h>
+#ifdef __ANDROID__
 #include "sys/system_properties.h"
+#endif
 
-bool VERBOSE = false;
 bool SCALE_NHD = false;
 const int MAX_PATH = 256;
+const int STREAM_QUEUE_LENGTH = 4096;
+const uint32_t DEFAULT_RING_CAPACITY = 65536;
+const int EVENT_BATCH = 64;
+const uint64_t DEFAULT_CACHE_MB = 64;
+const int SLOT_COUNT = 4;
 
-static struct pollfd ufds[2];
+// Touch panel, stdin, replay timer, then the stream server's listening socket and subscribers,
+// then the flight recorder's control socket and client
+static const int FIXED_FDS = 3;
+static struct pollfd ufds[FIXED_FDS + 1 + StreamServer::MAX_SUBSCRIBERS + 2];
+
+static volatile sig_atomic_t statsRequested = 0;
+static volatile sig_atomic_t quitRequested = 0;
+static volatile sig_atomic_t dumpRequested = 0;
+
+static void request_stats(int) {
+    statsRequested = 1;
+}
+
+static void request_quit(int) {
+    quitRequested = 1;
+}
+
+static void request_dump(int) {
+    dumpRequested = 1;
+}
 
 bool is_touch_device(const char *devname) 
 {
@@ -74,6 +115,65 @@ bool scan_devices(const char *dirname, char *devname)
     return false;
 }
 
+static nsecs_t earliest(nsecs_t a, nsecs_t b) {
+    return (a < 0 || (b >= 0 && b < a)) ? b : a;
+}
+
+// Earliest of the stdin/-p queue, the loop player, the compiled replay and the
+// fan-out targets, -1 if none has anything
+static nsecs_t next_deadline(InputMessenger* messenger, LoopPlayer* looper, CompiledReplay* compiled,
+                             FanoutPlayer* fanout, nsecs_t now) {
+    nsecs_t deadline = messenger->nextDeadline(now);
+    if( looper ) {
+        deadline = earliest(deadline, looper->nextDeadline(now));
+    }
+    if( compiled ) {
+        deadline = earliest(deadline, compiled->nextDeadline(now));
+    }
+    if( fanout ) {
+        deadline = earliest(deadline, fanout->nextDeadline(now));
+    }
+    return deadline;
+}
+
+// Keeps the device open and takes jobs on socketPath until told to quit
+static int run_daemon(const char* device, const char* socketPath, int screenWidth, int screenHeight,
+                      int rotation, bool flipX, bool flipY, TraceCache* cache) {
+    TouchVcr vcr(device, screenWidth, screenHeight);
+    vcr.setOrientation(rotation, flipX, flipY);
+    if( !vcr.open() || !vcr.start() ) {
+        return 1;
+    }
+    TouchDaemon daemon(&vcr, cache);
+    if( daemon.listen(socketPath) < 0 ) {
+        return 1;
+    }
+
+    signal(SIGUSR1, request_stats);
+    signal(SIGINT, request_quit);
+    signal(SIGTERM, request_quit);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd fds[TouchDaemon::MAX_POLL_FDS];
+    while( !quitRequested ) {
+        int nfds = daemon.fillPollFds(fds, TouchDaemon::MAX_POLL_FDS);
+        int res = poll(fds, nfds, daemon.timeout(Clock::getMonotonicNs()));
+        if( statsRequested ) {
+            statsRequested = 0;
+            daemon.dumpStats(stderr);
+            vcr.dumpStats(stderr);
+            if( cache ) {
+                cache->dumpStats(stderr);
+            }
+        }
+        if( res < 0 ) {
+            continue;
+        }
+        daemon.handlePollFds(fds, nfds);
+    }
+    return 0;
+}
+
 static void usage(int argc, char *argv[]) {
     fprintf(stderr, "Usage: %s [options] <device>\n", argv[0]);
     fprintf(stderr, "    -b: use binary formatted data (default is ASCII) (NOT IMPLEMENTED)\n");
@@ -82,6 +182,37 @@ static void usage(int argc, char *argv[]) {
     fprintf(stderr, "    -q: quit when stdin is closed (good for catting files) (NOT IMPLEMNTED)\n");
     fprintf(stderr, "    -x<width>: width of screen (default 720)\n");
     fprintf(stderr, "    -y<height>: height of screen (default 1280)\n");
+    fprintf(stderr, "    -r<degrees>: rotation of the screen relative to the panel (0, 90, 180, 270)\n");
+    fprintf(stderr, "    -f<x|y|xy>: flip the x and/or y axis after rotation\n");
+    fprintf(stderr, "    -u<path>: also serve the recording on a Unix socket ('@' for abstract)\n");
+    fprintf(stderr, "    -U<oldest|newest|disconnect>: what to drop when a subscriber falls behind\n");
+    fprintf(stderr, "    -m<path>[:<records>]: write binary records to a shared memory ring instead of stdout\n");
+    fprintf(stderr, "        (default 65536 records, at most 16777216)\n");
+    fprintf(stderr, "    -o<text|csv|jsonl|fixed>: layout of recorded messages and subscriber streams (default text)\n");
+    fprintf(stderr, "    -S[<px>]: record fitted strokes instead of text, within px of every sample (default %.1f)\n",
+            TraceCodec::DEFAULT_MAX_ERROR);
+    fprintf(stderr, "    -M<dir>[:<seconds>]: keep the last seconds (default 60) in memory instead of writing them out,\n");
+    fprintf(stderr, "        dumping them to dir on SIGUSR2\n");
+    fprintf(stderr, "    -T<path>: also take flight recorder dump commands on a Unix socket\n");
+    fprintf(stderr, "    -k: install a kernel event mask so unrecorded axes never wake us up\n");
+    fprintf(stderr, "    -R<left>,<top>,<right>,<bottom>: only record touches inside this screen region\n");
+    fprintf(stderr, "    -I<id>[,<id>...]: only record these tracking ids\n");
+    fprintf(stderr, "    -p<trace>: replay a trace file (in addition to anything on stdin)\n");
+    fprintf(stderr, "    -F<hz>: regenerate -p stroke traces at this rate (default: as recorded)\n");
+    fprintf(stderr, "    -C<dir>[:<MB>]: cache parsed -p traces in dir, evicting past the cap (default 64MB)\n");
+    fprintf(stderr, "    -L<count>[:<gap ms>]: replay the -p trace count times (0 for forever), gap between loops (default 500)\n");
+    fprintf(stderr, "    -J<ms>: start each loop up to this much late\n");
+    fprintf(stderr, "    -O<dx>,<dy>: shift each loop by a random offset of up to dx,dy\n");
+    fprintf(stderr, "    -X<file>: compile the -p trace into device frames for this device and orientation, then exit\n");
+    fprintf(stderr, "    -E<file>: replay frames compiled with -X\n");
+    fprintf(stderr, "    -N<count>[:<stagger ms>]: replay the -p trace to count new virtual devices instead of this one,\n");
+    fprintf(stderr, "        each starting stagger ms after the one before\n");
+    fprintf(stderr, "    -W<threads>: threads writing to -N devices (default: number of cpus)\n");
+    fprintf(stderr, "    -D<path>: stay running with the device open and take record and replay jobs on a Unix socket\n");
+    fprintf(stderr, "    -w<us>: busy-wait this long before each replayed frame (default 200)\n");
+    fprintf(stderr, "    -B<percent>: cap busy-waiting to this share of a core (default 10)\n");
+    fprintf(stderr, "    -P[<ms>]: profile the panel instead of recording, one summary per period (default 1000)\n");
+    fprintf(stderr, "Send SIGUSR1 to print subscriber, capture and replay statistics\n");
     fprintf(stderr, "If a device isn't specified, it will be inferred\n");
     fprintf(stderr, "from the product name\n");
 }
@@ -96,16 +227,59 @@ int main(int argc, char *argv[])
     char device[MAX_PATH];
     int pollres = 0;
     int res = 0;
-    input_event event;
+    input_event events[EVENT_BATCH];
+    Message msg;
     long current;
 
     // Default to thinking we have a NHD screen
     int screenWidth = 360;
     int screenHeight = 640;
+    int rotation = 0;
+    bool flipX = false;
+    bool flipY = false;
+    const char* socketPath = NULL;
+    DropPolicy dropPolicy = DROP_OLDEST;
+    StreamServer* server = NULL;
+    char* ringPath = NULL;
+    uint32_t ringCapacity = DEFAULT_RING_CAPACITY;
+    CaptureFilter* filter = NULL;
+    const char* tracePath = NULL;
+    char* cacheDir = NULL;
+    uint64_t cacheMB = DEFAULT_CACHE_MB;
+    nsecs_t spinWindow = ReplayScheduler::DEFAULT_SPIN_WINDOW;
+    int spinBudget = ReplayScheduler::DEFAULT_SPIN_BUDGET;
+    int profilePeriod = 0;
+    TouchProfiler* profiler = NULL;
+    bool looping = false;
+    uint32_t loopCount = 0;
+    int loopGap = LoopPlayer::DEFAULT_GAP_MS;
+    int loopJitter = 0;
+    const char* loopOffsets = NULL;
+    double strokeError = 0;
+    OutputFormat outputFormat = OUTPUT_TEXT;
+    char* flightDir = NULL;
+    int flightSeconds = FlightRecorder::DEFAULT_SECONDS;
+    const char* flightSocket = NULL;
+    FlightRecorder* flight = NULL;
+    int strokeRate = 0;
+    Trace trace;
+    LoopPlayer* looper = NULL;
+    const char* compilePath = NULL;
+    const char* compiledPath = NULL;
+    CompiledReplay* compiled = NULL;
+    int fanoutCount = 0;
+    int fanoutStagger = 0;
+    int fanoutThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    UinputDevice* fanoutDevices = NULL;
+    ReplayCompiler* fanoutFrames = NULL;
+    FanoutPlayer* fanout = NULL;
+    const char* daemonSocket = NULL;
 
+#ifdef __ANDROID__
     char product[PROP_VALUE_MAX];
     __system_property_get("ro.product.name",product);
     printf("Product: %s\n", product);
+#endif
 
     scan_devices("/dev/input", device);
     fprintf(stderr, "Detected multitouch device: %s\n", device);
@@ -113,7 +287,7 @@ int main(int argc, char *argv[])
     int c;
     opterr = 0;
     do {
-        c = getopt(argc, argv, "bdsh");
+        c = getopt(argc, argv, "bdsvhx:y:r:f:u:U:m:kR:I:p:C:w:B:P::L:J:O:S::F:o:M:T:X:E:N:W:D:");
         if (c == EOF)
             break;
         switch (c) {
@@ -135,6 +309,147 @@ int main(int argc, char *argv[])
         case 'y':
             screenHeight = atoi(optarg);
             break;
+        case 'r':
+            rotation = atoi(optarg);
+            break;
+        case 'f':
+            flipX = strchr(optarg, 'x') != NULL;
+            flipY = strchr(optarg, 'y') != NULL;
+            break;
+        case 'u':
+            socketPath = optarg;
+            break;
+        case 'U':
+            dropPolicy = StreamServer::parseDropPolicy(optarg);
+            break;
+        case 'm': {
+            ringPath = optarg;
+            char* sep = strrchr(optarg, ':');
+            if( sep ) {
+                *sep = '\0';
+                char* end;
+                unsigned long capacity = strtoul(sep + 1, &end, 10);
+                if( *end || capacity == 0 || capacity > ShmRing::MAX_CAPACITY ) {
+                    usage(argc, argv);
+                    exit(1);
+                }
+                ringCapacity = capacity;
+            }
+            break;
+        }
+        case 'k':
+            if( !filter ) filter = new CaptureFilter();
+            filter->setKernelMask(true);
+            break;
+        case 'R':
+            if( !filter ) filter = new CaptureFilter();
+            if( !filter->parseRegion(optarg) ) exit(1);
+            break;
+        case 'I':
+            if( !filter ) filter = new CaptureFilter();
+            if( !filter->parseTrackingIds(optarg) ) exit(1);
+            break;
+        case 'p':
+            tracePath = optarg;
+            break;
+        case 'w':
+            spinWindow = strtoll(optarg, NULL, 10) * 1000LL;
+            break;
+        case 'B':
+            spinBudget = atoi(optarg);
+            break;
+        case 'P':
+            profilePeriod = optarg ? atoi(optarg) : TouchProfiler::DEFAULT_PERIOD_MS;
+            if( profilePeriod <= 0 ) {
+                usage(argc, argv);
+                exit(1);
+            }
+            break;
+        case 'L': {
+            looping = true;
+            loopCount = strtoul(optarg, NULL, 10);
+            char* sep = strchr(optarg, ':');
+            if( sep ) {
+                loopGap = atoi(sep + 1);
+            }
+            if( loopGap < 0 ) {
+                usage(argc, argv);
+                exit(1);
+            }
+            break;
+        }
+        case 'J':
+            loopJitter = atoi(optarg);
+            break;
+        case 'O':
+            loopOffsets = optarg;
+            break;
+        case 'S':
+            strokeError = optarg ? atof(optarg) : TraceCodec::DEFAULT_MAX_ERROR;
+            if( strokeError <= 0 ) {
+                usage(argc, argv);
+                exit(1);
+            }
+            break;
+        case 'F':
+            strokeRate = atoi(optarg);
+            break;
+        case 'M': {
+            flightDir = optarg;
+            char* sep = strrchr(optarg, ':');
+            if( sep ) {
+                *sep = '\0';
+                flightSeconds = atoi(sep + 1);
+            }
+            if( flightSeconds <= 0 ) {
+                usage(argc, argv);
+                exit(1);
+            }
+            break;
+        }
+        case 'T':
+            flightSocket = optarg;
+            break;
+        case 'X':
+            compilePath = optarg;
+            break;
+        case 'E':
+            compiledPath = optarg;
+            break;
+        case 'N': {
+            fanoutCount = atoi(optarg);
+            char* sep = strchr(optarg, ':');
+            if( sep ) {
+                fanoutStagger = atoi(sep + 1);
+            }
+            if( fanoutCount <= 0 ) {
+                usage(argc, argv);
+                exit(1);
+            }
+            break;
+        }
+        case 'W':
+            fanoutThreads = atoi(optarg);
+            break;
+        case 'D':
+            daemonSocket = optarg;
+            break;
+        case 'o':
+            outputFormat = parseOutputFormat(optarg);
+            if( outputFormat == OUTPUT_UNKNOWN ) {
+                usage(argc, argv);
+                exit(1);
+            }
+            break;
+        case 'C': {
+            cacheDir = optarg;
+            char* sep = strrchr(optarg, ':');
+            if( sep ) {
+                *sep = '\0';
+                cacheMB = strtoull(sep + 1, NULL, 10);
+            }
+            break;
+        }
         }
     } while(1);
 
@@ -153,13 +468,75 @@ int main(int argc, char *argv[])
         screenWidth = 360;
         screenHeight = 640;
     }
-    touchPanel = new TouchPanel(device, 4, messenger, screenWidth, screenHeight);
+
+    if( daemonSocket ) {
+        TraceCache* cache = cacheDir ? new TraceCache(cacheDir, cacheMB * 1024 * 1024) : NULL;
+        int status = run_daemon(device, daemonSocket, screenWidth, screenHeight, rotation, flipX, flipY, cache);
+        delete cache;
+        return status;
+    }
+    touchPanel = new TouchPanel(device, SLOT_COUNT, messenger, screenWidth, screenHeight);
+    touchPanel->setOrientation(rotation, flipX, flipY);
     
-    ufds[0].fd = touchPanel->openDevice();
+    if( fanoutCount > 0 ) {
+        // Virtual panels as big as the screen, in the panel's orientation.  The
+        // first one also takes whatever arrives on stdin.
+        input_absinfo xInfo, yInfo;
+        memset(&xInfo, 0, sizeof(xInfo));
+        memset(&yInfo, 0, sizeof(yInfo));
+        bool sideways = rotation == 90 || rotation == 270;
+        xInfo.maximum = (sideways ? screenHeight : screenWidth) - 1;
+        yInfo.maximum = (sideways ? screenWidth : screenHeight) - 1;
+        fanoutDevices = new UinputDevice[fanoutCount];
+        for(int i = 0; i < fanoutCount; i++) {
+            char name[64];
+            snprintf(name, sizeof(name), "touch_vcr fan-out %d", i);
+            if( !fanoutDevices[i].create(name, xInfo, yInfo, SLOT_COUNT) ) {
+                return 1;
+            }
+        }
+        touchPanel->attachDevice(fanoutDevices[0].getFD(), true);
+        touchPanel->configureAxes(xInfo, yInfo);
+        ufds[0].fd = -1;
+    } else {
+        ufds[0].fd = touchPanel->openDevice();
+    }
     ufds[0].events = POLLIN;
 
+    if( filter ) {
+        filter->attach(ufds[0].fd);
+        touchPanel->setCaptureFilter(filter);
+    }
+
+    if( profilePeriod > 0 ) {
+        profiler = new TouchProfiler(STDOUT_FILENO, profilePeriod);
+    }
+
     messenger->setInFD( STDIN_FILENO );
-    messenger->setOutFD( STDOUT_FILENO );
+    if( ringPath ) {
+        ShmRing* ring = new ShmRing();
+        if( !ring->create(ringPath, ringCapacity) ) {
+            return 1;
+        }
+        messenger->setRing(ring);
+    } else if( flightDir ) {
+        flight = new FlightRecorder(flightDir, flightSeconds, 0);
+        if( !flight->start() ) {
+            return 1;
+        }
+        if( flightSocket && flight->listen(flightSocket) < 0 ) {
+            return 1;
+        }
+        messenger->setFlightRecorder(flight);
+    } else if( !profiler ) {
+        messenger->setOutFD( STDOUT_FILENO );
+        messenger->setFormat( outputFormat );
+    }
+    StrokeWriter* strokes = NULL;
+    if( strokeError > 0 && !ringPath && !flight && !profiler ) {
+        strokes = new StrokeWriter(STDOUT_FILENO, strokeError);
+        messenger->setStrokeWriter(strokes);
+    }
 
     // Make stdin non-blocking
     int flags = fcntl(STDIN_FILENO, F_GETFL, 0); /* get current file status flags */
@@ -169,35 +546,186 @@ int main(int argc, char *argv[])
     ufds[1].fd = STDIN_FILENO;
     ufds[1].events = POLLIN;
 
+    if( tracePath ) {
+        TraceCache* cache = NULL;
+        if( cacheDir ) {
+            cache = new TraceCache(cacheDir, cacheMB * 1024 * 1024);
+        }
+        if( !trace.load(tracePath, cache, strokeRate) ) {
+            return 1;
+        }
+        if( fanoutCount > 0 ) {
+            // Encoded once, every device gets the same frames
+            fanoutFrames = new ReplayCompiler();
+            fanoutFrames->build(trace, touchPanel);
+            fanout = new FanoutPlayer(fanoutFrames->frames(), fanoutFrames->events(), fanoutFrames->frameCount());
+            for(int i = 0; i < fanoutCount; i++) {
+                char name[32];
+                snprintf(name, sizeof(name), "device %d", i);
+                fanout->addTarget(fanoutDevices[i].getFD(), name, (nsecs_t)i * fanoutStagger * 1000000LL);
+            }
+            if( !fanout->start(fanoutThreads) ) {
+                return 1;
+            }
+        } else if( compilePath ) {
+            CompiledReplayHeader header;
+            if( !ReplayCompiler::compile(trace, touchPanel, compilePath, &header) ) {
+                return 1;
+            }
+            fprintf(stderr, "Compiled %d messages into %u frames, %u events (%d bytes) in %s\n",
+                    (int)trace.size(), header.frameCount, header.eventCount,
+                    (int)ReplayCompiler::fileSize(header), compilePath);
+            return 0;
+        } else if( looping ) {
+            looper = new LoopPlayer(trace, loopCount, loopGap);
+            looper->setJitter(loopJitter);
+            if( loopOffsets && !looper->parseOffsets(loopOffsets) ) {
+                return 1;
+            }
+        } else {
+            for(size_t i = 0; i < trace.size(); i++) {
+                if( trace.get(i, msg) ) {
+                    messenger->add_msg(msg);
+                }
+            }
+        }
+        if( cache ) {
+            cache->dumpStats(stderr);
+            delete cache;
+        }
+    } else if( looping || compilePath || fanoutCount > 0 ) {
+        fprintf(stderr, "-%c needs a trace, pass one with -p\n", looping ? 'L' : compilePath ? 'X' : 'N');
+        return 1;
+    }
+
+    if( compiledPath ) {
+        DeviceProfile profile;
+        touchPanel->getProfile(&profile);
+        compiled = new CompiledReplay();
+        if( !compiled->open(compiledPath, profile) ) {
+            return 1;
+        }
+    }
+
+    if( socketPath ) {
+        server = new StreamServer(STREAM_QUEUE_LENGTH, dropPolicy);
+        if( server->listen(socketPath) < 0 ) {
+            return 1;
+        }
+        server->setFormat(outputFormat);
+        messenger->setServer(server);
+    }
+    signal(SIGUSR1, request_stats);
+    signal(SIGINT, request_quit);
+    signal(SIGTERM, request_quit);
+    signal(SIGUSR2, request_dump);
+
+    ReplayScheduler scheduler(spinWindow, spinBudget);
+    ufds[2].fd = scheduler.open();
+    ufds[2].events = POLLIN;
+
     // Device discovery and setup (based on which phone this is)
     if(VERBOSE) printf("Starting input polling %d\n", clock.getTimestampStart());
 
-    int pollTimeout = -1;
-    int now = 0;
-    Message msg;
+    nsecs_t now = Clock::getMonotonicNs();
 
-    while(1) {
-        now = clock.getTimestampNow();
-        if(!messenger->isEmpty()) {
-            pollTimeout = messenger->dequeue(now, msg);
-            while( pollTimeout == 0 )  {
-                touchPanel->replay(msg, now);
-                pollTimeout = messenger->dequeue(now, msg);
-                if(VERBOSE) fprintf(stderr, "Set poll timeout to %d\n", pollTimeout);
+    while( !quitRequested ) {
+        // Play everything that's due as frames, then sleep until the next one
+        nsecs_t deadline = next_deadline(messenger, looper, compiled, fanout, now);
+        if( deadline >= 0 && deadline <= now ) {
+            scheduler.noteEmit(deadline, now);
+            while( messenger->dequeue(now, msg) )  {
+                touchPanel->replay(msg, now / 1000000LL);
+            }
+            while( looper && looper->dequeue(now, msg) ) {
+                touchPanel->replay(msg, now / 1000000LL);
+            }
+            touchPanel->flushFrame();
+            if( compiled ) {
+                compiled->emit(now, ufds[0].fd);
             }
+            if( fanout ) {
+                fanout->dispatch(now);
+            }
+            deadline = next_deadline(messenger, looper, compiled, fanout, now);
+        }
+        scheduler.arm(deadline);
+
+        int nfds = FIXED_FDS;
+        int serverFds = 0;
+        if( server ) {
+            serverFds = server->fillPollFds(ufds + nfds, sizeof(ufds)/sizeof(ufds[0]) - nfds);
+            nfds += serverFds;
+        }
+        int flightFds = 0;
+        if( flight ) {
+            flightFds = flight->fillPollFds(ufds + nfds, sizeof(ufds)/sizeof(ufds[0]) - nfds);
+            nfds += flightFds;
+        }
+        pollres = poll(ufds, nfds, -1);
+        now = Clock::getMonotonicNs();
+
+        if( statsRequested ) {
+            statsRequested = 0;
+            if( server ) {
+                server->dumpStats(stderr);
+            }
+            if( filter ) {
+                filter->dumpStats(stderr);
+            }
+            if( looper ) {
+                looper->dumpStats(stderr);
+            }
+            if( flight ) {
+                flight->dumpStats(stderr);
+            }
+            if( compiled ) {
+                compiled->dumpStats(stderr);
+            }
+            if( fanout ) {
+                fanout->dumpStats(stderr);
+            }
+            scheduler.dumpStats(stderr);
+        }
+        if( dumpRequested ) {
+            dumpRequested = 0;
+            if( flight ) {
+                flight->requestDump(NULL);
+            }
+        }
+        if( pollres < 0 ) {
+            // Interrupted, revents are not valid
+            continue;
+        }
+
+        // Next frame is close, spin the rest of the way and emit straight away.
+        // Everything else polled is still pending and gets handled right after.
+        if(ufds[2].revents & POLLIN) {
+            now = scheduler.waitForDeadline();
+            continue;
         }
-        pollres = poll(ufds, 2, pollTimeout);
 
         // Input from touch panel
         if(ufds[0].revents & POLLIN) {
             if(VERBOSE) fprintf(stderr, "Saw event\n");
-            res = read(ufds[0].fd, &event, sizeof(event));
-            if(res < (int)sizeof(event)) {
+            // Take everything that's queued in one go
+            res = read(ufds[0].fd, events, sizeof(events));
+            if(res < (int)sizeof(input_event)) {
                 fprintf(stderr, "could not get event\n");
                 return 1;
             }
             
-            touchPanel->process(&event);
+            int count = res / sizeof(input_event);
+            if( filter ) {
+                filter->noteEvents(events, count);
+            }
+            for(int i = 0; i < count; i++) {
+                if( profiler ) {
+                    profiler->process(&events[i]);
+                } else {
+                    touchPanel->process(&events[i]);
+                }
+            }
         }
 
         // Input from STDIN
@@ -210,9 +738,26 @@ int main(int argc, char *argv[])
         if(ufds[1].revents & POLLHUP) {
             ufds[1].fd = -1;
         }
+
+        // Subscriber connections and backlogged writes
+        if( server ) {
+            server->handlePollFds(ufds + FIXED_FDS, serverFds);
+        }
+        if( flight ) {
+            flight->handlePollFds(ufds + FIXED_FDS + serverFds, flightFds);
+        }
     
     }
 
+    // Strokes are only written once the finger lifts, so finish any in progress
+    if( strokes ) {
+        strokes->flush();
+    }
+    delete flight;
+    delete compiled;
+    delete fanout;
+    delete fanoutFrames;
+    delete[] fanoutDevices;
     return 0;
 }
 
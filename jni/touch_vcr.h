@@ -1,7 +1,9 @@
 #ifndef EVENTCAT_HEADER
 #define EVENTCAT_HEADER
 
+#ifdef __ANDROID__
 #include <jni.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,14 +15,23 @@
 #include <stdint.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
+#ifdef __ANDROID__
 #include <sys/limits.h>
+#else
+#include <limits.h>
+#endif
 #include <sys/poll.h>
 #include <time.h>
+#include <unistd.h>
 
 typedef int64_t nsecs_t;
 
+// Extra debugging on stderr, defined in the core library
+extern bool VERBOSE;
+
 // Stealing multitouch defines from the kernel since
-// the NDK seems to lack them
+// the NDK seems to lack them.  Host kernel headers already have them.
+#ifndef ABS_MT_SLOT
 #define EVIOCGMTSLOTS(len)      _IOC(_IOC_READ, 'E', 0x0a, len)
 
 #define ABS_MT_SLOT             0x2f    /* MT slot being modified */
@@ -36,13 +47,30 @@ typedef int64_t nsecs_t;
 #define ABS_MT_TRACKING_ID      0x39    /* Unique ID of initiated contact */
 #define ABS_MT_PRESSURE         0x3a    /* Pressure on contact area */
 #define ABS_MT_DISTANCE         0x3b    /* Contact hover distance */
+#endif
+
+// Per-client event masks (kernel 4.4) postdate the NDK headers too
+#ifndef EVIOCSMASK
+struct input_mask {
+    __u32 type;
+    __u32 codes_size;
+    __u64 codes_ptr;
+};
+#define EVIOCSMASK              _IOW('E', 0x93, struct input_mask)
+#endif
+
+#ifndef MSC_TIMESTAMP
+#define MSC_TIMESTAMP           0x05
+#endif
 
 /*
  * MT_TOOL types
  */
+#ifndef MT_TOOL_FINGER
 #define MT_TOOL_FINGER          0
 #define MT_TOOL_PEN             1
 #define MT_TOOL_MAX             1
+#endif
 
 /*
  * Synchronization events.
@@ -0,0 +1,281 @@
+#include "touch_vcr.h"
+#include "Message.h"
+#include "TraceCodec.h"
+
+#include <pthread.h>
+#include <vector>
+
+/* Converts trace files between formats.  The input is cut into chunks on record
+ * boundaries, the chunks are decoded and re-encoded on a pool of worker threads,
+ * and the results are written out in order.  Only a fixed number of chunks are in
+ * flight at once, so memory use doesn't depend on the input size. */
+
+static const size_t DEFAULT_CHUNK_SIZE = 4 << 20;
+static const int MAX_THREADS = 64;
+
+enum ChunkState {
+    CHUNK_FREE,
+    CHUNK_QUEUED,
+    CHUNK_RUNNING,
+    CHUNK_DONE
+};
+
+struct Chunk {
+    ChunkState state;
+    size_t seq;
+    bool ok;
+    std::vector<char> input;
+    std::vector<Message> msgs;
+    std::vector<char> output;
+};
+
+static TraceFormat inFormat;
+static TraceFormat outFormat;
+static double maxError = TraceCodec::DEFAULT_MAX_ERROR;
+static int sampleRate = 0;
+static Chunk* chunks;
+static int chunkCount;
+static bool finished = false;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+
+static void* worker(void*) {
+    pthread_mutex_lock(&lock);
+    while(1) {
+        // Oldest queued chunk first so the writer is never starved
+        Chunk* next = NULL;
+        for(int i = 0; i < chunkCount; i++) {
+            if(chunks[i].state == CHUNK_QUEUED && (!next || chunks[i].seq < next->seq)) {
+                next = &chunks[i];
+            }
+        }
+        if(!next) {
+            if(finished) break;
+            pthread_cond_wait(&workReady, &lock);
+            continue;
+        }
+        next->state = CHUNK_RUNNING;
+        pthread_mutex_unlock(&lock);
+
+        next->msgs.clear();
+        next->output.clear();
+        next->ok = TraceCodec::decode(inFormat, next->input.empty() ? NULL : &next->input[0],
+                next->input.size(), next->msgs, sampleRate);
+        TraceCodec::encode(outFormat, next->msgs.empty() ? NULL : &next->msgs[0], next->msgs.size(),
+                next->output, maxError);
+
+        pthread_mutex_lock(&lock);
+        next->state = CHUNK_DONE;
+        pthread_cond_broadcast(&workDone);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+// Fills chunk->input with carry plus up to chunkSize bytes, cut at the last whole
+// unit.  The leftover goes back into carry.  Returns false once input is exhausted.
+static bool read_chunk(int fd, Chunk* chunk, std::vector<char> &carry, size_t chunkSize, bool* eof) {
+    chunk->input.swap(carry);
+    carry.clear();
+
+    while(!*eof) {
+        size_t have = chunk->input.size();
+        if(have >= chunkSize) {
+            size_t split = TraceCodec::splitPoint(inFormat, &chunk->input[0], have, false);
+            if(split > 0) {
+                carry.assign(chunk->input.begin() + split, chunk->input.end());
+                chunk->input.resize(split);
+                return true;
+            }
+            // A single unit bigger than the chunk, keep reading
+            chunkSize *= 2;
+        }
+
+        chunk->input.resize(chunkSize);
+        ssize_t res = read(fd, &chunk->input[have], chunkSize - have);
+        if(res < 0 && errno == EINTR) {
+            chunk->input.resize(have);
+            continue;
+        }
+        if(res <= 0) {
+            if(res < 0) {
+                fprintf(stderr, "read failed, %s\n", strerror(errno));
+            }
+            chunk->input.resize(have);
+            *eof = true;
+        } else {
+            chunk->input.resize(have + res);
+        }
+    }
+    return !chunk->input.empty();
+}
+
+static bool write_all(int fd, const std::vector<char> &data) {
+    size_t done = 0;
+    while(done < data.size()) {
+        ssize_t res = write(fd, &data[done], data.size() - done);
+        if(res < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr, "write failed, %s\n", strerror(errno));
+            return false;
+        }
+        done += res;
+    }
+    return true;
+}
+
+static int64_t now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000LL;
+}
+
+static void usage(char *argv[]) {
+    fprintf(stderr, "Usage: %s [options] <in-format> <out-format> <input> <output>\n", argv[0]);
+    fprintf(stderr, "    formats: text, record, packed, stroke, and for output only csv, jsonl, fixed\n");
+    fprintf(stderr, "    input and output may be - for stdin/stdout\n");
+    fprintf(stderr, "    -j<threads>: worker threads (default: number of cpus)\n");
+    fprintf(stderr, "    -c<KB>: chunk size (default 4096)\n");
+    fprintf(stderr, "    -e<px>: largest error allowed when fitting strokes (default %.1f)\n", TraceCodec::DEFAULT_MAX_ERROR);
+    fprintf(stderr, "    -r<hz>: rate to regenerate strokes at (default: as many samples as were recorded)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t chunkSize = DEFAULT_CHUNK_SIZE;
+
+    int c;
+    while((c = getopt(argc, argv, "hj:c:e:r:")) != EOF) {
+        switch(c) {
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'c':
+            chunkSize = strtoul(optarg, NULL, 10) * 1024;
+            break;
+        case 'e':
+            maxError = atof(optarg);
+            break;
+        case 'r':
+            sampleRate = atoi(optarg);
+            break;
+        default:
+            usage(argv);
+            exit(1);
+        }
+    }
+    if(argc - optind != 4) {
+        usage(argv);
+        exit(1);
+    }
+
+    inFormat = TraceCodec::parseFormat(argv[optind]);
+    outFormat = TraceCodec::parseFormat(argv[optind + 1]);
+    if(!TraceCodec::canDecode(inFormat) || outFormat == FORMAT_UNKNOWN) {
+        usage(argv);
+        exit(1);
+    }
+    if(threads < 1) threads = 1;
+    if(threads > MAX_THREADS) threads = MAX_THREADS;
+    if(chunkSize < 4096) chunkSize = 4096;
+
+    const char* inPath = argv[optind + 2];
+    const char* outPath = argv[optind + 3];
+    int inFD = strcmp(inPath, "-") == 0 ? STDIN_FILENO : open(inPath, O_RDONLY);
+    int outFD = strcmp(outPath, "-") == 0 ? STDOUT_FILENO : open(outPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(inFD < 0 || outFD < 0) {
+        fprintf(stderr, "could not open %s, %s\n", inFD < 0 ? inPath : outPath, strerror(errno));
+        exit(1);
+    }
+
+    // Two chunks per worker keeps everybody busy while the writer catches up
+    chunkCount = threads * 2;
+    chunks = new Chunk[chunkCount];
+    for(int i = 0; i < chunkCount; i++) {
+        chunks[i].state = CHUNK_FREE;
+    }
+
+    pthread_t workers[MAX_THREADS];
+    for(int i = 0; i < threads; i++) {
+        pthread_create(&workers[i], NULL, worker, NULL);
+    }
+
+    int64_t start = now_ms();
+    bool ok = true;
+    const char* header = TraceCodec::header(outFormat);
+    if(header) {
+        ok = write_all(outFD, std::vector<char>(header, header + strlen(header)));
+    }
+    std::vector<char> carry;
+    bool eof = false;
+    size_t seqRead = 0;
+    size_t seqWrite = 0;
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    uint64_t messages = 0;
+    size_t badChunks = 0;
+
+    while(1) {
+        // Keep every free slot filled
+        while(!eof && seqRead - seqWrite < (size_t)chunkCount) {
+            Chunk* chunk = &chunks[seqRead % chunkCount];
+            if(!read_chunk(inFD, chunk, carry, chunkSize, &eof)) {
+                break;
+            }
+            bytesIn += chunk->input.size();
+
+            pthread_mutex_lock(&lock);
+            chunk->seq = seqRead++;
+            chunk->state = CHUNK_QUEUED;
+            pthread_cond_signal(&workReady);
+            pthread_mutex_unlock(&lock);
+        }
+        if(seqWrite == seqRead) {
+            break;
+        }
+
+        // Write out the oldest chunk as soon as it's done
+        Chunk* chunk = &chunks[seqWrite % chunkCount];
+        pthread_mutex_lock(&lock);
+        while(chunk->state != CHUNK_DONE) {
+            pthread_cond_wait(&workDone, &lock);
+        }
+        pthread_mutex_unlock(&lock);
+
+        if(!chunk->ok) {
+            badChunks++;
+        }
+        messages += chunk->msgs.size();
+        bytesOut += chunk->output.size();
+        if(ok && !write_all(outFD, chunk->output)) {
+            ok = false;
+        }
+        pthread_mutex_lock(&lock);
+        chunk->state = CHUNK_FREE;
+        pthread_mutex_unlock(&lock);
+        seqWrite++;
+    }
+
+    pthread_mutex_lock(&lock);
+    finished = true;
+    pthread_cond_broadcast(&workReady);
+    pthread_mutex_unlock(&lock);
+    for(int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    int64_t elapsed = now_ms() - start;
+    fprintf(stderr, "Converted %llu messages, %llu -> %llu bytes in %lld ms (%.1f MB/s, %d threads)\n",
+            (unsigned long long)messages, (unsigned long long)bytesIn, (unsigned long long)bytesOut,
+            (long long)elapsed, elapsed > 0 ? bytesIn / 1024.0 / 1024.0 / (elapsed / 1000.0) : 0.0, threads);
+    if(badChunks > 0) {
+        fprintf(stderr, "%d chunks had malformed input\n", (int)badChunks);
+        ok = false;
+    }
+
+    if(outFD != STDOUT_FILENO) close(outFD);
+    delete[] chunks;
+    return ok ? 0 : 1;
+}